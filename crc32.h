@@ -0,0 +1,18 @@
+#pragma once
+
+#include "types.h"
+
+// pass crc of the previous part as `previous` to continue it
+constexpr uint crc32(const ubyte* message, uint size, uint previous = 0) {
+    uint crc = ~previous;
+
+    for (uint i = 0; i < size; ++i) {
+        uint byte = message[i];            // Get next byte.
+        crc = crc ^ byte;
+        for (int j = 7; j >= 0; j--) {    // Do eight times.
+            uint mask = -(crc & 1);
+            crc = (crc >> 1) ^ (0xEDB88320 & mask);
+        }
+    }
+    return ~crc;
+}
@@ -0,0 +1,223 @@
+#include "descriptor_codec.h"
+#include "crc32.h"
+#include "net_utils.h"
+#include "protocols/logical_views.h"
+
+using namespace LogicalProto;
+
+
+// encoding
+static uint write_varint(ubyte* dst, uint value) {
+    uint size = 0;
+    do {
+        auto byte = (ubyte) (value & 0x7F);
+        value >>= 7;
+        if (value)
+            byte |= 0x80;
+        if (dst)
+            dst[size] = byte;
+        size++;
+    } while (value);
+    return size;
+}
+
+static uint write_string(ubyte* dst, const char* string, uint length) {
+    for (uint i = 0; i < DescriptorCodec::WELL_KNOWN_WORD_COUNT; ++i) {
+        auto word = DescriptorCodec::WELL_KNOWN_WORDS[i];
+        if (strlen(word) == length && !memcmp(word, string, length))
+            return write_varint(dst, (i << 1) | 1);
+    }
+
+    auto size = write_varint(dst, length << 1);
+    if (dst)
+        memcpy(dst + size, string, length);
+    return size + length;
+}
+
+uint DescriptorCodec::encode(ubyte* dst, DeviceClassEnum device_class, const char* name, uint name_len,
+                             const DeviceAttrib* attribs, ubyte attrib_count, const DeviceApiAction* actions,
+                             ubyte action_count) {
+    uint size = 0;
+    auto at = [&]() { return dst ? dst + size : nullptr; };
+
+    size += write_varint(at(), (uint) device_class);
+    size += write_string(at(), name, name_len);
+
+    size += write_varint(at(), attrib_count);
+    for (int i = 0; i < attrib_count; ++i) {
+        size += write_string(at(), attribs[i].name, attribs[i].name_len);
+        size += write_string(at(), attribs[i].value, attribs[i].value_len);
+    }
+
+    size += write_varint(at(), action_count);
+    for (int i = 0; i < action_count; ++i) {
+        if (dst)
+            dst[size] = (ubyte) actions[i].type;
+        size++;
+        size += write_string(at(), actions[i].name, actions[i].length);
+    }
+    return size;
+}
+
+
+// decoding
+class DescriptorReader
+{
+public:
+    DescriptorReader(const ubyte* ptr_, uint size) : ptr(ptr_), end(ptr_ + size) { }
+
+    bool read_varint(uint& value) {
+        value = 0;
+        for (int shift = 0; shift < 32; shift += 7) {
+            if (ptr >= end)
+                return false;
+            auto byte = *ptr++;
+            value |= (uint) (byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+
+    bool read_byte(ubyte& value) {
+        if (ptr >= end)
+            return false;
+        value = *ptr++;
+        return true;
+    }
+
+    // strings longer than 255 bytes can't be represented in HELLO_WORLD layout
+    bool read_string(std::string_view& string) {
+        uint code;
+        if (!read_varint(code))
+            return false;
+
+        if (code & 1) {
+            if ((code >> 1) >= DescriptorCodec::WELL_KNOWN_WORD_COUNT)
+                return false;
+            string = DescriptorCodec::WELL_KNOWN_WORDS[code >> 1];
+            return true;
+        }
+
+        auto length = code >> 1;
+        if (length > 255 || length > (uint) (end - ptr))
+            return false;
+        string = {(const char*) ptr, length};
+        ptr += length;
+        return true;
+    }
+
+    bool is_finished() const {
+        return ptr == end;
+    }
+
+private:
+    const ubyte* ptr;
+    const ubyte* end;
+};
+
+// walks over the descriptor calling `on_name`, `on_attrib` and `on_action`, returns false if it's malformed
+template <typename OnName, typename OnAttrib, typename OnAction>
+static bool parse_descriptor(const ubyte* src, uint size, uint& device_class, uint& attrib_count, uint& action_count,
+                             OnName&& on_name, OnAttrib&& on_attrib, OnAction&& on_action) {
+    DescriptorReader reader(src, size);
+
+    std::string_view name;
+    if (!reader.read_varint(device_class) || !reader.read_string(name) || !reader.read_varint(attrib_count))
+        return false;
+    if (attrib_count > 255)
+        return false;
+    on_name(name);
+
+    for (uint i = 0; i < attrib_count; ++i) {
+        std::string_view key, value;
+        if (!reader.read_string(key) || !reader.read_string(value))
+            return false;
+        on_attrib(key, value);
+    }
+
+    if (!reader.read_varint(action_count) || action_count > 255)
+        return false;
+
+    for (uint i = 0; i < action_count; ++i) {
+        ubyte type;
+        std::string_view name;
+        if (!reader.read_byte(type) || !reader.read_string(name))
+            return false;
+        on_action((ActionType) type, name);
+    }
+    return reader.is_finished();
+}
+
+bool DescriptorCodec::decode_to_hello_world(const ubyte* src, uint size, DescriptorPacket& packet) {
+    uint device_class, attrib_count, action_count;
+
+    // calculating HELLO_WORLD size and validating the descriptor
+    uint packet_size = LOG_PACKET_SIZE(hello_world);
+    auto is_valid = parse_descriptor(src, size, device_class, attrib_count, action_count,
+        [&](std::string_view name) { packet_size += name.size(); },
+        [&](std::string_view key, std::string_view value) {
+            packet_size += HelloWorldAttribItemLayout::size(key.size(), value.size());
+        },
+        [&](ActionType, std::string_view name) { packet_size += HelloWorldActionItemLayout::size(name.size()); });
+    if (!is_valid)
+        return false;
+
+    // writing HELLO_WORLD layout
+    packet.assign(packet_size, 0);
+    auto log = (LogicalPacket*) packet.data();
+    ListWriter writer(log->hello_world.name);
+    parse_descriptor(src, size, device_class, attrib_count, action_count,
+        [&](std::string_view name) {
+            net_store(log->hello_world.name_len, name.size());
+            writer.write_bytes(name.data(), name.size());
+        },
+        [&](std::string_view key, std::string_view value) {
+            writer.write_attrib(key.data(), key.size(), value.data(), value.size());
+        },
+        [&](ActionType type, std::string_view name) { writer.write_action(type, name.data(), name.size()); });
+
+    net_store(log->hello_world.device_class, device_class);
+    net_store(log->hello_world.special_attrib_count, attrib_count);
+    net_store(log->hello_world.action_count, action_count);
+    return true;
+}
+
+
+// descriptor cache
+DescriptorCache::DescriptorCache() {
+#if KHAWASU_STATIC_MEMORY
+    index.reserve(CAPACITY); // growing would leave outgrown bucket arrays in the arena
+#endif
+}
+
+DescriptorPacket* DescriptorCache::find(uint hash) {
+    auto iter = index.find(hash);
+    if (iter == index.end())
+        return nullptr;
+
+    entries.splice(entries.begin(), entries, iter->second);
+    return &iter->second->second;
+}
+
+DescriptorPacket* DescriptorCache::insert(uint hash, const ubyte* descriptor, uint size) {
+    if (crc32(descriptor, size) != hash)
+        return nullptr;
+
+    auto existing = find(hash);
+    if (existing)
+        return existing;
+
+    DescriptorPacket packet;
+    if (!DescriptorCodec::decode_to_hello_world(descriptor, size, packet))
+        return nullptr;
+
+    if (entries.size() >= CAPACITY) {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+
+    entries.emplace_front(hash, std::move(packet));
+    index[hash] = entries.begin();
+    return &entries.front().second;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "khawasu_config.h"
+#include "logical_device.h"
+#include "memory_accounting.h"
+
+// decoded descriptor, logical packet with HELLO_WORLD layout
+using DescriptorPacket = AccountedVector<ubyte, MemoryArea::DISCOVERY>;
+
+// compact descriptor format, version 1 (LogicalProto::DESCRIPTOR_FORMAT_VERSION):
+//  varint device class
+//  string name
+//  varint attribute count, then `string key, string value` for every attribute
+//  varint action count, then `ubyte type, string name` for every action
+// every string starts with a varint code:
+//  odd code - index of a well-known word in the shared dictionary (code >> 1), nothing follows
+//  even code - literal string of (code >> 1) bytes follows
+// varints are unsigned LEB128. descriptor hash is crc32 of the whole encoding
+
+namespace DescriptorCodec
+{
+    // shared dictionary, append-only: indices are a part of the protocol
+    constexpr const char* WELL_KNOWN_WORDS[] = {
+        "state", "toggle", "on", "off", "set", "get", "value", "level",
+        "brightness", "color", "temperature", "humidity", "pressure", "uptime", "time", "label",
+        "button", "relay", "led", "sensor", "controller", "location", "room", "model",
+        "version", "firmware", "hardware", "vendor", "name", "channel", "enabled", "interval",
+    };
+
+    constexpr uint WELL_KNOWN_WORD_COUNT = sizeof(WELL_KNOWN_WORDS) / sizeof(WELL_KNOWN_WORDS[0]);
+
+    // descriptors up to this size are sent inline with HELLO_WORLD_COMPACT, saving a round-trip
+    constexpr uint INLINE_LIMIT = 24;
+
+    // returns encoded size, writes nothing if `dst` is nullptr
+    uint encode(ubyte* dst, LogicalProto::DeviceClassEnum device_class, const char* name, uint name_len,
+                const DeviceAttrib* attribs, ubyte attrib_count, const DeviceApiAction* actions, ubyte action_count);
+
+    // decodes into a logical packet with HELLO_WORLD layout, so it can be passed to `on_device_discover`
+    // packet header (type, addresses) is left for the caller. returns false if the descriptor is malformed
+    bool decode_to_hello_world(const ubyte* src, uint size, DescriptorPacket& packet);
+}
+
+
+// decoded descriptors of remote devices by their hash, shared by all local devices
+class DescriptorCache
+{
+public:
+    static constexpr uint CAPACITY = KHAWASU_DESCRIPTOR_CACHE_SIZE;
+
+    DescriptorCache();
+
+    // returns logical packet with HELLO_WORLD layout or nullptr
+    DescriptorPacket* find(uint hash);
+
+    // verifies the hash and decodes the descriptor, returns nullptr if it's invalid
+    DescriptorPacket* insert(uint hash, const ubyte* descriptor, uint size);
+
+private:
+    using Entries = AccountedList<std::pair<uint, DescriptorPacket>, MemoryArea::DISCOVERY>;
+
+    Entries entries; // most recently used first
+    AccountedMap<uint, Entries::iterator, MemoryArea::DISCOVERY> index;
+};
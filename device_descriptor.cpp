@@ -0,0 +1,79 @@
+#include "device_descriptor.h"
+
+using namespace LogicalProto;
+
+
+void DeviceDescriptor::begin_update() {
+    arena.assign(1, '\0'); // empty name until `set_name`
+    name_ref = {};
+    pending_device_class = DeviceClassEnum::UNKNOWN;
+    attrib_refs.clear();
+    field_refs.clear();
+    action_refs.clear();
+}
+
+DeviceDescriptor::StringRef DeviceDescriptor::store(const char* string, uint length) {
+    StringRef ref{(uint) arena.size(), (ubyte) length};
+    arena.insert(arena.end(), string, string + length);
+    return ref;
+}
+
+bool DeviceDescriptor::set_name(const char* name, uint length) {
+    if (length > 255)
+        return false;
+
+    name_ref = store(name, length);
+    arena.push_back('\0'); // get_name returns a null-terminated string
+    return true;
+}
+
+void DeviceDescriptor::set_device_class(DeviceClassEnum device_class_) {
+    pending_device_class = device_class_;
+}
+
+bool DeviceDescriptor::add_attrib(const char* name, uint name_len, const char* value, uint value_len) {
+    if (name_len > 255 || value_len > 255 || attrib_refs.size() >= 255)
+        return false;
+
+    attrib_refs.push_back({store(name, name_len), store(value, value_len)});
+    return true;
+}
+
+bool DeviceDescriptor::add_api_field(const char* string, uint length) {
+    if (length > 255 || field_refs.size() >= 255)
+        return false;
+
+    field_refs.push_back(store(string, length));
+    return true;
+}
+
+bool DeviceDescriptor::add_api_action(ActionType type, const char* name, uint length) {
+    if (length > 255 || action_refs.size() >= 255)
+        return false;
+
+    action_refs.push_back({store(name, length), type});
+    return true;
+}
+
+void DeviceDescriptor::commit() {
+    if (arena.empty())
+        begin_update();
+
+    // arena doesn't move from here on, so the published lists may point into it
+    auto base = arena.data();
+    device_class = pending_device_class;
+
+    attribs.clear();
+    for (auto& ref : attrib_refs)
+        attribs.emplace_back(base + ref.name.offset, ref.name.length, base + ref.value.offset, ref.value.length);
+
+    api_fields.clear();
+    for (auto& ref : field_refs)
+        api_fields.emplace_back(base + ref.offset, ref.length);
+
+    api_actions.clear();
+    for (auto& ref : action_refs)
+        api_actions.emplace_back(ref.type, base + ref.name.offset, ref.name.length);
+
+    version++;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "logical_device.h"
+#include "memory_accounting.h"
+
+// descriptor of a device built at runtime (interpreters), owned by the device and pointed to by
+// `LogicalDevice::descriptor`. all strings live in a single arena which keeps its memory between versions,
+// so rebuilding the descriptor stops allocating once it reached its working size
+//
+// LogicalDevice reads it directly instead of calling get_* / free_* and serializes it once per version:
+//   descriptor.begin_update();
+//   descriptor.set_name(...); descriptor.add_attrib(...); descriptor.add_api_action(...); ...
+//   descriptor.commit();
+// previous version must not be read between `begin_update` and `commit`, so don't send packets in between
+class DeviceDescriptor
+{
+public:
+    // drops the content, keeps the memory
+    void begin_update();
+
+    // add_* / set_* return false if the string is longer than 255 bytes or the list is full (255 items)
+    bool set_name(const char* name, uint length);
+
+    void set_device_class(LogicalProto::DeviceClassEnum device_class_);
+
+    bool add_attrib(const char* name, uint name_len, const char* value, uint value_len);
+
+    bool add_api_field(const char* string, uint length);
+
+    bool add_api_action(LogicalProto::ActionType type, const char* name, uint length);
+
+    // publishes the new content and bumps the version
+    void commit();
+
+    // 0 until the first commit
+    inline uint get_version() const {
+        return version;
+    }
+
+    inline const char* get_name() const {
+        return version ? arena.data() + name_ref.offset : "";
+    }
+
+    inline LogicalProto::DeviceClassEnum get_device_class() const {
+        return device_class;
+    }
+
+    inline std::pair<DeviceAttrib*, ubyte> get_attribs() {
+        return {attribs.data(), attribs.size()};
+    }
+
+    inline std::pair<DeviceApiField*, ubyte> get_api_fields() {
+        return {api_fields.data(), api_fields.size()};
+    }
+
+    inline std::pair<DeviceApiAction*, ubyte> get_api_actions() {
+        return {api_actions.data(), api_actions.size()};
+    }
+
+protected:
+    // offsets into the arena are used while building, as the arena may move while growing
+    struct StringRef
+    {
+        uint offset;
+        ubyte length;
+    };
+
+    struct AttribRef
+    {
+        StringRef name;
+        StringRef value;
+    };
+
+    struct ActionRef
+    {
+        StringRef name;
+        LogicalProto::ActionType type;
+    };
+
+    StringRef store(const char* string, uint length);
+
+    AccountedVector<char, MemoryArea::DEVICES> arena;
+    StringRef name_ref{};
+    LogicalProto::DeviceClassEnum pending_device_class = LogicalProto::DeviceClassEnum::UNKNOWN;
+    AccountedVector<AttribRef, MemoryArea::DEVICES> attrib_refs;
+    AccountedVector<StringRef, MemoryArea::DEVICES> field_refs;
+    AccountedVector<ActionRef, MemoryArea::DEVICES> action_refs;
+
+    // published content, points into the arena
+    LogicalProto::DeviceClassEnum device_class = LogicalProto::DeviceClassEnum::UNKNOWN;
+    AccountedVector<DeviceAttrib, MemoryArea::DEVICES> attribs;
+    AccountedVector<DeviceApiField, MemoryArea::DEVICES> api_fields;
+    AccountedVector<DeviceApiAction, MemoryArea::DEVICES> api_actions;
+    uint version = 0;
+};
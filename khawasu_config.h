@@ -0,0 +1,131 @@
+#pragma once
+
+// build-time limits, override with compile definitions (target_compile_definitions / idf component flags)
+
+// subscriber slots of every logical device, see SubscriptionManager
+#ifndef KHAWASU_SUBSCRIBERS_PER_DEVICE
+#define KHAWASU_SUBSCRIBERS_PER_DEVICE 16
+#endif
+
+// recent ACTION_EXECUTE requests remembered for duplicate suppression, see ActionExecuteFlags::DEDUPLICATE
+#ifndef KHAWASU_EXECUTE_HISTORY_SIZE
+#define KHAWASU_EXECUTE_HISTORY_SIZE 32
+#endif
+
+// default queue limits (packets) of TxScheduler classes, adjustable at runtime with `TxScheduler::config`. packets
+// not fitting into the packet pool are taken from the heap, keep them small on constrained targets
+#ifndef KHAWASU_TX_QUEUE_INTERACTIVE
+#define KHAWASU_TX_QUEUE_INTERACTIVE 32
+#endif
+
+#ifndef KHAWASU_TX_QUEUE_NORMAL
+#define KHAWASU_TX_QUEUE_NORMAL 48
+#endif
+
+#ifndef KHAWASU_TX_QUEUE_BULK
+#define KHAWASU_TX_QUEUE_BULK 64
+#endif
+
+// default `TxScheduler::rate` (bytes per second). the fresh mesh doesn't tell when its radio is busy, without a limit
+// every packet would go to it right away and the tx classes would never take effect. zero disables the limit for
+// transports reporting their state with MeshTransport::get_ready_time
+#ifndef KHAWASU_TX_RATE
+#define KHAWASU_TX_RATE 16384
+#endif
+
+// bytes per second a node may send without loading its tx path, when TxScheduler has no rate limit. every such share
+// sent recently stretches non-strict subscription periods once more, see TxScheduler::get_pressure
+#ifndef KHAWASU_TX_NOMINAL_RATE
+#define KHAWASU_TX_NOMINAL_RATE 16384
+#endif
+
+// PreservedProperty values stored by PropertyStore with another schema are dropped. properties whose type changed
+// are detected by themselves (see get_property_type_id), change it to drop all stored values at once, e.g. when
+// the meaning of a value changes but its type doesn't
+#ifndef KHAWASU_PROPERTY_SCHEMA
+#define KHAWASU_PROPERTY_SCHEMA 1
+#endif
+
+// data partition of the default PropertyStore on ESP32, split into two banks
+#ifndef KHAWASU_PROPERTY_PARTITION
+#define KHAWASU_PROPERTY_PARTITION "khawasu"
+#endif
+
+// bank size of PropertyStore files and memory-only stores, bytes
+#ifndef KHAWASU_PROPERTY_BANK_SIZE
+#define KHAWASU_PROPERTY_BANK_SIZE 16384
+#endif
+
+// decoded descriptors of remote devices kept by every manager, see DescriptorCache. a descriptor includes the device
+// name, so size it to the devices whose descriptors local devices want (see LogicalDevice::wants_peer_descriptors)
+#ifndef KHAWASU_DESCRIPTOR_CACHE_SIZE
+#define KHAWASU_DESCRIPTOR_CACHE_SIZE 256
+#endif
+
+// descriptor fetches waiting for DESCRIPTOR_RESPONSE, per manager
+#ifndef KHAWASU_MAX_PENDING_REQUESTS
+#define KHAWASU_MAX_PENDING_REQUESTS 32
+#endif
+
+// serve the heap memory areas of the core (see memory_accounting.h) from static arenas sized by the capacities
+// below, so nothing is allocated from the heap after init
+#ifndef KHAWASU_STATIC_MEMORY
+#define KHAWASU_STATIC_MEMORY 0
+#endif
+
+// managers sharing the static arenas: one per physical device on firmware, the simulator hosts all its nodes in one
+// process. the capacities below are per manager
+#ifndef KHAWASU_MAX_MANAGERS
+#define KHAWASU_MAX_MANAGERS 1
+#endif
+
+// logical devices of every manager
+#ifndef KHAWASU_MAX_DEVICES
+#define KHAWASU_MAX_DEVICES 16
+#endif
+
+// packets queued in TxScheduler of every manager. with static memory packets over it are dropped like ones over
+// a class limit
+#ifndef KHAWASU_MAX_IN_FLIGHT_PACKETS
+#define KHAWASU_MAX_IN_FLIGHT_PACKETS 32
+#endif
+
+// largest packet in flight (bytes, with overlay header). packets not fitting into a packet pool part are taken from
+// the PACKETS area
+#ifndef KHAWASU_MAX_PACKET_SIZE
+#define KHAWASU_MAX_PACKET_SIZE 1024
+#endif
+
+// static arena sizes (bytes) derived from the capacities, blocks are rounded up to powers of two. compare them with
+// the peaks of `print_memory_report` when tuning
+#ifndef KHAWASU_ARENA_PACKETS
+#define KHAWASU_ARENA_PACKETS \
+    (KHAWASU_MAX_MANAGERS * KHAWASU_MAX_IN_FLIGHT_PACKETS * (2 * KHAWASU_MAX_PACKET_SIZE + 64))
+#endif
+
+// three deques of TxScheduler, their chunks and maps
+#ifndef KHAWASU_ARENA_TX_QUEUE
+#define KHAWASU_ARENA_TX_QUEUE (KHAWASU_MAX_MANAGERS * 4096)
+#endif
+
+// descriptors built at runtime, serialized descriptors and action caches take up to two kilobytes per device
+#ifndef KHAWASU_ARENA_DEVICES
+#define KHAWASU_ARENA_DEVICES (KHAWASU_MAX_MANAGERS * (KHAWASU_MAX_DEVICES * 2048 + 8192))
+#endif
+
+// a cached descriptor of a name, a few attributes and actions takes 384 bytes with its list and index nodes.
+// known peers (LogicalDeviceManager::KNOWN_PEERS_CAPACITY) and hash table buckets fit into the last part
+#ifndef KHAWASU_ARENA_DISCOVERY
+#define KHAWASU_ARENA_DISCOVERY \
+    (KHAWASU_MAX_MANAGERS * (KHAWASU_DESCRIPTOR_CACHE_SIZE * 384 + KHAWASU_MAX_PENDING_REQUESTS * 1024 + 32768))
+#endif
+
+// one store per physical device. the index only on ESP32, where values are read from the mapped partition,
+// elsewhere the store image (two banks) is kept in memory as well
+#ifndef KHAWASU_ARENA_PROPERTIES
+#ifdef ESP_PLATFORM
+#define KHAWASU_ARENA_PROPERTIES (KHAWASU_MAX_MANAGERS * 4096)
+#else
+#define KHAWASU_ARENA_PROPERTIES (KHAWASU_MAX_MANAGERS * (2 * KHAWASU_PROPERTY_BANK_SIZE + 4096))
+#endif
+#endif
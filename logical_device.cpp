@@ -1,42 +1,146 @@
 #include "logical_device.h"
 #include "logical_device_manager.h"
-#include "platform.h"
 #include "net_utils.h"
+#include "crc32.h"
+#include "descriptor_codec.h"
+#include "device_descriptor.h"
+#include <algorithm>
+#include <cmath>
 
 using namespace LogicalProto;
 using namespace OverlayProto;
 
 
 // subscription manager
-SubscriptionManager::Subscriber::Subscriber(LogicalAddress addr_, u64 end_time_, u64 next_upd_, uint period_, uint id_,
-                                            ushort action_id_)
-: addr(addr_), end_time(end_time_), next_periodic_update_time(next_upd_), period(period_), subscription_id(id_),
-action_id(action_id_) { }
-
 SubscriptionManager::SubscriptionManager(LogicalDevice* device_) : device(device_), self_update_next(0ull - 1) { }
 
-void SubscriptionManager::add_subscriber(SubscriptionStartPacket* packet, uint size, LogicalAddress addr) {
+SubscriptionDoneState SubscriptionManager::add_subscriber(SubscriptionStartPacket* packet, SubscriptionStartFlags flags,
+                                                         const ubyte* info_payload, uint info_size,
+                                                         LogicalAddress addr) {
+    if ((flags & SubscriptionStartFlags::HAS_FILTER) && info_size < sizeof(SubscriptionFilter))
+        return SubscriptionDoneState::INVALID_FORMAT;
     // todo validate size when extracting format data
-    for (auto& subscriber : subscribers) {
-        if (subscriber.subscription_id == net_load(packet->id) && subscriber.addr == addr) {
-            subscriber.end_time = KhawasuOsApi::get_microseconds() + net_load(packet->duration) * 1'000'000;
-            return;
-        }
-    }
 
+    auto sub_id = net_load(packet->id);
     auto packet_period = net_load(packet->period);
-    auto time = KhawasuOsApi::get_microseconds();
-    subscribers.emplace_back(addr,
-                             (u64) time + net_load(packet->duration) * 1'000'000,
-                             packet_period ? (u64) time + packet_period * 1'000 - 1 : (0ull - 1),
-                             (uint) packet_period,
-                             (uint) net_load(packet->id),
-                             (ushort) net_load(packet->action_id));
+    auto time = device->dev_manager->get_time();
+
+    // a renewed subscription takes the parameters of the new START, keeping what it has already sent
+    auto slot = find_subscriber(addr, sub_id);
+    auto renewed = slot >= 0;
+    if (!renewed) {
+        if (count >= CAPACITY)
+            return SubscriptionDoneState::CAPACITY_EXHAUSTED;
+
+        slot = count++;
+        subscribers[slot] = {};
+        subscribers[slot].addr = addr;
+        subscribers[slot].subscription_id = sub_id;
+        subscribers[slot].idle_stretch = 1;
+
+        auto pos = hash_key(addr, sub_id);
+        while (index[pos] != EMPTY_INDEX)
+            pos = (pos + 1) & (INDEX_SIZE - 1);
+        index[pos] = slot + 1;
+    }
+
+    auto& subscriber = subscribers[slot];
+    times[slot].end_time = time + net_load(packet->duration) * 1'000'000ull;
+    if (!renewed || packet_period != subscriber.period)
+        times[slot].next_periodic_update_time = packet_period ? time + packet_period * 1'000ull - 1 : (0ull - 1);
+
+    subscriber.period = packet_period;
+    subscriber.action_id = net_load(packet->action_id);
+    subscriber.flags = flags;
+    subscriber.filter = {};
+    if (flags & SubscriptionStartFlags::HAS_FILTER) {
+        auto filter = (const SubscriptionFilter*) info_payload;
+        subscriber.filter.value_format = net_load(filter->value_format);
+        subscriber.filter.value_offset = net_load(filter->value_offset);
+        subscriber.filter.flags = net_load(filter->flags);
+        subscriber.filter.dead_band = net_load(filter->dead_band);
+        subscriber.filter.min_interval = net_load(filter->min_interval);
+    }
+    return SubscriptionDoneState::OK;
+}
+
+void SubscriptionManager::renew_subscriptions(SubscriptionRenewPacket* packet, LogicalAddress addr) {
+    auto end_time = device->dev_manager->get_time() + net_load(packet->duration) * 1'000'000ull;
+    auto renew_count = net_load(packet->count);
+
+    for (int i = 0; i < renew_count; ++i) {
+        auto sub_id = net_load(packet->ids[i]);
+        auto slot = find_subscriber(addr, sub_id);
+        if (slot >= 0)
+            times[slot].end_time = end_time;
+        else
+            send_subscription_done(addr, sub_id, SubscriptionDoneState::NOT_FOUND);
+    }
+}
+
+void SubscriptionManager::send_subscription_done(LogicalAddress addr, uint sub_id, SubscriptionDoneState state) {
+    auto log = device->dev_manager->alloc_logical_packet_ptr(addr, device->self_port, 0,
+                                                             OverlayProtoType::UNRELIABLE,
+                                                             LogicalPacketType::SUBSCRIPTION_DONE);
+    net_store(log.ptr()->subscription_done.id, sub_id);
+    net_store(log.ptr()->subscription_done.state, state);
+    device->dev_manager->finish_ptr(log);
+}
+
+uint SubscriptionManager::hash_key(LogicalAddress addr, uint sub_id) {
+    auto hash = ((uint) addr.phy * 31 + addr.log) * 31 + sub_id;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash & (INDEX_SIZE - 1);
+}
+
+int SubscriptionManager::find_subscriber(LogicalAddress addr, uint sub_id) {
+    for (auto pos = hash_key(addr, sub_id); index[pos] != EMPTY_INDEX; pos = (pos + 1) & (INDEX_SIZE - 1)) {
+        auto slot = index[pos] - 1;
+        if (subscribers[slot].subscription_id == sub_id && subscribers[slot].addr == addr)
+            return slot;
+    }
+    return -1;
+}
+
+void SubscriptionManager::erase_subscriber(uint slot) {
+    auto remove_from_index = [this](uint pos) {
+        // backward shift deletion keeps probe chains intact without tombstones
+        auto next = (pos + 1) & (INDEX_SIZE - 1);
+        while (index[next] != EMPTY_INDEX) {
+            auto& moved = subscribers[index[next] - 1];
+            auto home = hash_key(moved.addr, moved.subscription_id);
+            if (((next - home) & (INDEX_SIZE - 1)) >= ((next - pos) & (INDEX_SIZE - 1))) {
+                index[pos] = index[next];
+                pos = next;
+            }
+            next = (next + 1) & (INDEX_SIZE - 1);
+        }
+        index[pos] = EMPTY_INDEX;
+    };
+    auto index_pos = [this](uint slot_) {
+        auto pos = hash_key(subscribers[slot_].addr, subscribers[slot_].subscription_id);
+        while (index[pos] != slot_ + 1)
+            pos = (pos + 1) & (INDEX_SIZE - 1);
+        return pos;
+    };
+
+    remove_from_index(index_pos(slot));
+
+    // filling the hole with the last subscriber
+    uint last = count - 1;
+    if (slot != last) {
+        index[index_pos(last)] = slot + 1;
+        times[slot] = times[last];
+        subscribers[slot] = subscribers[last];
+    }
+    count--;
 }
 
 void SubscriptionManager::set_self_update_period(u64 us_period) {
     self_update_period = us_period;
-    self_update_next = KhawasuOsApi::get_microseconds() + self_update_period;
+    self_update_next = device->dev_manager->get_time() + self_update_period;
 }
 
 void SubscriptionManager::stop_self_update() {
@@ -44,166 +148,554 @@ void SubscriptionManager::stop_self_update() {
 }
 
 void SubscriptionManager::stop_subscription(SubscriptionStopPacket* packet, LogicalAddress addr) {
-    auto iter = subscribers.begin();
-    while (iter != subscribers.end()) {
-        auto& subscriber = *iter;
-        if (subscriber.subscription_id == net_load(packet->id) && subscriber.addr == addr) {
-            subscribers.erase(iter++);
-            continue;
-        }
-        iter++;
-    }
+    auto slot = find_subscriber(addr, net_load(packet->id));
+    if (slot >= 0)
+        erase_subscriber(slot);
 }
 
 void SubscriptionManager::update_periodic() {
-    auto time = KhawasuOsApi::get_microseconds();
+    auto time = device->dev_manager->get_time();
 
-    if (time > self_update_next) {
+    if (time >= self_update_next) {
         device->on_timer_update();
         self_update_next += self_update_period;
     }
 
-    auto iter = subscribers.begin();
-    while (iter != subscribers.end()) {
-        auto& subscriber = *iter;
-        if (time >= subscriber.end_time) {
-            subscribers.erase(iter++);
+    // subscribers erased by the callbacks may make this pass skip one, it's served on the next tick
+    uint slot = 0;
+    while (slot < count) {
+        if (time >= times[slot].end_time) {
+            erase_subscriber(slot);
             continue;
         }
 
-        if (subscriber.next_periodic_update_time <= time) {
-            subscriber.next_periodic_update_time += subscriber.period * 1'000;
+        if (times[slot].next_periodic_update_time <= time) {
+            auto& subscriber = subscribers[slot];
+            times[slot].next_periodic_update_time += get_effective_period(subscriber) * 1'000ull;
             device->on_subscription_timer_update(subscriber.addr, subscriber.subscription_id, subscriber.action_id, nullptr); // todo feed format data here
         }
 
-        iter++;
+        slot++;
     }
 }
 
+u64 SubscriptionManager::get_next_deadline() {
+    auto deadline = self_update_next;
+    for (uint slot = 0; slot < count; ++slot)
+        deadline = std::min({deadline, times[slot].end_time, times[slot].next_periodic_update_time});
+    return deadline;
+}
+
 void SubscriptionManager::send_immediate_callback_data(ushort action_id, ubyte* data, uint size) {
-    for (auto& subscriber : subscribers) {
-        // todo store subscribers in map with key=action_id
+    SlicedPayload payload(data, size);
+    send_immediate_callback_data(action_id, payload);
+}
+
+void SubscriptionManager::send_immediate_callback_data(ushort action_id, PayloadSource& payload) {
+    auto time = device->dev_manager->get_time();
+
+    for (uint slot = 0; slot < count; ++slot) {
+        // todo index subscribers by action_id
+        auto& subscriber = subscribers[slot];
         if(subscriber.action_id != action_id)
             continue;
+        if (!pass_filter(subscriber, payload, time, false))
+            continue;
+
+        device->dev_manager->send_subscription_callback(subscriber.addr, device->self_port,
+                                                        subscriber.subscription_id, payload);
+    }
+}
+
+void SubscriptionManager::send_callback_data(LogicalAddress addr, uint sub_id, const ubyte* data, uint size) {
+    SlicedPayload payload(data, size);
+    send_callback_data(addr, sub_id, payload);
+}
+
+// crc of the parts, continued part by part
+class CrcSink : public PayloadSink
+{
+public:
+    uint crc = 0;
+
+    void write(const ubyte* data, uint size) override {
+        crc = crc32(data, size, crc);
+    }
+};
+
+static uint get_payload_crc(PayloadSource& payload) {
+    if (auto data = payload.get_contiguous())
+        return crc32(data, payload.get_size());
+
+    CrcSink sink;
+    payload.write_to(sink);
+    return sink.crc;
+}
+
+void SubscriptionManager::send_callback_data(LogicalAddress addr, uint sub_id, PayloadSource& payload) {
+    auto slot = find_subscriber(addr, sub_id);
+    if (slot < 0)
+        return;
+
+    auto& subscriber = subscribers[slot];
+    auto payload_crc = get_payload_crc(payload);
+    auto unchanged = payload_crc == subscriber.last_payload_crc;
+    // sent even if unchanged or within the dead-band, so the subscriber knows the notifier is alive
+    auto keep_alive = subscriber.suppressed_count >= MAX_SUPPRESSED_CALLBACKS;
+    if (!subscriber.is_strict() && unchanged && !keep_alive) {
+        // nothing new to tell, backing off until the payload changes
+        subscriber.suppressed_count++;
+        if (subscriber.idle_stretch < MAX_PERIOD_STRETCH)
+            subscriber.idle_stretch *= 2;
+        return;
+    }
+    if (!pass_filter(subscriber, payload, device->dev_manager->get_time(), keep_alive)) {
+        if (!keep_alive)
+            subscriber.suppressed_count++;
+        return;
+    }
+
+    subscriber.suppressed_count = 0;
+    if (!unchanged)
+        subscriber.idle_stretch = 1;
+    subscriber.last_payload_crc = payload_crc;
 
-        auto log = device->dev_manager->alloc_logical_packet_ptr(
-                subscriber.addr, device->self_port, size,
-                OverlayProtoType::UNRELIABLE, LogicalPacketType::SUBSCRIPTION_CALLBACK);
-        net_store(log.ptr()->subscription_callback.id, subscriber.subscription_id);
-        net_memcpy(log.ptr()->subscription_callback.payload, data, size);
-        device->dev_manager->finish_ptr(log);
+    device->dev_manager->send_subscription_callback(subscriber.addr, device->self_port, subscriber.subscription_id,
+                                                    payload);
+}
+
+// keeps the bytes at [offset, offset + sizeof(value)) of the parts
+class ValueWindowSink : public PayloadSink
+{
+public:
+    uint offset;
+    uint position = 0;
+    ubyte value[4];
+
+    explicit ValueWindowSink(uint offset_) : offset(offset_) { }
+
+    void write(const ubyte* data, uint size) override {
+        auto begin = std::max(offset, position);
+        auto end = std::min<uint>(offset + sizeof(value), position + size);
+        if (begin < end)
+            memcpy(value + (begin - offset), data + (begin - position), end - begin);
+        position += size;
+    }
+};
+
+template <typename T>
+static float load_filter_value(const ubyte* ptr) {
+    T value;
+    memcpy(&value, ptr, sizeof(T));
+    return (float) net_load(value);
+}
+
+bool SubscriptionManager::pass_filter(Subscriber& subscriber, PayloadSource& payload, u64 time, bool keep_alive) {
+    auto& filter = subscriber.filter;
+    if (subscriber.last_sent_time && time - subscriber.last_sent_time < filter.min_interval * 1'000ull)
+        return false;
+
+    auto size = payload.get_size();
+    auto value_left = size > filter.value_offset ? size - filter.value_offset : 0;
+    ValueWindowSink window(filter.value_offset);
+    const ubyte* value_ptr = window.value;
+    if (auto data = payload.get_contiguous())
+        value_ptr = data + filter.value_offset;
+    else if (filter.value_format != FilterValueFormat::NONE && value_left)
+        payload.write_to(window);
+
+    float value;
+    switch (filter.value_format) {
+        case FilterValueFormat::UINT8:   { value = value_left < 1 ? NAN : load_filter_value<ubyte>(value_ptr);   break; }
+        case FilterValueFormat::INT8:    { value = value_left < 1 ? NAN : load_filter_value<int8_t>(value_ptr);  break; }
+        case FilterValueFormat::UINT16:  { value = value_left < 2 ? NAN : load_filter_value<ushort>(value_ptr);  break; }
+        case FilterValueFormat::INT16:   { value = value_left < 2 ? NAN : load_filter_value<int16_t>(value_ptr); break; }
+        case FilterValueFormat::UINT32:  { value = value_left < 4 ? NAN : load_filter_value<uint>(value_ptr);    break; }
+        case FilterValueFormat::INT32:   { value = value_left < 4 ? NAN : load_filter_value<int32_t>(value_ptr); break; }
+        case FilterValueFormat::FLOAT32: { value = value_left < 4 ? NAN : load_filter_value<float>(value_ptr);   break; }
+        default: { value = NAN; break; }
+    }
+
+    // first value and values the filter can't read are always sent
+    if (subscriber.last_sent_time && !std::isnan(value) && !keep_alive) {
+        auto dead_band = (float) filter.dead_band / 1000.f;
+        if (filter.flags & SubscriptionFilterFlags::RELATIVE_DEAD_BAND)
+            dead_band *= std::fabs(subscriber.last_sent_value);
+        if (std::fabs(value - subscriber.last_sent_value) < dead_band)
+            return false;
+    }
+
+    subscriber.last_sent_value = std::isnan(value) ? subscriber.last_sent_value : value;
+    subscriber.last_sent_time = time;
+    return true;
+}
+
+uint SubscriptionManager::get_effective_period(const Subscriber& subscriber) {
+    if (subscriber.is_strict())
+        return subscriber.period;
+
+    // every unit of tx pressure stretches the period once more
+    auto stretch = std::max<uint>(1 + device->dev_manager->get_tx_pressure(), subscriber.idle_stretch);
+    return subscriber.period * std::min(stretch, MAX_PERIOD_STRETCH);
+}
+
+
+// action value cache
+ActionValueCache::Entry* ActionValueCache::find(ushort action_id) {
+    for (auto& entry : entries) {
+        if (entry.action_id == action_id)
+            return &entry;
     }
+    return nullptr;
 }
 
 
 // logical device
 LogicalDevice::LogicalDevice(LogicalDeviceManager* manager_, const char* name_, ushort port_)
-: self_port(port_), dev_manager(manager_), name(name_) { }
+: self_port(port_), dev_manager(manager_), name(name_), groups(manager_->property_store, port_, "khawasu_groups") { }
+
+PropertyStore* LogicalDevice::get_property_store() {
+    return dev_manager->property_store;
+}
 
 void LogicalDevice::post_init() {
-    send_hello_world(LogicalProto::LogicalPacketType::HELLO_WORLD, MeshProto::BROADCAST_FAR_ADDR, BROADCAST_PORT);
+    if (dev_manager->use_compact_discovery()) {
+        auto flags = dev_manager->known_peers.empty() ? HelloWorldCompactFlags::FRESH : (HelloWorldCompactFlags) 0;
+        send_hello_world_compact(flags, MeshProto::BROADCAST_FAR_ADDR, BROADCAST_PORT);
+    }
+    else
+        send_hello_world(LogicalProto::LogicalPacketType::HELLO_WORLD, MeshProto::BROADCAST_FAR_ADDR, BROADCAST_PORT);
 }
 
 void LogicalDevice::update() {
     //
 }
 
+u64 LogicalDevice::get_next_update_time() {
+    return 0;
+}
+
+static void write_hello_world(HelloWorldPacket& packet, DeviceClassEnum device_class, const char* name, ubyte name_len,
+                              const DeviceAttrib* attribs, ubyte attrib_cnt, const DeviceApiAction* actions,
+                              ubyte action_cnt) {
+    // writing packet parameters
+    net_store(packet.name_len, name_len);
+    net_store(packet.special_attrib_count, attrib_cnt);
+    net_store(packet.device_class, device_class);
+    net_store(packet.action_count, action_cnt);
+
+    // writing variable-length parameters
+    ListWriter writer(packet.name);
+    writer.write_bytes(name, name_len);  // without \0
+    for (int i = 0; i < attrib_cnt; ++i)
+        writer.write_attrib(attribs[i].name, attribs[i].name_len, attribs[i].value, attribs[i].value_len);
+    for (int i = 0; i < action_cnt; ++i)
+        writer.write_action(actions[i].type, actions[i].name, actions[i].length);
+}
+
+static void write_field_dictionary(FieldDictionaryResponsePacket& packet, const DeviceApiField* fields, ubyte field_cnt) {
+    net_store(packet.field_count, field_cnt);
+
+    ListWriter writer((ubyte*) packet.fields);
+    for (int i = 0; i < field_cnt; ++i)
+        writer.write_field(fields[i].string, fields[i].length); // without \0
+}
+
 void LogicalDevice::send_hello_world(LogicalPacketType type, MeshProto::far_addr_t dst_phy, ushort dst_port) {
+    if (auto cached = get_serialized_descriptor()) {
+        auto log = dev_manager->alloc_logical_packet_ptr({dst_phy, dst_port}, self_port,
+                                                         cached->hello_world.size() - sizeof(HelloWorldPacket),
+                                                         OverlayProtoType::UNRELIABLE, type);
+        memcpy(&log.ptr()->hello_world, cached->hello_world.data(), cached->hello_world.size());
+        dev_manager->finish_ptr(log);
+        return;
+    }
+
     // getting info
     auto name = get_name();
     auto [attribs, attrib_cnt] = get_attribs();
     auto [actions, action_cnt] = get_api_actions();
     auto name_len = strlen(name);
 
-    // calculating packet size
-    auto additional_size = name_len + sizeof(LogicalProto::HelloWorldPacket::HelloWorldDeviceAttrib) * attrib_cnt
-                                    + sizeof(LogicalProto::HelloWorldPacket::ActionData) * action_cnt;
-
-    for (int i = 0; i < attrib_cnt; ++i)
-        additional_size += attribs[i].name_len + attribs[i].value_len;
-
-    for (int i = 0; i < action_cnt; ++i)
-        additional_size += actions[i].length;
-
     // building packet
+    auto additional_size = hello_world_payload_size(name_len, attribs, attrib_cnt, actions, action_cnt);
     auto log = dev_manager->alloc_logical_packet_ptr({dst_phy, dst_port}, self_port, additional_size,
                                                      OverlayProtoType::UNRELIABLE, type);
+    write_hello_world(log.ptr()->hello_world, get_device_class(), name, name_len, attribs, attrib_cnt,
+                      actions, action_cnt);
 
-    // writing packet parameters
-    net_store(log.ptr()->hello_world.name_len, name_len);
-    net_store(log.ptr()->hello_world.special_attrib_count, attrib_cnt);
-    net_store(log.ptr()->hello_world.device_class, get_device_class());
-    net_store(log.ptr()->hello_world.action_count, action_cnt);
-    net_memcpy(log.ptr()->hello_world.name, name, name_len);  // without \0
+    dev_manager->finish_ptr(log);
+    free_api_actions(actions);
+    free_attribs(attribs);
+    free_name(name);
+}
 
-    // writing variable-length parameters
-    auto attrib_offset_byte = log.ptr()->hello_world.name + name_len;
-    for (int i = 0; i < attrib_cnt; ++i) {
-        auto attrib_offset = (HelloWorldPacket::HelloWorldDeviceAttrib*) attrib_offset_byte;
-        net_store(attrib_offset->key_len, attribs[i].name_len);
-        net_store(attrib_offset->value_len, attribs[i].value_len);
-        net_memcpy(attrib_offset->key, attribs[i].name, attribs[i].name_len);
-        net_memcpy(attrib_offset->value + attribs[i].name_len, attribs[i].value, attribs[i].value_len);
-
-        attrib_offset_byte = &attrib_offset->value[attribs[i].name_len + attribs[i].value_len];
+void LogicalDevice::send_field_dictionary(LogicalAddress dst_addr) {
+    if (auto cached = get_serialized_descriptor()) {
+        auto log = dev_manager->alloc_logical_packet_ptr(dst_addr, self_port, cached->field_dictionary.size()
+                                                         - sizeof(FieldDictionaryResponsePacket),
+                                                         OverlayProtoType::UNRELIABLE,
+                                                         LogicalPacketType::FIELD_DICTIONARY_RESPONSE);
+        memcpy(&log.ptr()->field_dictionary_response, cached->field_dictionary.data(), cached->field_dictionary.size());
+        dev_manager->finish_ptr(log);
+        return;
     }
 
-    // writing action data
-    auto action_offset_byte = attrib_offset_byte;
-    for (int i = 0; i < action_cnt; ++i) {
-        auto action_offset = (HelloWorldPacket::ActionData*) action_offset_byte;
-        net_store(action_offset->type, actions[i].type);
-        net_store(action_offset->name_length, actions[i].length);
-        net_memcpy(action_offset->name, actions[i].name, actions[i].length);
+    auto [fields, field_cnt] = get_api_fields();
 
-        action_offset_byte = &action_offset->name[actions[i].length];
-    }
+    // building packet
+    auto log = dev_manager->alloc_logical_packet_ptr(dst_addr, self_port, field_dictionary_payload_size(fields, field_cnt),
+                                                     OverlayProtoType::UNRELIABLE, LogicalPacketType::FIELD_DICTIONARY_RESPONSE);
+    write_field_dictionary(log.ptr()->field_dictionary_response, fields, field_cnt);
 
     dev_manager->finish_ptr(log);
+    free_api_fields(fields);
+}
+
+void LogicalDevice::build_compact_descriptor(DescriptorBuffer& descriptor) {
+    if (auto cached = get_serialized_descriptor()) {
+        descriptor = cached->compact;
+        return;
+    }
+
+    auto name = get_name();
+    auto [attribs, attrib_cnt] = get_attribs();
+    auto [actions, action_cnt] = get_api_actions();
+    auto name_len = strlen(name);
+    auto device_class = get_device_class();
+
+    descriptor.resize(DescriptorCodec::encode(nullptr, device_class, name, name_len, attribs, attrib_cnt,
+                                              actions, action_cnt));
+    DescriptorCodec::encode(descriptor.data(), device_class, name, name_len, attribs, attrib_cnt, actions, action_cnt);
+
     free_api_actions(actions);
     free_attribs(attribs);
     free_name(name);
 }
 
-void LogicalDevice::send_field_dictionary(LogicalAddress dst_addr) {
-    auto [fields, field_cnt] = get_api_fields();
-
-    auto additional_size = field_cnt * sizeof(FieldDictionaryResponsePacket::ApiFieldLayout);
-    for (int i = 0; i < field_cnt; ++i)
-        additional_size += fields[i].length;
+LogicalDevice::SerializedDescriptor* LogicalDevice::get_serialized_descriptor() {
+    if (!descriptor)
+        return nullptr;
+    if (serialized.version == descriptor->get_version())
+        return &serialized;
 
-    // building packet
-    auto log = dev_manager->alloc_logical_packet_ptr(dst_addr, self_port, additional_size,
-                                                     OverlayProtoType::UNRELIABLE, LogicalPacketType::FIELD_DICTIONARY_RESPONSE);
-    log.ptr()->field_dictionary_response.field_count = field_cnt;
+    auto name = descriptor->get_name();
+    auto name_len = strlen(name);
+    auto device_class = descriptor->get_device_class();
+    auto [attribs, attrib_cnt] = descriptor->get_attribs();
+    auto [fields, field_cnt] = descriptor->get_api_fields();
+    auto [actions, action_cnt] = descriptor->get_api_actions();
+
+    // vectors keep their capacity, so re-serializing a descriptor of the same size doesn't allocate
+    serialized.hello_world.resize(sizeof(HelloWorldPacket)
+                                  + hello_world_payload_size(name_len, attribs, attrib_cnt, actions, action_cnt));
+    write_hello_world(*(HelloWorldPacket*) serialized.hello_world.data(), device_class, name, name_len,
+                      attribs, attrib_cnt, actions, action_cnt);
+
+    serialized.field_dictionary.resize(sizeof(FieldDictionaryResponsePacket)
+                                       + field_dictionary_payload_size(fields, field_cnt));
+    write_field_dictionary(*(FieldDictionaryResponsePacket*) serialized.field_dictionary.data(), fields, field_cnt);
+
+    serialized.compact.resize(DescriptorCodec::encode(nullptr, device_class, name, name_len, attribs, attrib_cnt,
+                                                      actions, action_cnt));
+    DescriptorCodec::encode(serialized.compact.data(), device_class, name, name_len, attribs, attrib_cnt,
+                            actions, action_cnt);
+    serialized.compact_hash = crc32(serialized.compact.data(), serialized.compact.size());
+
+    serialized.version = descriptor->get_version();
+    return &serialized;
+}
 
-    // writing variable-length parameters
-    auto field_offset_byte = (ubyte*) log.ptr()->field_dictionary_response.fields;
-    for (int i = 0; i < field_cnt; ++i) {
-        auto field_write = (FieldDictionaryResponsePacket::ApiFieldLayout*) field_offset_byte;
-        net_store(field_write->length, fields[i].length);
-        net_memcpy(field_write->string, fields[i].string, fields[i].length); // without \0
-        field_offset_byte = field_write->string + fields[i].length;
+const DescriptorBuffer& LogicalDevice::get_compact_descriptor(DescriptorBuffer& storage, uint& hash) {
+    if (auto cached = get_serialized_descriptor()) {
+        hash = cached->compact_hash;
+        return cached->compact;
     }
 
+    build_compact_descriptor(storage);
+    hash = crc32(storage.data(), storage.size());
+    return storage;
+}
+
+void LogicalDevice::send_hello_world_compact(HelloWorldCompactFlags flags, MeshProto::far_addr_t dst_phy,
+                                             ushort dst_port) {
+    DescriptorBuffer storage;
+    uint hash;
+    auto& descriptor = get_compact_descriptor(storage, hash);
+
+    auto is_inline = descriptor.size() <= DescriptorCodec::INLINE_LIMIT;
+    if (is_inline)
+        flags = (HelloWorldCompactFlags) (flags | HelloWorldCompactFlags::HAS_DESCRIPTOR);
+
+    auto log = dev_manager->alloc_logical_packet_ptr({dst_phy, dst_port}, self_port, is_inline ? descriptor.size() : 0,
+                                                     OverlayProtoType::UNRELIABLE,
+                                                     LogicalPacketType::HELLO_WORLD_COMPACT);
+    net_store(log.ptr()->hello_world_compact.version, DESCRIPTOR_FORMAT_VERSION);
+    net_store(log.ptr()->hello_world_compact.flags, flags);
+    net_store(log.ptr()->hello_world_compact.descriptor_hash, hash);
+    if (is_inline)
+        net_memcpy(log.ptr()->hello_world_compact.descriptor, descriptor.data(), descriptor.size());
     dev_manager->finish_ptr(log);
-    free_api_fields(fields);
+}
+
+void LogicalDevice::send_descriptor(LogicalAddress dst_addr, uint hash) {
+    DescriptorBuffer storage;
+    uint actual_hash;
+    auto& descriptor = get_compact_descriptor(storage, actual_hash);
+    if (actual_hash != hash)
+        return; // descriptor has changed since it was announced
+
+    auto log = dev_manager->alloc_logical_packet_ptr(dst_addr, self_port, descriptor.size(),
+                                                     OverlayProtoType::UNRELIABLE,
+                                                     LogicalPacketType::DESCRIPTOR_RESPONSE);
+    net_store(log.ptr()->descriptor_response.descriptor_hash, hash);
+    net_memcpy(log.ptr()->descriptor_response.descriptor, descriptor.data(), descriptor.size());
+    dev_manager->finish_ptr(log);
+}
+
+void LogicalDevice::send_subscription_renew(LogicalAddress dst_addr, ushort duration, const uint* sub_ids, ubyte count) {
+    auto log = dev_manager->alloc_logical_packet_ptr(dst_addr, self_port, count * sizeof(uint),
+                                                     OverlayProtoType::UNRELIABLE, LogicalPacketType::SUBSCRIPTION_RENEW);
+    net_store(log.ptr()->subscription_renew.duration, duration);
+    net_store(log.ptr()->subscription_renew.count, count);
+    for (int i = 0; i < count; ++i)
+        net_store(log.ptr()->subscription_renew.ids[i], sub_ids[i]);
+
+    dev_manager->finish_ptr(log);
+}
+
+void LogicalDevice::set_action_cache_ttl(ushort action_id, u64 ttl) {
+    auto entry = action_cache.find(action_id);
+    if (ttl == 0) {
+        if (entry)
+            action_cache.entries.erase(action_cache.entries.begin() + (entry - action_cache.entries.data()));
+        return;
+    }
+
+    if (entry == nullptr) {
+        entry = &action_cache.entries.emplace_back();
+        entry->action_id = action_id;
+    }
+    entry->ttl = ttl;
+}
+
+void LogicalDevice::invalidate_action_cache(ushort action_id) {
+    if (auto entry = action_cache.find(action_id))
+        entry->expire_time = 0;
+}
+
+void LogicalDevice::handle_action_get(ushort action_id, const ubyte* data, uint size, LogicalAddress addr,
+                                      ubyte request_id) {
+    // fetches with arguments may return anything
+    auto entry = size == 0 ? action_cache.find(action_id) : nullptr;
+    if (entry == nullptr) {
+        on_action_get(action_id, data, size, addr, request_id);
+        return;
+    }
+
+    auto time = dev_manager->get_time();
+    if (time < entry->expire_time) {
+        dev_manager->send_action_response(addr, self_port, action_id, request_id, entry->status, entry->value.data(),
+                                          entry->value.size());
+        return;
+    }
+
+    auto is_reading = entry->read_time != 0 && time - entry->read_time < ActionValueCache::READ_TIMEOUT;
+    if (!is_reading) {
+        entry->read_time = time;
+        entry->waiter_count = 0; // requesters of the timed out read won't get the answer
+    }
+
+    if (entry->waiter_count < ActionValueCache::MAX_WAITERS)
+        entry->waiters[entry->waiter_count++] = {addr, request_id};
+    else if (is_reading) {
+        on_action_get(action_id, data, size, addr, request_id); // too many to wait, reading once more
+        return;
+    }
+
+    if (!is_reading)
+        on_action_get(action_id, data, size, addr, request_id);
+}
+
+void LogicalDevice::complete_action_get(ushort action_id, LogicalAddress dst_addr, ubyte request_id,
+                                        ActionExecuteStatus status, const ubyte* data, uint size) {
+    auto entry = action_cache.find(action_id);
+    if (entry == nullptr || entry->read_time == 0)
+        return;
+
+    // only the answer to a waiting fetch completes the read, answers to fetches with arguments aren't cached
+    auto waiter = std::find_if(entry->waiters, entry->waiters + entry->waiter_count, [&](auto& item) {
+        return item.addr == dst_addr && item.request_id == request_id;
+    });
+    if (waiter == entry->waiters + entry->waiter_count)
+        return;
+
+    entry->read_time = 0;
+    if (status == ActionExecuteStatus::SUCCESS) {
+        entry->status = status;
+        entry->value.assign(data, data + size);
+        entry->expire_time = dev_manager->get_time() + entry->ttl;
+    }
+
+    // the device answers one of the waiters itself, the rest get a copy. responses below don't complete anything
+    ActionValueCache::Waiter waiters[ActionValueCache::MAX_WAITERS];
+    auto waiter_count = entry->waiter_count;
+    std::copy(entry->waiters, entry->waiters + waiter_count, waiters);
+    entry->waiter_count = 0;
+
+    auto answered = false;
+    for (int i = 0; i < waiter_count; ++i) {
+        if (!answered && waiters[i].addr == dst_addr && waiters[i].request_id == request_id) {
+            answered = true;
+            continue;
+        }
+        dev_manager->send_action_response(waiters[i].addr, self_port, action_id, waiters[i].request_id, status, data,
+                                          size);
+    }
+}
+
+u64 LogicalDevice::get_broadcast_interest() {
+    return packet_type_bit(LogicalPacketType::ACTION_EXECUTE)
+         | packet_type_bit(LogicalPacketType::ACTION_FETCH)
+         | packet_type_bit(LogicalPacketType::HELLO_WORLD)
+         | packet_type_bit(LogicalPacketType::HELLO_WORLD_COMPACT)
+         | packet_type_bit(LogicalPacketType::FIELD_DICTIONARY_REQUEST)
+         | packet_type_bit(LogicalPacketType::GROUPS_LIST_REQUEST)
+         | packet_type_bit(LogicalPacketType::GROUPS_FIND_USERS_REQUEST);
 }
 
 bool LogicalDevice::on_general_packet_accept(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) {
     return true;
 }
 
+bool LogicalDevice::on_local_packet_accept(LogicalPacketType type, LogicalAddress src_addr) {
+    ubyte header_data[sizeof(LogicalPacket)];
+    auto header = (LogicalPacket*) header_data;
+    net_store(header->type, type);
+    net_store(header->src_addr, src_addr.log);
+    net_store(header->dst_addr, self_port);
+    return on_general_packet_accept(header, LogicalPacket::get_header_size(), src_addr.phy);
+}
+
+bool LogicalDevice::wants_peer_descriptors() {
+    return false;
+}
+
 void LogicalDevice::on_device_discover(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) {
     printf("default device discovery: im %d, i found %d (type %d)\n", self_port, net_load(packet->src_addr),
            (int) net_load(packet->hello_world.device_class));
 }
 
+void LogicalDevice::on_device_field_dictionary_view(const FieldDictionaryView& fields, MeshProto::far_addr_t src_phy) {
+    on_device_field_dictionary((FieldDictionaryResponsePacket::ApiFieldLayout*) fields.fields().data(),
+                               fields.fields().size(), src_phy);
+}
+
 void LogicalDevice::on_device_field_dictionary(FieldDictionaryResponsePacket::ApiFieldLayout* fields, ubyte count, MeshProto::far_addr_t src_phy) {
     //
 }
 
-void LogicalDevice::on_subscription_data(ubyte* data, uint size, LogicalAddress addr, uint sub_id) {
+void LogicalDevice::on_subscription_data(const ubyte* data, uint size, LogicalAddress addr, uint sub_id) {
     //
 }
 
@@ -211,25 +703,36 @@ void LogicalDevice::on_subscription_timer_update(LogicalAddress addr, uint sub_i
     //
 }
 
+void LogicalDevice::on_subscription_done(LogicalAddress addr, uint sub_id, SubscriptionDoneState state) {
+    //
+}
+
+void LogicalDevice::on_groups_list(const ushort* groups, ubyte count, LogicalAddress addr) {
+    //
+}
+
+void LogicalDevice::on_groups_find_users(const ushort* groups, ubyte count, LogicalAddress addr) {
+    //
+}
 
 const char* LogicalDevice::get_name() {
-    return name;
+    return descriptor ? descriptor->get_name() : name;
 }
 
 std::pair<DeviceAttrib*, ubyte> LogicalDevice::get_attribs() {
-    return {nullptr, 0};
+    return descriptor ? descriptor->get_attribs() : std::pair<DeviceAttrib*, ubyte>{nullptr, 0};
 }
 
 std::pair<DeviceApiField*, ubyte> LogicalDevice::get_api_fields() {
-    return {nullptr, 0};
+    return descriptor ? descriptor->get_api_fields() : std::pair<DeviceApiField*, ubyte>{nullptr, 0};
 }
 
 std::pair<DeviceApiAction*, ubyte> LogicalDevice::get_api_actions() {
-    return {nullptr, 0};
+    return descriptor ? descriptor->get_api_actions() : std::pair<DeviceApiAction*, ubyte>{nullptr, 0};
 }
 
 LogicalProto::DeviceClassEnum LogicalDevice::get_device_class() {
-    return LogicalProto::DeviceClassEnum::UNKNOWN;
+    return descriptor ? descriptor->get_device_class() : LogicalProto::DeviceClassEnum::UNKNOWN;
 }
 
 void LogicalDevice::free_name(const char* name) {
@@ -256,6 +759,10 @@ ActionExecuteStatus LogicalDevice::on_action_set(int action_id, const ubyte* dat
     return ActionExecuteStatus::UNKNOWN;
 }
 
+void LogicalDevice::on_action_set_result(int action_id, ActionExecuteStatus status, LogicalAddress addr, ubyte request_id) {
+    //
+}
+
 void LogicalDevice::on_action_get(int action_id, const ubyte* data, uint size, LogicalAddress addr, ubyte request_id) {
     //
 }
@@ -263,3 +770,13 @@ void LogicalDevice::on_action_get(int action_id, const ubyte* data, uint size, L
 void LogicalDevice::on_action_get_response(int action_id, const ubyte* data, uint size, LogicalAddress addr, ubyte request_id) {
     //
 }
+
+void LogicalDevice::on_action_batch_result(const ActionExecuteStatus* statuses, ubyte count,
+                                           MeshProto::far_addr_t src_phy, ubyte request_id) {
+    //
+}
+
+void LogicalDevice::on_action_multi_response(uint request_id, const ListView<ActionResponseItemLayout>& entries,
+                                             MeshProto::far_addr_t src_phy) {
+    //
+}
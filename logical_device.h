@@ -1,9 +1,15 @@
 #pragma once
 
 
+#include <algorithm>
 #include <cstring>
-#include <list>
+#include <bit>
 #include "protocols/logical_proto.h"
+#include "protocols/logical_views.h"
+#include "preserved_property.h"
+#include "payload_source.h"
+#include "memory_accounting.h"
+#include "khawasu_config.h"
 #include "types.h"
 #include <mesh_controller.h>
 
@@ -18,6 +24,9 @@ struct DeviceAttrib
     template<int name_len_, int value_len_>
     constexpr DeviceAttrib(const char (&name_)[name_len_], const char (&value_)[value_len_])
     : name(name_), value(value_), name_len(name_len_ - 1), value_len(value_len_ - 1) { }
+
+    DeviceAttrib(const char* name_, ubyte name_len_, const char* value_, ubyte value_len_)
+    : name(name_), value(value_), name_len(name_len_), value_len(value_len_) { }
 };
 
 
@@ -29,6 +38,8 @@ struct DeviceApiField
     template <int str_len_>
     constexpr DeviceApiField(const char (&string_)[str_len_])
             : string(string_), length(str_len_ - 1) { }
+
+    DeviceApiField(const char* string_, ubyte length_) : string(string_), length(length_) { }
 };
 
 struct DeviceApiAction
@@ -45,6 +56,9 @@ struct DeviceApiAction
     DeviceApiAction(const char* string_, LogicalProto::ActionType _type)
             : name(string_), length(strlen(string_)), type(_type) { }
 
+    DeviceApiAction(LogicalProto::ActionType _type, const char* string_, ubyte length_)
+            : name(string_), length(length_), type(_type) { }
+
 };
 
 
@@ -69,31 +83,123 @@ inline bool operator==(const LogicalAddress& a, const LogicalAddress& b) {
 }
 
 
+struct GroupMembership
+{
+    static constexpr ushort PROPERTY_TYPE_ID = 1; // see get_property_type_id
+    static constexpr ubyte MAX_GROUPS = 8;
+
+    ushort groups[MAX_GROUPS];
+    ubyte count;
+
+    inline bool contains(ushort group_id) const {
+        for (int i = 0; i < count; ++i) {
+            if (groups[i] == group_id)
+                return true;
+        }
+        return false;
+    }
+
+    // returns false if there's no space left or the id isn't a valid group id
+    inline bool add(ushort group_id) {
+        if (!LogicalProto::is_valid_group(group_id))
+            return false;
+        if (contains(group_id))
+            return true;
+        if (count >= MAX_GROUPS)
+            return false;
+        groups[count++] = group_id;
+        return true;
+    }
+
+    inline void remove(ushort group_id) {
+        for (int i = 0; i < count; ++i) {
+            if (groups[i] == group_id) {
+                groups[i] = groups[--count];
+                return;
+            }
+        }
+    }
+
+    // drops what a corrupted or foreign stored value may contain, returns true if anything was dropped
+    inline bool sanitize() {
+        auto stored_count = count;
+        count = 0;
+        for (int i = 0; i < std::min<int>(stored_count, MAX_GROUPS); ++i) {
+            if (LogicalProto::is_valid_group(groups[i]) && !contains(groups[i]))
+                groups[count++] = groups[i];
+        }
+        return count != stored_count;
+    }
+
+    inline bool operator==(const GroupMembership& other) const {
+        return count == other.count && !memcmp(groups, other.groups, count * sizeof(ushort));
+    }
+};
+
+
 class LogicalDevice;
 
+// subscribers live in fixed-size arrays inside the device, so their memory is known at build time and
+// subscribing never touches the heap. timing fields scanned every tick are kept apart from the rest
 class SubscriptionManager
 {
 public:
-    struct Subscriber
+    // subscriptions over this limit are rejected with SubscriptionDoneState::CAPACITY_EXHAUSTED
+    static constexpr uint CAPACITY = KHAWASU_SUBSCRIBERS_PER_DEVICE;
+    // non-strict periods are stretched at most by this factor
+    static constexpr uint MAX_PERIOD_STRETCH = 8;
+    // how many payloads in a row may be suppressed (unchanged or filtered out) before sending one anyway, so the
+    // subscriber knows the notifier is alive
+    static constexpr ubyte MAX_SUPPRESSED_CALLBACKS = 7;
+
+    static_assert(CAPACITY > 0 && CAPACITY < 255, "subscriber slots are indexed with ubyte");
+
+    // hot part, scanned by `update_periodic`
+    struct SubscriberTimes
     {
-        LogicalAddress addr;
         u64 end_time;                  // system time, us
         u64 next_periodic_update_time; // system time, us
+    };
+
+    // cold part, touched only when the subscriber is due or addressed
+    struct Subscriber
+    {
+        LogicalAddress addr;
         uint period;                   // delta time, ms
         uint subscription_id;
         ushort action_id;
-
-        Subscriber(LogicalAddress addr_, u64 end_time_, u64 next_upd_, uint period_, uint id_, ushort action_id_);
+        LogicalProto::SubscriptionStartFlags flags;
+        ubyte idle_stretch;            // period multiplier grown by suppressed unchanged payloads
+        ubyte suppressed_count;        // unchanged payloads suppressed in a row
+        uint last_payload_crc;
+        LogicalProto::SubscriptionFilter filter; // host byte order, zeroed if not requested
+        float last_sent_value;
+        u64 last_sent_time;            // system time, us
+
+        inline bool is_strict() const {
+            return !(flags & LogicalProto::SubscriptionStartFlags::STRETCHABLE_PERIOD);
+        }
     };
 
     LogicalDevice* device;
-    std::list<Subscriber> subscribers;
+    // slots [0, count) are used, removal moves the last subscriber into the freed slot
+    SubscriberTimes times[CAPACITY];
+    Subscriber subscribers[CAPACITY];
+    ubyte count = 0;
     u64 self_update_period;
     u64 self_update_next;
 
     explicit SubscriptionManager(LogicalDevice* device_);
 
-    void add_subscriber(LogicalProto::SubscriptionStartPacket* packet, uint size, LogicalAddress addr);
+    // returns the state sent back with SUBSCRIPTION_DONE. `flags` are zero for SUBSCRIPTION_START
+    LogicalProto::SubscriptionDoneState add_subscriber(LogicalProto::SubscriptionStartPacket* packet,
+                                                       LogicalProto::SubscriptionStartFlags flags,
+                                                       const ubyte* info_payload, uint info_size,
+                                                       LogicalAddress addr);
+
+    void renew_subscriptions(LogicalProto::SubscriptionRenewPacket* packet, LogicalAddress addr);
+
+    void send_subscription_done(LogicalAddress addr, uint sub_id, LogicalProto::SubscriptionDoneState state);
 
     void set_self_update_period(u64 us_period);
 
@@ -103,12 +209,83 @@ public:
 
     void send_immediate_callback_data(ushort action_id, ubyte* data, uint size);
 
+    // payload is serialized straight into every outgoing packet, see payload_source.h
+    void send_immediate_callback_data(ushort action_id, PayloadSource& payload);
+
+    // sends periodic callback data to a single subscriber, usually from `on_subscription_timer_update`
+    // unchanged payloads of non-strict subscriptions are suppressed
+    void send_callback_data(LogicalAddress addr, uint sub_id, const ubyte* data, uint size);
+
+    void send_callback_data(LogicalAddress addr, uint sub_id, PayloadSource& payload);
+
     void update_periodic();
+
+    // system time (us) of the earliest expiry, periodic update or self update, ~0 if there's nothing scheduled
+    u64 get_next_deadline();
+
+protected:
+    // open addressing over subscriber slots (slot + 1, zero is empty), at most half full
+    static constexpr uint INDEX_SIZE = std::bit_ceil(CAPACITY * 2);
+    static constexpr ubyte EMPTY_INDEX = 0;
+
+    ubyte index[INDEX_SIZE] = {};
+
+    static uint hash_key(LogicalAddress addr, uint sub_id);
+
+    // returns slot or -1
+    int find_subscriber(LogicalAddress addr, uint sub_id);
+
+    void erase_subscriber(uint slot);
+
+    uint get_effective_period(const Subscriber& subscriber);
+
+    // returns false if callback data must not be sent to this subscriber due to its filter
+    // only the filtered value is read from a non-contiguous payload. keep-alive callbacks skip the dead-band
+    bool pass_filter(Subscriber& subscriber, PayloadSource& payload, u64 time, bool keep_alive);
+};
+
+
+// opt-in cache of ACTION_FETCH responses without arguments, see `LogicalDevice::set_action_cache_ttl`
+// a fetch of a cached action is answered with the stored payload without calling `on_action_get`,
+// fetches arriving while a read is in flight wait for its response instead of starting another read
+class ActionValueCache
+{
+public:
+    static constexpr uint MAX_WAITERS = 8; // more concurrent fetches call `on_action_get` as usual
+    // a read not answered within this time is started again by the next fetch
+    static constexpr u64 READ_TIMEOUT = 1'000'000; // us
+
+    struct Waiter
+    {
+        LogicalAddress addr;
+        ubyte request_id;
+    };
+
+    struct Entry
+    {
+        ushort action_id;
+        u64 ttl;              // us
+        u64 expire_time = 0;  // system time, us. the value is valid before it
+        u64 read_time = 0;    // system time, us. zero if no read is in flight
+        LogicalProto::ActionExecuteStatus status = LogicalProto::ActionExecuteStatus::UNKNOWN;
+        AccountedVector<ubyte, MemoryArea::DEVICES> value;
+        ubyte waiter_count = 0;
+        Waiter waiters[MAX_WAITERS];
+    };
+
+    AccountedVector<Entry, MemoryArea::DEVICES> entries; // a few cached actions per device, searched linearly
+
+    // returns nullptr if the action isn't cached
+    Entry* find(ushort action_id);
 };
 
 
 class LogicalDeviceManager;
 
+// serialized descriptors of a device
+using DescriptorBuffer = AccountedVector<ubyte, MemoryArea::DEVICES>;
+class DeviceDescriptor;
+
 class LogicalDevice
 {
 public:
@@ -116,37 +293,108 @@ public:
     SubscriptionManager subscriptions{this};
     LogicalDeviceManager* dev_manager;
     const char* name;
+    PreservedProperty<GroupMembership> groups; // managed by LogicalDeviceManager
+    DeviceDescriptor* descriptor = nullptr; // owned by dynamic devices, see device_descriptor.h
+    ActionValueCache action_cache;
 
     LogicalDevice(LogicalDeviceManager* manager_, const char* name_, ushort port_);
 
     void post_init();
 
+    // store of `PROPERTY` members, the one of the manager
+    PropertyStore* get_property_store();
+
     // todo describe the meaning of these callback functions in comments
     virtual void update();
 
+    // system time (us) when `update` must be called next, used by LogicalDeviceManager::run_until
+    // default is 0: the device is polled on every run. return ~0 if `update` has nothing to do
+    virtual u64 get_next_update_time();
+
     virtual void send_hello_world(LogicalProto::LogicalPacketType type, MeshProto::far_addr_t dst_phy, ushort dst_port);
 
     virtual void send_field_dictionary(LogicalAddress dst_addr);
 
+    virtual void send_hello_world_compact(LogicalProto::HelloWorldCompactFlags flags, MeshProto::far_addr_t dst_phy,
+                                          ushort dst_port);
+
+    // answers DESCRIPTOR_REQUEST if `hash` is a hash of this device descriptor
+    virtual void send_descriptor(LogicalAddress dst_addr, uint hash);
+
+    // encodes this device descriptor in compact format, see descriptor_codec.h
+    void build_compact_descriptor(DescriptorBuffer& descriptor);
+
+    // caches successful responses to fetches of `action_id` without arguments for `ttl` us, zero ttl disables it
+    void set_action_cache_ttl(ushort action_id, u64 ttl);
+
+    // drops the cached value, call it when the value changes before its ttl ends
+    void invalidate_action_cache(ushort action_id);
+
+    // entry point of ACTION_FETCH handling, serves it from `action_cache` or calls `on_action_get`
+    void handle_action_get(ushort action_id, const ubyte* data, uint size, LogicalAddress addr, ubyte request_id);
+
+    // called by LogicalDeviceManager for every response sent by this device, completes a pending cached read
+    void complete_action_get(ushort action_id, LogicalAddress dst_addr, ubyte request_id,
+                             LogicalProto::ActionExecuteStatus status, const ubyte* data, uint size);
+
+    // renews leases of many subscriptions to the same notifier with a single packet
+    void send_subscription_renew(LogicalAddress dst_addr, ushort duration, const uint* sub_ids, ubyte count);
+
+    // packet types this device wants to receive when sent to BROADCAST_PORT, see `LogicalProto::packet_type_bit`
+    // by default action requests and the discovery and group requests the base device answers to
+    // call `LogicalDeviceManager::update_broadcast_interest` when it changes after the device was added
+    virtual u64 get_broadcast_interest();
+
     virtual bool on_general_packet_accept(LogicalProto::LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy); // return false to discard packet and not call other device methods
 
+    // same as `on_general_packet_accept` for same-node messages delivered without serialization. by default passes
+    // the packet header (without payload) to `on_general_packet_accept`, so filters by type or source apply to
+    // local messages as well. override it if `on_general_packet_accept` looks into payloads
+    virtual bool on_local_packet_accept(LogicalProto::LogicalPacketType type, LogicalAddress src_addr);
+
+    // return true to get descriptors of peers announced with HELLO_WORLD_COMPACT (fetching them if needed),
+    // otherwise use `LogicalDeviceManager::request_descriptor` to get them on demand
+    virtual bool wants_peer_descriptors();
+
+    // packet is already validated, use `LogicalProto::HelloWorldView::from_validated` to read it
     virtual void on_device_discover(LogicalProto::LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy);
 
+    // `fields` are already validated, default implementation calls `on_device_field_dictionary` with the raw layout
+    virtual void on_device_field_dictionary_view(const LogicalProto::FieldDictionaryView& fields, MeshProto::far_addr_t src_phy);
+
     virtual void on_device_field_dictionary(LogicalProto::FieldDictionaryResponsePacket::ApiFieldLayout* fields, ubyte count, MeshProto::far_addr_t src_phy);
 
-    // todo replace with const ubyte* data
-    virtual void on_subscription_data(ubyte* data, uint size, LogicalAddress addr, uint sub_id);
+    virtual void on_subscription_data(const ubyte* data, uint size, LogicalAddress addr, uint sub_id);
 
     virtual void on_subscription_timer_update(LogicalAddress addr, uint sub_id, ushort act_id, const void* format);
 
+    virtual void on_subscription_done(LogicalAddress addr, uint sub_id, LogicalProto::SubscriptionDoneState state);
+
+    // groups are in host byte order, GROUPS_LIST_RESPONSE
+    virtual void on_groups_list(const ushort* groups, ubyte count, LogicalAddress addr);
+
+    // groups are in host byte order, GROUPS_FIND_USERS_RESPONSE
+    virtual void on_groups_find_users(const ushort* groups, ubyte count, LogicalAddress addr);
+
     virtual void on_timer_update();
 
     virtual LogicalProto::ActionExecuteStatus on_action_set(int action_id, const ubyte* data, uint size, LogicalAddress addr);
 
+    virtual void on_action_set_result(int action_id, LogicalProto::ActionExecuteStatus status, LogicalAddress addr, ubyte request_id);
+
     virtual void on_action_get(int action_id, const ubyte* data, uint size, LogicalAddress addr, ubyte request_id);
 
     virtual void on_action_get_response(int action_id, const ubyte* data, uint size, LogicalAddress addr, ubyte request_id);
 
+    // statuses of ACTION_EXECUTE_BATCH entries in their order, the batch was executed by `src_phy`
+    virtual void on_action_batch_result(const LogicalProto::ActionExecuteStatus* statuses, ubyte count,
+                                        MeshProto::far_addr_t src_phy, ubyte request_id);
+
+    // responses to ACTION_FETCH_MULTI, may come in a few parts. entries carry the ports of responder devices
+    virtual void on_action_multi_response(uint request_id,
+                                          const LogicalProto::ListView<LogicalProto::ActionResponseItemLayout>& entries,
+                                          MeshProto::far_addr_t src_phy);
+
     virtual const char* get_name();
 
     virtual std::pair<DeviceAttrib*, ubyte> get_attribs();
@@ -164,6 +412,25 @@ public:
     virtual void free_api_fields(DeviceApiField*);
 
     virtual void free_api_actions(DeviceApiAction*);
+
+protected:
+    // serialized `descriptor`, rebuilt only when its version changes
+    struct SerializedDescriptor
+    {
+        uint version = ~0u;
+        DescriptorBuffer hello_world;      // HelloWorldPacket with its lists
+        DescriptorBuffer field_dictionary; // FieldDictionaryResponsePacket with its list
+        DescriptorBuffer compact;
+        uint compact_hash = 0;
+    };
+
+    SerializedDescriptor serialized;
+
+    // returns nullptr for devices without `descriptor`
+    SerializedDescriptor* get_serialized_descriptor();
+
+    // returns cached compact descriptor or builds it into `storage`
+    const DescriptorBuffer& get_compact_descriptor(DescriptorBuffer& storage, uint& hash);
 };
 
 
@@ -1,34 +1,48 @@
 #include "logical_device_manager.h"
 #include "net_utils.h"
+#include "protocols/logical_views.h"
+#include "platform.h"
+#include <algorithm>
 
 using namespace LogicalProto;
 using namespace OverlayProto;
 
-PoolMemoryAllocator<LOG_PACKET_POOL_ALLOC_PART_SIZE, LOG_PACKET_POOL_ALLOC_COUNT>*
-        OverlayPacketBuilder::log_ovl_packet_alloc = nullptr;
-
 
 // overlay builder
-OverlayPacketBuilder::OverlayPacketBuilder(MeshProto::far_addr_t dst_phy, uint size, OverlayProtoType ovl_type,
+OverlayPacketBuilder::OverlayPacketBuilder(LogicalPacketPool* pool_, MeshTransport* transport_,
+                                           MeshProto::far_addr_t dst_phy_, uint size_, OverlayProtoType ovl_type,
                                            void** user_write_addr_p)
-: mesh(*g_fresh_mesh, dst_phy, size + OverlayPacket::get_packet_size(ovl_type)),
-  packet((OverlayPacket*) log_ovl_packet_alloc->alloc(size + OverlayPacket::get_packet_size(ovl_type)))
+: pool(pool_), transport(transport_), dst_phy(dst_phy_), size(size_ + OverlayPacket::get_packet_size(ovl_type)),
+  packet((OverlayPacket*) pool->alloc(size))
 {
+    if (auto data = write_header(packet, ovl_type))
+        *user_write_addr_p = data;
+}
+
+ubyte* OverlayPacketBuilder::write_header(OverlayPacket* packet, OverlayProtoType ovl_type) {
     net_store(packet->type, ovl_type);
 
     switch (ovl_type) {
-        case OverlayProtoType::RELIABLE:   { *user_write_addr_p = packet->reliable.data;   break; }
-        case OverlayProtoType::UNRELIABLE: { *user_write_addr_p = packet->unreliable.data; break; }
-        default: { printf("OverlayPacketBuilder: unknown type\n"); break;}
+        case OverlayProtoType::RELIABLE:   return packet->reliable.data;
+        case OverlayProtoType::UNRELIABLE: return packet->unreliable.data;
+        default: { printf("OverlayPacketBuilder: unknown type\n"); return nullptr; }
     }
 }
 
 void OverlayPacketBuilder::send() {
-    mesh.write((ubyte*) packet, mesh.stream_size);
+    transport->send(dst_phy, (ubyte*) packet, size);
 }
 
 OverlayPacketBuilder::~OverlayPacketBuilder() {
-    log_ovl_packet_alloc->free(packet);
+    pool->free(packet, size);
+}
+
+void* OverlayPacketBuilder::operator new(size_t size) {
+    return memory_alloc(MemoryArea::PACKETS, size);
+}
+
+void OverlayPacketBuilder::operator delete(void* ptr, size_t size) {
+    memory_free(MemoryArea::PACKETS, ptr, size);
 }
 
 
@@ -50,33 +64,304 @@ LogicalPacketPtr LogicalDeviceManager::alloc_logical_packet_ptr(LogicalAddress d
     return packet;
 }
 
+void LogicalDeviceManager::dispatch_overlay_packet(const ubyte* data, uint size, MeshProto::far_addr_t src_phy) {
+    if (size < sizeof(OverlayProtoType))
+        return;
+
+    auto header_size = OverlayPacket::get_packet_size(net_load(((const OverlayPacket*) data)->type));
+    if (!header_size || header_size > size || size - header_size > 0xFFFF)
+        return;
+
+    // nothing on the receive path writes into the packet, it's non-const for the device callbacks only
+    dispatch_packet((LogicalPacket*) (data + header_size), size - header_size, src_phy);
+}
+
 void LogicalDeviceManager::dispatch_packet(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) {
-    if (LOG_PACKET_SIZE(dst_addr) > size)
+    Tick tick(this);
+    if (capture)
+        capture->record(CaptureDirection::RX, get_time(), src_phy, get_self_phy(), packet, size);
+
+    // validating once, no matter how many devices will receive the packet
+    if (!validate_packet(packet, size))
+        return;
+
+    dispatch_valid_packet(packet, size, src_phy);
+
+    if (packet->type == LogicalPacketType::HELLO_WORLD_COMPACT)
+        remember_peer(packet, src_phy);
+    else if (packet->type == LogicalPacketType::HELLO_WORLD && src_phy != get_self_phy())
+        legacy_peer_time = get_time();
+    flush_tx();
+}
+
+void LogicalDeviceManager::dispatch_valid_packet(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) {
+    if (packet->type == LogicalPacketType::ACTION_EXECUTE_BATCH) {
+        process_action_execute_batch(packet, src_phy);
+        return;
+    }
+    if (packet->type == LogicalPacketType::ACTION_FETCH_MULTI) {
+        process_action_fetch_multi(packet, src_phy);
         return;
+    }
 
     auto dst_addr = net_load(packet->dst_addr);
     if (dst_addr == BROADCAST_PORT) {
-        for (auto [_, device] : devices)
-            handle_packet(device, packet, size, src_phy);
+        auto type = (ubyte) packet->type;
+        if (type >= LOGICAL_PACKET_TYPE_COUNT)
+            return;
+
+        auto src_port = net_load(packet->src_addr);
+        auto is_self_phy = src_phy == get_self_phy();
+
+        // handlers may add or remove devices, see DispatchScope
+        DispatchScope scope(this);
+        auto& listeners = broadcast_listeners[type];
+        auto count = listeners.size();
+        for (size_t i = 0; i < count; ++i) {
+            auto device = listeners[i];
+            if (device == nullptr || (is_self_phy && device->self_port == src_port))
+                continue; // left meanwhile or sender of local broadcast
+            handle_valid_packet(device, packet, size, src_phy);
+        }
+    }
+    else if (is_group_port(dst_addr)) {
+        auto members = group_members.find(port_to_group(dst_addr));
+        if (members == group_members.end())
+            return;
+
+        // members joining meanwhile get the next packet, the ones leaving are cleared, see DispatchScope
+        DispatchScope scope(this);
+        auto& list = members->second;
+        auto count = list.size();
+        for (size_t i = 0; i < count; ++i) {
+            if (auto device = list[i])
+                handle_valid_packet(device, packet, size, src_phy);
+        }
     }
     else {
         auto device = lookup_device(dst_addr);
         if (device != nullptr)
-            handle_packet(device, packet, size, src_phy);
+            handle_valid_packet(device, packet, size, src_phy);
     }
 }
 
+static SystemClock system_clock; // stateless, safe to share
+
+LogicalDeviceManager::LogicalDeviceManager(MeshController& mesh)
+: own_transport(mesh), transport(&*own_transport), clock(&system_clock) {
+    reserve_memory();
+}
+
+LogicalDeviceManager::LogicalDeviceManager(MeshTransport* transport_)
+: transport(transport_), clock(&system_clock) {
+    reserve_memory();
+}
+
+void LogicalDeviceManager::reserve_memory() {
+#if KHAWASU_STATIC_MEMORY
+    // containers filled after init would grow on the way, leaving blocks of outgrown sizes in the arenas
+    discovery_replies.reserve(KHAWASU_MAX_DEVICES);
+    run_ports.reserve(KHAWASU_MAX_DEVICES);
+    known_peers.reserve(KNOWN_PEERS_CAPACITY);
+    descriptor_fetches.reserve(KHAWASU_MAX_PENDING_REQUESTS);
+#endif
+}
+
+LogicalDeviceManager::~LogicalDeviceManager() {
+    tx_scheduler.clear(); // queued packets are allocated from `packet_pool`
+}
+
+void LogicalDeviceManager::set_transport(MeshTransport* transport_) {
+    transport = transport_;
+}
+
+void LogicalDeviceManager::set_clock(Clock* clock_) {
+    clock = clock_;
+    if (tick_depth)
+        tick_time = clock->now_us();
+}
+
 void LogicalDeviceManager::add_device(LogicalDevice* device) {
+    if (is_group_port(device->self_port))
+        printf("LogicalDeviceManager: device port %d is in group port range\n", device->self_port);
+
+    auto membership = *device->groups;
+    if (membership.sanitize())
+        device->groups = membership;
+
     devices[device->self_port] = device;
+    index_groups(device);
+    index_broadcast_interest(device);
     device->post_init();
 }
 
 void LogicalDeviceManager::remove_device(LogicalDevice* device) {
+    discovery_replies.erase(device->self_port);
+    unindex_broadcast_interest(device);
+    unindex_groups(device);
     devices.erase(device->self_port);
 }
 
+void LogicalDeviceManager::update_broadcast_interest(LogicalDevice* device) {
+    unindex_broadcast_interest(device);
+    index_broadcast_interest(device);
+}
+
+void LogicalDeviceManager::index_broadcast_interest(LogicalDevice* device) {
+    auto interest = device->get_broadcast_interest();
+    for (int type = 0; type < LOGICAL_PACKET_TYPE_COUNT; ++type) {
+        if (interest & (1ull << type))
+            broadcast_listeners[type].push_back(device);
+    }
+}
+
+void LogicalDeviceManager::unindex_broadcast_interest(LogicalDevice* device) {
+    for (auto& listeners : broadcast_listeners) {
+        if (dispatch_depth) {
+            std::replace(listeners.begin(), listeners.end(), device, (LogicalDevice*) nullptr);
+            dispatch_lists_dirty = true;
+        } else
+            std::erase(listeners, device);
+    }
+}
+
+bool LogicalDeviceManager::join_group(LogicalDevice* device, ushort group_id) {
+    auto membership = *device->groups;
+    if (!membership.add(group_id))
+        return false;
+    set_groups(device, membership);
+    return true;
+}
+
+void LogicalDeviceManager::leave_group(LogicalDevice* device, ushort group_id) {
+    auto membership = *device->groups;
+    membership.remove(group_id);
+    set_groups(device, membership);
+}
+
+void LogicalDeviceManager::set_groups(LogicalDevice* device, const GroupMembership& membership) {
+    unindex_groups(device);
+    device->groups = membership;
+    index_groups(device);
+}
+
+void LogicalDeviceManager::index_groups(LogicalDevice* device) {
+    auto& membership = *device->groups;
+    for (int i = 0; i < membership.count; ++i)
+        group_members[membership.groups[i]].push_back(device);
+}
+
+void LogicalDeviceManager::unindex_groups(LogicalDevice* device) {
+    auto& membership = *device->groups;
+    for (int i = 0; i < membership.count; ++i) {
+        auto members = group_members.find(membership.groups[i]);
+        if (members == group_members.end())
+            continue;
+
+        if (dispatch_depth) {
+            std::replace(members->second.begin(), members->second.end(), device, (LogicalDevice*) nullptr);
+            dispatch_lists_dirty = true;
+            continue;
+        }
+
+        std::erase(members->second, device);
+        if (members->second.empty())
+            group_members.erase(members);
+    }
+}
+
+void LogicalDeviceManager::compact_dispatch_lists() {
+    dispatch_lists_dirty = false;
+    for (auto& listeners : broadcast_listeners)
+        std::erase(listeners, nullptr);
+    for (auto members = group_members.begin(); members != group_members.end();) {
+        std::erase(members->second, nullptr);
+        if (members->second.empty())
+            members = group_members.erase(members);
+        else
+            ++members;
+    }
+}
+
+void LogicalDeviceManager::send_groups_list(LogicalDevice* device, LogicalPacketType type, const ushort* groups,
+                                            ubyte count, LogicalAddress dst_addr) {
+    // every groups packet shares the same layout
+    auto log = alloc_logical_packet_ptr(dst_addr, device->self_port, count * sizeof(ushort),
+                                        OverlayProtoType::UNRELIABLE, type);
+    net_store(log.ptr()->groups_list_response.groups_count, count);
+    for (int i = 0; i < count; ++i)
+        net_store(log.ptr()->groups_list_response.groups[i], groups[i]);
+    finish_ptr(log);
+}
+
+bool LogicalDeviceManager::validate_packet(LogicalPacket* packet, ushort size) {
+    if (LOG_PACKET_SIZE(dst_addr) > size)
+        return false;
+
+    auto type = packet->type;
+    // packets without fields have non-zero struct size, but nothing to check
+    if (type == LogicalPacketType::FIELD_DICTIONARY_REQUEST || type == LogicalPacketType::GROUPS_LIST_REQUEST)
+        return true;
+    if (LogicalPacket::get_packet_size(type) > size)
+        return false;
+
+    switch (type) {
+        case LogicalPacketType::HELLO_WORLD:
+        case LogicalPacketType::HELLO_WORLD_RESPONSE: {
+            return HelloWorldView(packet, size).is_valid();
+        }
+        case LogicalPacketType::FIELD_DICTIONARY_RESPONSE: {
+            return FieldDictionaryView(packet, size).is_valid();
+        }
+        case LogicalPacketType::GROUPS_LIST_RESPONSE:
+        case LogicalPacketType::GROUPS_ADD:
+        case LogicalPacketType::GROUPS_EDIT:
+        case LogicalPacketType::GROUPS_REMOVE:
+        case LogicalPacketType::GROUPS_FIND_USERS_REQUEST:
+        case LogicalPacketType::GROUPS_FIND_USERS_RESPONSE: {
+            // all these packets share the same layout
+            auto groups_count = net_load(packet->groups_list_response.groups_count);
+            return LOG_PACKET_SIZE(groups_list_response) + groups_count * sizeof(ushort) <= size;
+        }
+        case LogicalPacketType::SUBSCRIPTION_RENEW: {
+            return LOG_PACKET_SIZE(subscription_renew) + net_load(packet->subscription_renew.count) * sizeof(uint) <= size;
+        }
+        case LogicalPacketType::ACTION_EXECUTE_BATCH: {
+            auto& batch = packet->action_execute_batch;
+            return validate_list<ActionEntryItemLayout>(batch.entries, (ubyte*) packet + size,
+                                                        net_load(batch.entries_count));
+        }
+        case LogicalPacketType::ACTION_FETCH_MULTI: {
+            auto& fetch = packet->action_fetch_multi;
+            return validate_list<ActionEntryItemLayout>(fetch.entries, (ubyte*) packet + size,
+                                                        net_load(fetch.entries_count));
+        }
+        case LogicalPacketType::ACTION_RESPONSE_MULTI: {
+            auto& response = packet->action_response_multi;
+            return validate_list<ActionResponseItemLayout>(response.entries, (ubyte*) packet + size,
+                                                           net_load(response.entries_count));
+        }
+        case LogicalPacketType::ACTION_EXECUTE_BATCH_RESULT: {
+            auto entries_count = net_load(packet->action_execute_batch_result.entries_count);
+            return LOG_PACKET_SIZE(action_execute_batch_result) + entries_count * sizeof(ActionExecuteStatus) <= size;
+        }
+        case LogicalPacketType::UNKNOWN: return false;
+        default: return true;
+    }
+}
+
 void LogicalDeviceManager::handle_packet(LogicalDevice* device, LogicalPacket* packet, ushort size,
                                          MeshProto::far_addr_t src_phy) {
+    if (!validate_packet(packet, size))
+        return;
+
+    handle_valid_packet(device, packet, size, src_phy);
+    if (packet->type == LogicalPacketType::HELLO_WORLD_COMPACT)
+        remember_peer(packet, src_phy);
+}
+
+void LogicalDeviceManager::handle_valid_packet(LogicalDevice* device, LogicalPacket* packet, ushort size,
+                                               MeshProto::far_addr_t src_phy) {
     if (!device->on_general_packet_accept(packet, size, src_phy))
         return;
 
@@ -84,7 +369,7 @@ void LogicalDeviceManager::handle_packet(LogicalDevice* device, LogicalPacket* p
 
     switch (packet->type) {
         case LogicalPacketType::HELLO_WORLD: {
-            if (src_port == device->self_port && src_phy == g_fresh_mesh->self_addr)
+            if (src_port == device->self_port && src_phy == get_self_phy())
                 break; // skipping if got self packet
             device->send_hello_world(LogicalPacketType::HELLO_WORLD_RESPONSE, src_phy, src_port);
             device->on_device_discover(packet, size, src_phy);
@@ -94,42 +379,94 @@ void LogicalDeviceManager::handle_packet(LogicalDevice* device, LogicalPacket* p
             device->on_device_discover(packet, size, src_phy);
             break;
         }
+        case LogicalPacketType::HELLO_WORLD_COMPACT: {
+            if (src_port == device->self_port && src_phy == get_self_phy())
+                break; // skipping if got self packet
+            if (net_load(packet->hello_world_compact.version) != DESCRIPTOR_FORMAT_VERSION)
+                break;
+            auto flags = net_load(packet->hello_world_compact.flags);
+            auto hash = net_load(packet->hello_world_compact.descriptor_hash);
+            if (!(flags & HelloWorldCompactFlags::IS_RESPONSE)
+                && ((flags & HelloWorldCompactFlags::FRESH) || !is_known_peer({src_phy, src_port}, hash)))
+                schedule_discovery_reply(device);
+            if (device->wants_peer_descriptors())
+                handle_hello_world_compact(device, packet, size, src_phy);
+            break;
+        }
+        case LogicalPacketType::DESCRIPTOR_REQUEST: {
+            device->send_descriptor({src_phy, src_port}, net_load(packet->descriptor_request.descriptor_hash));
+            break;
+        }
+        case LogicalPacketType::DESCRIPTOR_RESPONSE: {
+            handle_descriptor_response(packet, size);
+            break;
+        }
         case LogicalPacketType::FIELD_DICTIONARY_REQUEST: {
             device->send_field_dictionary({src_phy, src_port});
             break;
         }
         case LogicalPacketType::FIELD_DICTIONARY_RESPONSE: {
-            // validating packet size
-            if (LOG_PACKET_SIZE(field_dictionary_response) > size)
-                break;
+            device->on_device_field_dictionary_view(FieldDictionaryView::from_validated(packet), src_phy);
+            break;
+        }
+
+        case LogicalPacketType::GROUPS_LIST_REQUEST: {
+            send_groups_list(device, LogicalPacketType::GROUPS_LIST_RESPONSE, device->groups->groups,
+                             device->groups->count, {src_phy, src_port});
+            break;
+        }
+        case LogicalPacketType::GROUPS_LIST_RESPONSE:
+        case LogicalPacketType::GROUPS_ADD:
+        case LogicalPacketType::GROUPS_EDIT:
+        case LogicalPacketType::GROUPS_REMOVE:
+        case LogicalPacketType::GROUPS_FIND_USERS_REQUEST:
+        case LogicalPacketType::GROUPS_FIND_USERS_RESPONSE: {
+            // all these packets share the same layout
+            auto groups_count = net_load(packet->groups_list_response.groups_count);
+            ushort groups[255];
+            for (int i = 0; i < groups_count; ++i)
+                groups[i] = net_load(packet->groups_list_response.groups[i]);
 
-            auto curr_ptr = packet->field_dictionary_response.fields;
-            auto end_ptr = (ubyte*) packet + size;
-            auto field_count = net_load(packet->field_dictionary_response.field_count);
-            for (int i = 0; i < field_count; ++i) {
-                if ((ubyte*) curr_ptr >= end_ptr)
-                    break;
-                curr_ptr = (FieldDictionaryResponsePacket::ApiFieldLayout*) curr_ptr->string + net_load(curr_ptr->length);
+            if (packet->type == LogicalPacketType::GROUPS_LIST_RESPONSE) {
+                device->on_groups_list(groups, groups_count, {src_phy, src_port});
+                break;
+            }
+            if (packet->type == LogicalPacketType::GROUPS_FIND_USERS_RESPONSE) {
+                device->on_groups_find_users(groups, groups_count, {src_phy, src_port});
+                break;
             }
-            if ((ubyte*) curr_ptr > end_ptr)
+            if (packet->type == LogicalPacketType::GROUPS_FIND_USERS_REQUEST) {
+                ubyte found_count = 0;
+                for (int i = 0; i < groups_count; ++i) {
+                    if (device->groups->contains(groups[i]))
+                        groups[found_count++] = groups[i];
+                }
+                if (found_count)
+                    send_groups_list(device, LogicalPacketType::GROUPS_FIND_USERS_RESPONSE, groups, found_count,
+                                     {src_phy, src_port});
                 break;
+            }
+
+            // invalid group ids are skipped by `add`
+            auto membership = *device->groups;
+            if (packet->type == LogicalPacketType::GROUPS_EDIT)
+                membership.count = 0;
+            for (int i = 0; i < groups_count; ++i) {
+                if (packet->type == LogicalPacketType::GROUPS_REMOVE)
+                    membership.remove(groups[i]);
+                else
+                    membership.add(groups[i]);
+            }
+            set_groups(device, membership);
 
-            device->on_device_field_dictionary(packet->field_dictionary_response.fields, field_count, src_phy);
+            // answering only if addressed directly, not to the whole group
+            if (net_load(packet->dst_addr) == device->self_port)
+                send_groups_list(device, LogicalPacketType::GROUPS_LIST_RESPONSE, device->groups->groups,
+                                 device->groups->count, {src_phy, src_port});
             break;
         }
 
-        case LogicalPacketType::GROUPS_LIST_REQUEST: { break; }
-        case LogicalPacketType::GROUPS_LIST_RESPONSE: { break; }
-        case LogicalPacketType::GROUPS_ADD: { break; }
-        case LogicalPacketType::GROUPS_EDIT: { break; }
-        case LogicalPacketType::GROUPS_REMOVE: { break; }
-        case LogicalPacketType::GROUPS_FIND_USERS_REQUEST: { break; }
-        case LogicalPacketType::GROUPS_FIND_USERS_RESPONSE: { break; }
-
         case LogicalPacketType::ACTION_RESPONSE: {
-            if (LOG_PACKET_SIZE(action_response) > size)
-                break;
-
             device->on_action_get_response(net_load(packet->action_response.action_id),
                                            packet->action_response.payload,
                                            size - LOG_PACKET_SIZE(action_response),
@@ -138,50 +475,63 @@ void LogicalDeviceManager::handle_packet(LogicalDevice* device, LogicalPacket* p
             break;
         }
         case LogicalPacketType::ACTION_FETCH: {
-            if (LOG_PACKET_SIZE(action_fetch) > size)
-                break;
-
-            device->on_action_get(net_load(packet->action_fetch.action_id),
-                                  packet->action_fetch.payload,
-                                  size - LOG_PACKET_SIZE(action_fetch),
-                                  {src_phy, src_port},
-                                  net_load(packet->action_fetch.request_id));
+            device->handle_action_get(net_load(packet->action_fetch.action_id),
+                                      packet->action_fetch.payload,
+                                      size - LOG_PACKET_SIZE(action_fetch),
+                                      {src_phy, src_port},
+                                      net_load(packet->action_fetch.request_id));
             break;
         }
         case LogicalPacketType::ACTION_EXECUTE: {
-            if (LOG_PACKET_SIZE(action_execute) > size)
-                break;
-
-            auto action_id = net_load(packet->action_execute.action_id);
-            auto status = device->on_action_set(action_id, packet->action_execute.payload,
-                              size - LOG_PACKET_SIZE(action_execute), {src_phy, src_port});
-
-
-            if (net_load(packet->action_execute.flags) & ActionExecuteFlags::REQUIRE_STATUS_RESPONSE) {
-                auto log = alloc_logical_packet_ptr({src_phy, src_port}, device->self_port, 0,
-                                                    OverlayProtoType::UNRELIABLE,
-                                                    LogicalPacketType::ACTION_EXECUTE_RESULT);
-                net_store(log.ptr()->action_execute_result.status, status);
-                net_store(log.ptr()->action_execute_result.request_id, net_load(packet->action_execute.request_id));
-                finish_ptr(log);
-            }
+            process_action_execute(device, net_load(packet->action_execute.action_id), packet->action_execute.payload,
+                                   size - LOG_PACKET_SIZE(action_execute), {src_phy, src_port},
+                                   net_load(packet->action_execute.request_id),
+                                   net_load(packet->action_execute.flags));
+            break;
+        }
+        case LogicalPacketType::ACTION_EXECUTE_RESULT: {
+            device->on_action_set_result(net_load(packet->action_execute_result.action_id),
+                                         net_load(packet->action_execute_result.status),
+                                         {src_phy, src_port},
+                                         net_load(packet->action_execute_result.request_id));
+            break;
+        }
+        case LogicalPacketType::ACTION_EXECUTE_BATCH_RESULT: {
+            device->on_action_batch_result(packet->action_execute_batch_result.statuses,
+                                           net_load(packet->action_execute_batch_result.entries_count), src_phy,
+                                           net_load(packet->action_execute_batch_result.request_id));
+            break;
+        }
+        case LogicalPacketType::ACTION_RESPONSE_MULTI: {
+            auto& response = packet->action_response_multi;
+            device->on_action_multi_response(net_load(response.request_id),
+                                             {response.entries, net_load(response.entries_count)}, src_phy);
             break;
         }
         case LogicalPacketType::SUBSCRIPTION_START: {
-            if (LOG_PACKET_SIZE(subscription_start) > size)
-                break;
-            device->subscriptions.add_subscriber(&packet->subscription_start,
-                                                 size - LOG_PACKET_SIZE(subscription_start),
-                                                 {src_phy, src_port});
+            auto state = device->subscriptions.add_subscriber(&packet->subscription_start, (SubscriptionStartFlags) 0,
+                                                              packet->subscription_start.info_payload,
+                                                              size - LOG_PACKET_SIZE(subscription_start),
+                                                              {src_phy, src_port});
+            device->subscriptions.send_subscription_done({src_phy, src_port},
+                                                         net_load(packet->subscription_start.id), state);
+            break;
+        }
+        case LogicalPacketType::SUBSCRIPTION_START_EXT: {
+            auto& start_ext = packet->subscription_start_ext;
+            auto state = device->subscriptions.add_subscriber(&start_ext.start, net_load(start_ext.flags),
+                                                              start_ext.info_payload,
+                                                              size - LOG_PACKET_SIZE(subscription_start_ext),
+                                                              {src_phy, src_port});
+            device->subscriptions.send_subscription_done({src_phy, src_port}, net_load(start_ext.start.id), state);
             break;
         }
         case LogicalPacketType::SUBSCRIPTION_DONE: {
-            // not implemented currently
+            device->on_subscription_done({src_phy, src_port}, net_load(packet->subscription_done.id),
+                                         net_load(packet->subscription_done.state));
             break;
         }
         case LogicalPacketType::SUBSCRIPTION_CALLBACK: {
-            if (LOG_PACKET_SIZE(subscription_callback) > size)
-                break;
             device->on_subscription_data(packet->subscription_callback.payload,
                                          size - LOG_PACKET_SIZE(subscription_callback),
                                          {src_phy, src_port},
@@ -189,38 +539,798 @@ void LogicalDeviceManager::handle_packet(LogicalDevice* device, LogicalPacket* p
             break;
         }
         case LogicalPacketType::SUBSCRIPTION_STOP: {
-            if (LOG_PACKET_SIZE(subscription_stop) > size)
-                break;
             device->subscriptions.stop_subscription(&packet->subscription_stop, {src_phy, src_port});
             break;
         }
+        case LogicalPacketType::SUBSCRIPTION_RENEW: {
+            device->subscriptions.renew_subscriptions(&packet->subscription_renew, {src_phy, src_port});
+            break;
+        }
         default: break;
     }
 }
 
+void LogicalDeviceManager::handle_hello_world_compact(LogicalDevice* device, LogicalPacket* packet, ushort size,
+                                                      MeshProto::far_addr_t src_phy) {
+    auto src_addr = LogicalAddress(src_phy, net_load(packet->src_addr));
+    auto hash = net_load(packet->hello_world_compact.descriptor_hash);
+    auto flags = net_load(packet->hello_world_compact.flags);
+    auto is_response = (bool) (flags & HelloWorldCompactFlags::IS_RESPONSE);
+
+    auto cached = flags & HelloWorldCompactFlags::HAS_DESCRIPTOR
+            ? descriptor_cache.insert(hash, packet->hello_world_compact.descriptor,
+                                      size - LOG_PACKET_SIZE(hello_world_compact))
+            : descriptor_cache.find(hash);
+    if (cached) {
+        deliver_descriptor(device, *cached, is_response, src_addr);
+        return;
+    }
+
+    fetch_descriptor(device, src_addr, hash, is_response);
+}
+
+void LogicalDeviceManager::fetch_descriptor(LogicalDevice* device, LogicalAddress src_addr, uint hash,
+                                            bool is_response) {
+    // fetching unknown descriptor once for all local devices
+    auto time = get_time();
+    if (!descriptor_fetches.contains(hash) && descriptor_fetches.size() >= KHAWASU_MAX_PENDING_REQUESTS) {
+        // expired fetches are dropped here as well, so lost responses don't block fetching when `update` isn't run
+        expire_descriptor_fetches(time);
+        if (descriptor_fetches.size() >= KHAWASU_MAX_PENDING_REQUESTS)
+            return;
+    }
+
+    auto& fetch = descriptor_fetches[hash];
+    auto need_request = fetch.waiters.empty() || time - fetch.request_time > DESCRIPTOR_FETCH_TIMEOUT;
+    if (fetch.waiters.size() < MAX_DESCRIPTOR_WAITERS)
+        fetch.waiters.push_back({device->self_port, src_addr, is_response});
+
+    if (need_request) {
+        fetch.request_time = time;
+        auto log = alloc_logical_packet_ptr(src_addr, device->self_port, 0, OverlayProtoType::UNRELIABLE,
+                                            LogicalPacketType::DESCRIPTOR_REQUEST);
+        net_store(log.ptr()->descriptor_request.descriptor_hash, hash);
+        finish_ptr(log);
+    }
+}
+
+static inline u64 peer_key(LogicalAddress addr) {
+    return ((u64) addr.phy << 16) | addr.log;
+}
+
+bool LogicalDeviceManager::use_compact_discovery() {
+    return compact_discovery && (legacy_peer_time == 0 || get_time() - legacy_peer_time >= LEGACY_PEER_TIMEOUT);
+}
+
+bool LogicalDeviceManager::request_descriptor(LogicalDevice* device, LogicalAddress peer) {
+    auto known = known_peers.find(peer_key(peer));
+    if (known == known_peers.end())
+        return false;
+
+    auto cached = descriptor_cache.find(known->second.hash);
+    if (cached)
+        deliver_descriptor(device, *cached, true, peer);
+    else
+        fetch_descriptor(device, peer, known->second.hash, true);
+    return true;
+}
+
+bool LogicalDeviceManager::is_known_peer(LogicalAddress addr, uint hash) {
+    auto known = known_peers.find(peer_key(addr));
+    return known != known_peers.end() && known->second.hash == hash;
+}
+
+void LogicalDeviceManager::remember_peer(LogicalPacket* packet, MeshProto::far_addr_t src_phy) {
+    auto key = peer_key({src_phy, net_load(packet->src_addr)});
+    if (known_peers.size() >= KNOWN_PEERS_CAPACITY && !known_peers.contains(key)) {
+        // the peer heard from least recently is answered again if it announces itself later
+        auto oldest = std::min_element(known_peers.begin(), known_peers.end(), [](auto& a, auto& b) {
+            return a.second.last_time < b.second.last_time;
+        });
+        known_peers.erase(oldest);
+    }
+    known_peers[key] = {net_load(packet->hello_world_compact.descriptor_hash), get_time()};
+}
+
+void LogicalDeviceManager::schedule_discovery_reply(LogicalDevice* device) {
+    auto time = get_time();
+    auto& reply = discovery_replies[device->self_port];
+    if (reply.due_time)
+        return; // already scheduled, the answer will serve this announcer as well
+
+    // answering too often is deferred rather than dropped, otherwise late announcers would never learn this device
+    auto earliest = reply.last_time ? std::max(time, reply.last_time + DISCOVERY_REPLY_INTERVAL) : time;
+    reply.due_time = earliest + random() % DISCOVERY_REPLY_JITTER + 1;
+}
+
+uint LogicalDeviceManager::random() {
+    // xorshift32, seeded with physical address to desynchronize the nodes
+    if (!random_state)
+        random_state = (get_self_phy() ^ (uint) get_time()) | 1;
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+void LogicalDeviceManager::update() {
+    auto time = get_time();
+
+    for (auto& [port, reply] : discovery_replies) {
+        if (!reply.due_time || reply.due_time > time)
+            continue;
+
+        reply.due_time = 0;
+        reply.last_time = time;
+        auto device = lookup_device(port);
+        if (device)
+            device->send_hello_world_compact(HelloWorldCompactFlags::IS_RESPONSE, MeshProto::BROADCAST_FAR_ADDR,
+                                             BROADCAST_PORT);
+    }
+
+    expire_descriptor_fetches(time);
+    flush_tx();
+}
+
+void LogicalDeviceManager::expire_descriptor_fetches(u64 time) {
+    // unanswered fetches are forgotten, the next request for the descriptor starts a new one
+    std::erase_if(descriptor_fetches, [time](auto& item) {
+        return time - item.second.request_time > DESCRIPTOR_FETCH_TIMEOUT;
+    });
+}
+
+u64 LogicalDeviceManager::next_wakeup_us() {
+    u64 wakeup = 0ull - 1;
+    for (auto& [port, device] : devices)
+        wakeup = std::min({wakeup, device->get_next_update_time(), device->subscriptions.get_next_deadline()});
+    for (auto& [port, reply] : discovery_replies) {
+        if (reply.due_time)
+            wakeup = std::min(wakeup, reply.due_time);
+    }
+    for (auto& [hash, fetch] : descriptor_fetches)
+        wakeup = std::min(wakeup, fetch.request_time + DESCRIPTOR_FETCH_TIMEOUT + 1);
+    if (!tx_scheduler.empty())
+        wakeup = std::min(wakeup, get_tx_ready_time());
+    return wakeup;
+}
+
+u64 LogicalDeviceManager::run_until(u64 deadline) {
+    Tick tick(this);
+    auto time = get_time();
+
+    run_ports.clear();
+    for (auto& [port, device] : devices)
+        run_ports.push_back(port);
+
+    for (auto port : run_ports) {
+        auto device = lookup_device(port);
+        if (device && device->get_next_update_time() <= time)
+            device->update();
+
+        device = lookup_device(port);
+        if (device && device->subscriptions.get_next_deadline() <= time)
+            device->subscriptions.update_periodic();
+    }
+
+    update();
+    return std::min(next_wakeup_us(), deadline);
+}
+
+void LogicalDeviceManager::handle_descriptor_response(LogicalPacket* packet, ushort size) {
+    auto hash = net_load(packet->descriptor_response.descriptor_hash);
+    auto cached = descriptor_cache.insert(hash, packet->descriptor_response.descriptor,
+                                          size - LOG_PACKET_SIZE(descriptor_response));
+    if (!cached)
+        return;
+
+    auto fetch = descriptor_fetches.find(hash);
+    if (fetch == descriptor_fetches.end())
+        return;
+
+    auto waiters = std::move(fetch->second.waiters);
+    descriptor_fetches.erase(fetch);
+    for (auto& waiter : waiters) {
+        auto device = lookup_device(waiter.local_port);
+        if (device)
+            deliver_descriptor(device, *cached, waiter.is_response, waiter.src_addr);
+    }
+}
+
+void LogicalDeviceManager::deliver_descriptor(LogicalDevice* device, DescriptorPacket& packet, bool is_response,
+                                              LogicalAddress src_addr) {
+    // the cached packet is the most recently used one, so it isn't evicted by the handler
+    auto log = (LogicalPacket*) packet.data();
+    net_store(log->type, is_response ? LogicalPacketType::HELLO_WORLD_RESPONSE : LogicalPacketType::HELLO_WORLD);
+    net_store(log->src_addr, src_addr.log);
+    net_store(log->dst_addr, device->self_port);
+    device->on_device_discover(log, packet.size(), src_addr.phy);
+}
+
+void LogicalDeviceManager::process_action_execute(LogicalDevice* device, ushort action_id, const ubyte* data,
+                                                  uint size, LogicalAddress src_addr, ubyte request_id,
+                                                  ActionExecuteFlags flags) {
+    auto status = execute_action(device, action_id, data, size, src_addr, request_id, flags);
+    if (flags & ActionExecuteFlags::REQUIRE_STATUS_RESPONSE)
+        send_action_execute_result(src_addr, device->self_port, action_id, request_id, status);
+}
+
+ActionExecuteStatus LogicalDeviceManager::execute_action(LogicalDevice* device, ushort action_id, const ubyte* data,
+                                                         uint size, LogicalAddress src_addr, ubyte request_id,
+                                                         ActionExecuteFlags flags) {
+    auto executed = flags & ActionExecuteFlags::DEDUPLICATE
+                    ? find_executed_request(src_addr, device->self_port, action_id, request_id) : nullptr;
+    if (executed)
+        return executed->status; // a retransmission, the result is repeated only
+
+    auto status = device->on_action_set(action_id, data, size, src_addr);
+    if (flags & ActionExecuteFlags::DEDUPLICATE) {
+        execute_history[execute_history_next] = {get_time(), src_addr, device->self_port, action_id, request_id,
+                                                 status};
+        execute_history_next = (execute_history_next + 1) % KHAWASU_EXECUTE_HISTORY_SIZE;
+    }
+    return status;
+}
+
+LogicalDeviceManager::ExecutedRequest* LogicalDeviceManager::find_executed_request(LogicalAddress src_addr,
+                                                                                   ushort dst_port, ushort action_id,
+                                                                                   ubyte request_id) {
+    auto time = get_time();
+    for (auto& request : execute_history) {
+        if (request.time && time - request.time < EXECUTE_HISTORY_TIMEOUT && request.request_id == request_id
+            && request.action_id == action_id && request.dst_port == dst_port && request.src_addr == src_addr)
+            return &request;
+    }
+    return nullptr;
+}
+
+void LogicalDeviceManager::process_action_execute_batch(const LogicalPacket* packet, MeshProto::far_addr_t src_phy) {
+    auto& batch = packet->action_execute_batch;
+    auto entries_count = net_load(batch.entries_count);
+    auto request_id = net_load(batch.request_id);
+    auto flags = net_load(batch.flags);
+    LogicalAddress src_addr(src_phy, net_load(packet->src_addr));
+
+    // entries of unknown devices and ones their device doesn't accept look the same to the sender
+    ActionExecuteStatus statuses[255];
+    int i = 0;
+    for (auto entry : ListView<ActionEntryItemLayout>(batch.entries, entries_count)) {
+        auto device = accept_batch_entry(packet, src_phy, entry.port);
+        if (device == nullptr)
+            statuses[i++] = ActionExecuteStatus::ACTION_NOT_FOUND;
+        else
+            statuses[i++] = execute_action(device, entry.action_id, entry.payload, entry.payload_size, src_addr,
+                                           request_id, flags);
+    }
+
+    if (flags & ActionExecuteFlags::REQUIRE_STATUS_RESPONSE)
+        send_action_execute_batch_result(src_addr, request_id, statuses, entries_count);
+}
+
+LogicalDevice* LogicalDeviceManager::accept_batch_entry(const LogicalPacket* packet, MeshProto::far_addr_t src_phy,
+                                                       ushort port) {
+    auto device = lookup_device(port);
+    if (device == nullptr)
+        return nullptr;
+
+    // the device sees the header addressed to itself, the received packet is left untouched
+    ubyte header_data[sizeof(LogicalPacket)];
+    auto header_size = LogicalPacket::get_header_size();
+    memcpy(header_data, packet, header_size);
+    auto header = (LogicalPacket*) header_data;
+    net_store(header->dst_addr, port);
+    return device->on_general_packet_accept(header, header_size, src_phy) ? device : nullptr;
+}
+
+void LogicalDeviceManager::process_action_fetch_multi(const LogicalPacket* packet, MeshProto::far_addr_t src_phy) {
+    auto& fetch = packet->action_fetch_multi;
+    MultiResponse response;
+    response.requester = {src_phy, net_load(packet->src_addr)};
+    response.request_id = net_load(fetch.request_id);
+
+    auto outer = multi_response; // handlers may fetch from another device of this node
+    multi_response = &response;
+    for (auto entry : ListView<ActionEntryItemLayout>(fetch.entries, net_load(fetch.entries_count))) {
+        auto device = accept_batch_entry(packet, src_phy, entry.port);
+        collect_action_get(device, entry.port, entry.action_id, entry.payload, entry.payload_size);
+    }
+    flush_multi_response();
+    multi_response = outer;
+}
+
+void LogicalDeviceManager::collect_action_get(LogicalDevice* device, ushort port, ushort action_id, const ubyte* data,
+                                              uint size) {
+    auto& response = *multi_response;
+    response.port = port;
+    response.action_id = action_id;
+    response.answered = false;
+    if (device == nullptr)
+        append_multi_response(response.requester, port, action_id, ActionExecuteStatus::ACTION_NOT_FOUND, nullptr, 0);
+    else
+        device->handle_action_get(action_id, data, size, response.requester, (ubyte) response.request_id);
+    response.port = BROADCAST_PORT; // answers after this point are sent separately
+
+    if (!response.answered) {
+        late_multi_answers[late_multi_answers_next] = {get_time(), response.requester, port, action_id,
+                                                       response.request_id};
+        late_multi_answers_next = (late_multi_answers_next + 1) % KHAWASU_MAX_PENDING_REQUESTS;
+    }
+}
+
+LogicalDeviceManager::LateMultiAnswer* LogicalDeviceManager::find_late_multi_answer(LogicalAddress dst_addr,
+                                                                                    ushort src_port, ushort action_id,
+                                                                                    ubyte request_id) {
+    // the oldest matching one, answers usually come in order
+    auto time = get_time();
+    LateMultiAnswer* found = nullptr;
+    for (auto& answer : late_multi_answers) {
+        if (answer.time && time - answer.time < LATE_MULTI_ANSWER_TIMEOUT && (ubyte) answer.request_id == request_id
+            && answer.action_id == action_id && answer.port == src_port && answer.requester == dst_addr
+            && (found == nullptr || answer.time < found->time))
+            found = &answer;
+    }
+    return found;
+}
+
+bool LogicalDeviceManager::send_late_multi_answer(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                                  ubyte request_id, ActionExecuteStatus status, const ubyte* data,
+                                                  uint size) {
+    auto answer = find_late_multi_answer(dst_addr, src_port, action_id, request_id);
+    if (answer == nullptr || ActionResponseItemLayout::size(size) > ACTION_RESPONSE_MULTI_CAPACITY)
+        return false;
+
+    // a multi-response of its own, carrying the full request id
+    MultiResponse response;
+    response.requester = dst_addr;
+    response.request_id = answer->request_id;
+    response.port = src_port;
+    response.action_id = action_id;
+    answer->time = 0;
+
+    auto outer = multi_response;
+    multi_response = &response;
+    append_multi_response(dst_addr, src_port, action_id, status, data, size);
+    flush_multi_response();
+    multi_response = outer;
+    return true;
+}
+
+bool LogicalDeviceManager::append_multi_response(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                                 ActionExecuteStatus status, const ubyte* data, uint size) {
+    auto response = multi_response;
+    if (response == nullptr || !(response->requester == dst_addr) || response->port != src_port
+        || response->action_id != action_id)
+        return false;
+
+    auto entry_size = ActionResponseItemLayout::size(size);
+    if (entry_size > ACTION_RESPONSE_MULTI_CAPACITY)
+        return false; // too large to be aggregated at all
+
+    if (response->size + entry_size > ACTION_RESPONSE_MULTI_CAPACITY || response->count == 255)
+        flush_multi_response();
+
+    ListWriter writer(response->entries + response->size);
+    writer.write_action_response(src_port, action_id, status, data, size);
+    response->size += entry_size;
+    response->count++;
+    response->answered = true;
+    return true;
+}
+
+void LogicalDeviceManager::flush_multi_response() {
+    auto& response = *multi_response;
+    if (response.count == 0)
+        return;
+
+    if (is_local_unicast(response.requester)) {
+        auto device = accept_local(response.requester.log, BROADCAST_PORT, LogicalPacketType::ACTION_RESPONSE_MULTI);
+        if (device)
+            device->on_action_multi_response(response.request_id, {response.entries, response.count}, get_self_phy());
+    } else {
+        auto log = alloc_logical_packet_ptr(response.requester, BROADCAST_PORT, response.size,
+                                            OverlayProtoType::UNRELIABLE, LogicalPacketType::ACTION_RESPONSE_MULTI);
+        net_store(log.ptr()->action_response_multi.request_id, response.request_id);
+        net_store(log.ptr()->action_response_multi.entries_count, response.count);
+        memcpy(log.ptr()->action_response_multi.entries, response.entries, response.size); // already serialized
+        finish_ptr(log);
+    }
+
+    response.count = 0;
+    response.size = 0;
+}
+
+bool LogicalDeviceManager::is_local_unicast(LogicalAddress dst_addr) {
+    return dst_addr.phy == get_self_phy() && dst_addr.log != BROADCAST_PORT && !is_group_port(dst_addr.log);
+}
+
+LogicalDevice* LogicalDeviceManager::accept_local(ushort dst_port, ushort src_port, LogicalPacketType type) {
+    auto device = lookup_device(dst_port);
+    if (device == nullptr || !device->on_local_packet_accept(type, {get_self_phy(), src_port}))
+        return nullptr;
+    return device;
+}
+
+void LogicalDeviceManager::send_action_execute(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                               const ubyte* data, uint size, ubyte request_id,
+                                               ActionExecuteFlags flags, OverlayProtoType ovl_type) {
+    if (is_local_unicast(dst_addr)) {
+        auto device = accept_local(dst_addr.log, src_port, LogicalPacketType::ACTION_EXECUTE);
+        if (device)
+            process_action_execute(device, action_id, data, size, {dst_addr.phy, src_port}, request_id, flags);
+        return;
+    }
+
+    auto log = alloc_logical_packet_ptr(dst_addr, src_port, size, ovl_type, LogicalPacketType::ACTION_EXECUTE);
+    net_store(log.ptr()->action_execute.action_id, action_id);
+    net_store(log.ptr()->action_execute.request_id, request_id);
+    net_store(log.ptr()->action_execute.flags, flags);
+    net_memcpy(log.ptr()->action_execute.payload, data, size);
+    finish_ptr(log);
+}
+
+void LogicalDeviceManager::send_action_execute_result(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                                      ubyte request_id, ActionExecuteStatus status) {
+    if (is_local_unicast(dst_addr)) {
+        auto device = accept_local(dst_addr.log, src_port, LogicalPacketType::ACTION_EXECUTE_RESULT);
+        if (device)
+            device->on_action_set_result(action_id, status, {dst_addr.phy, src_port}, request_id);
+        return;
+    }
+
+    auto log = alloc_logical_packet_ptr(dst_addr, src_port, 0, OverlayProtoType::UNRELIABLE,
+                                        LogicalPacketType::ACTION_EXECUTE_RESULT);
+    net_store(log.ptr()->action_execute_result.action_id, action_id);
+    net_store(log.ptr()->action_execute_result.status, status);
+    net_store(log.ptr()->action_execute_result.request_id, request_id);
+    finish_ptr(log);
+}
+
+void LogicalDeviceManager::send_action_fetch(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                             const ubyte* data, uint size, ubyte request_id) {
+    if (is_local_unicast(dst_addr)) {
+        auto device = accept_local(dst_addr.log, src_port, LogicalPacketType::ACTION_FETCH);
+        if (device)
+            device->handle_action_get(action_id, data, size, {dst_addr.phy, src_port}, request_id);
+        return;
+    }
+
+    auto log = alloc_logical_packet_ptr(dst_addr, src_port, size, OverlayProtoType::UNRELIABLE,
+                                        LogicalPacketType::ACTION_FETCH);
+    net_store(log.ptr()->action_fetch.action_id, action_id);
+    net_store(log.ptr()->action_fetch.request_id, request_id);
+    net_memcpy(log.ptr()->action_fetch.payload, data, size);
+    finish_ptr(log);
+}
+
+void LogicalDeviceManager::send_action_response(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                                ubyte request_id, ActionExecuteStatus status, const ubyte* data,
+                                                uint size) {
+    auto device = lookup_device(src_port);
+    if (device != nullptr && !device->action_cache.entries.empty())
+        device->complete_action_get(action_id, dst_addr, request_id, status, data, size);
+
+    if (append_multi_response(dst_addr, src_port, action_id, status, data, size)
+        || send_late_multi_answer(dst_addr, src_port, action_id, request_id, status, data, size))
+        return;
+
+    if (is_local_unicast(dst_addr)) {
+        auto device = accept_local(dst_addr.log, src_port, LogicalPacketType::ACTION_RESPONSE);
+        if (device)
+            device->on_action_get_response(action_id, data, size, {dst_addr.phy, src_port}, request_id);
+        return;
+    }
+
+    auto log = alloc_logical_packet_ptr(dst_addr, src_port, size, OverlayProtoType::UNRELIABLE,
+                                        LogicalPacketType::ACTION_RESPONSE);
+    net_store(log.ptr()->action_response.status, status);
+    net_store(log.ptr()->action_response.action_id, action_id);
+    net_store(log.ptr()->action_response.request_id, request_id);
+    net_memcpy(log.ptr()->action_response.payload, data, size);
+    finish_ptr(log);
+}
+
+void LogicalDeviceManager::send_subscription_callback(LogicalAddress dst_addr, ushort src_port, uint sub_id,
+                                                      const ubyte* data, uint size) {
+    if (is_local_unicast(dst_addr)) {
+        auto device = accept_local(dst_addr.log, src_port, LogicalPacketType::SUBSCRIPTION_CALLBACK);
+        if (device)
+            device->on_subscription_data(data, size, {dst_addr.phy, src_port}, sub_id);
+        return;
+    }
+
+    auto log = alloc_logical_packet_ptr(dst_addr, src_port, size, OverlayProtoType::UNRELIABLE,
+                                        LogicalPacketType::SUBSCRIPTION_CALLBACK);
+    net_store(log.ptr()->subscription_callback.id, sub_id);
+    net_memcpy(log.ptr()->subscription_callback.payload, data, size);
+    finish_ptr(log);
+}
+
+void LogicalDeviceManager::send_action_response(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                                ubyte request_id, ActionExecuteStatus status, PayloadSource& payload) {
+    auto device = lookup_device(src_port);
+    auto contiguous = payload.get_contiguous();
+    if (contiguous || is_local_unicast(dst_addr) || multi_response || (device && device->action_cache.find(action_id))
+        || find_late_multi_answer(dst_addr, src_port, action_id, request_id)) {
+        if (contiguous) {
+            send_action_response(dst_addr, src_port, action_id, request_id, status, contiguous, payload.get_size());
+            return;
+        }
+
+        auto data = materialize_payload(payload);
+        send_action_response(dst_addr, src_port, action_id, request_id, status, data.data(), data.size());
+        return;
+    }
+
+    ubyte header_data[sizeof(LogicalPacket)];
+    auto header = (LogicalPacket*) header_data;
+    net_store(header->type, LogicalPacketType::ACTION_RESPONSE);
+    net_store(header->src_addr, src_port);
+    net_store(header->dst_addr, dst_addr.log);
+    net_store(header->action_response.status, status);
+    net_store(header->action_response.action_id, action_id);
+    net_store(header->action_response.request_id, request_id);
+    send_with_payload(header, dst_addr.phy, payload);
+}
+
+void LogicalDeviceManager::send_subscription_callback(LogicalAddress dst_addr, ushort src_port, uint sub_id,
+                                                      PayloadSource& payload) {
+    auto contiguous = payload.get_contiguous();
+    if (contiguous || is_local_unicast(dst_addr)) {
+        if (contiguous) {
+            send_subscription_callback(dst_addr, src_port, sub_id, contiguous, payload.get_size());
+            return;
+        }
+
+        auto data = materialize_payload(payload);
+        send_subscription_callback(dst_addr, src_port, sub_id, data.data(), data.size());
+        return;
+    }
+
+    ubyte header_data[sizeof(LogicalPacket)];
+    auto header = (LogicalPacket*) header_data;
+    net_store(header->type, LogicalPacketType::SUBSCRIPTION_CALLBACK);
+    net_store(header->src_addr, src_port);
+    net_store(header->dst_addr, dst_addr.log);
+    net_store(header->subscription_callback.id, sub_id);
+    send_with_payload(header, dst_addr.phy, payload);
+}
+
+// passes exactly `left` bytes on, a source writing less is padded with zeros
+class ExactSink : public PayloadSink
+{
+public:
+    PayloadSink& sink;
+    uint left;
+
+    ExactSink(PayloadSink& sink_, uint size) : sink(sink_), left(size) { }
+
+    void write(const ubyte* data, uint size) override {
+        size = std::min(size, left);
+        sink.write(data, size);
+        left -= size;
+    }
+
+    void pad() {
+        if (left)
+            printf("ExactSink: payload is %u bytes shorter than declared\n", left);
+
+        ubyte zeros[64] = {};
+        while (left)
+            write(zeros, std::min<uint>(left, sizeof(zeros)));
+    }
+};
+
+void LogicalDeviceManager::send_with_payload(LogicalPacket* header, MeshProto::far_addr_t dst_phy,
+                                             PayloadSource& payload) {
+    auto type = net_load(header->type);
+    auto header_size = LogicalPacket::get_packet_size(type);
+    auto payload_size = payload.get_size();
+    if (header_size + payload_size > 0xFFFF) {
+        printf("send_with_payload: payload is too large (%u)\n", payload_size);
+        return;
+    }
+
+    auto ovl_type = OverlayProtoType::UNRELIABLE;
+    auto size = OverlayPacket::get_packet_size(ovl_type) + header_size + payload_size;
+    // local copies of self-addressed and broadcast packets are dispatched from the buffer by `finish_ptr`
+    auto is_remote = dst_phy != get_self_phy() && dst_phy != MeshProto::BROADCAST_FAR_ADDR;
+    if (size <= STREAM_THRESHOLD || !is_remote || capture || !tx_scheduler.empty() || get_tx_ready_time() > get_time()) {
+        auto log = alloc_raw_logical_ptr(dst_phy, header_size + payload_size, ovl_type);
+        memcpy(log.ptr(), header, header_size);
+
+        BufferSink buffer((ubyte*) log.ptr() + header_size, payload_size);
+        ExactSink sink(buffer, payload_size);
+        payload.write_to(sink);
+        sink.pad();
+        finish_ptr(log);
+        return;
+    }
+
+    // the overlay header goes first, then the parts follow as they're produced
+    ubyte ovl_data[sizeof(OverlayPacket)];
+    OverlayPacketBuilder::write_header((OverlayPacket*) ovl_data, ovl_type);
+
+    ExactSink sink(transport->begin_stream(dst_phy, size), size);
+    sink.write(ovl_data, OverlayPacket::get_packet_size(ovl_type));
+    sink.write((const ubyte*) header, header_size);
+    payload.write_to(sink);
+    sink.pad();
+    tx_scheduler.on_sent(tx_classes[(ubyte) type], size, get_time());
+}
+
 void LogicalDeviceManager::finish_ptr(LogicalPacketPtr ptr) {
+    if (ptr._ptr == nullptr)
+        return; // not allocated, see `alloc_group_packet_ptr`
+
     auto raw = ptr.ptr();
+    if (capture)
+        capture->record(CaptureDirection::TX, get_time(), get_self_phy(), ptr.dst_phy, raw, ptr.size);
 
     if (ptr.ovl) {
-        ptr.ovl->send();
-        if (net_load(raw->dst_addr) == BROADCAST_PORT)
-            dispatch_packet(raw, ptr.size, g_fresh_mesh->self_addr);
-        delete ptr.ovl;
+        // local copy first, `raw` lives in the queued packet
+        auto dst_addr = net_load(raw->dst_addr);
+        if (dst_addr == BROADCAST_PORT || (is_group_port(dst_addr) && ptr.dst_phy == MeshProto::BROADCAST_FAR_ADDR))
+            dispatch_packet(raw, ptr.size, get_self_phy());
+        queue_tx(ptr.ovl, net_load(raw->type));
     } else {
-        dispatch_packet(raw, ptr.size, g_fresh_mesh->self_addr);
-        OverlayPacketBuilder::log_ovl_packet_alloc->free(raw);
+        dispatch_packet(raw, ptr.size, get_self_phy());
+        packet_pool.free(raw, ptr.size);
     }
 }
 
+LogicalPacketPtr LogicalDeviceManager::alloc_group_packet_ptr(MeshProto::far_addr_t dst_phy, ushort group_id,
+                                                              ushort src_port, uint size, OverlayProtoType ovl_type,
+                                                              LogicalPacketType log_type) {
+    if (!is_valid_group(group_id)) {
+        printf("LogicalDeviceManager: invalid group id %d\n", group_id);
+        return {};
+    }
+    return alloc_logical_packet_ptr({dst_phy, group_to_port(group_id)}, src_port, size, ovl_type, log_type);
+}
+
 LogicalPacketPtr LogicalDeviceManager::alloc_raw_logical_ptr(MeshProto::far_addr_t dst_phy, uint log_size,
                                                              OverlayProto::OverlayProtoType ovl_type) {
     LogicalPacket* packet;
 
-    if (g_fresh_mesh->self_addr == dst_phy) {
-        packet = (LogicalPacket*) OverlayPacketBuilder::log_ovl_packet_alloc->alloc(log_size);
-        return {packet, nullptr, log_size};
+    if (get_self_phy() == dst_phy) {
+        packet = (LogicalPacket*) packet_pool.alloc(log_size);
+        return {packet, nullptr, log_size, dst_phy};
     } else {
-        auto ovl_ptr = new OverlayPacketBuilder(dst_phy, log_size, ovl_type, (void**) &packet);
-        return {packet, ovl_ptr, log_size};
+        auto ovl_ptr = new OverlayPacketBuilder(&packet_pool, transport, dst_phy, log_size, ovl_type, (void**) &packet);
+        return {packet, ovl_ptr, log_size, dst_phy};
     }
-}
\ No newline at end of file
+}
+
+uint LogicalDeviceManager::get_tx_pressure() {
+    return tx_scheduler.get_pressure(get_time());
+}
+
+u64 LogicalDeviceManager::get_tx_ready_time() {
+    return std::max(transport->get_ready_time(), tx_scheduler.get_ready_time());
+}
+
+void LogicalDeviceManager::queue_tx(OverlayPacketBuilder* packet, LogicalPacketType type) {
+    auto tx_class = (ubyte) type < LOGICAL_PACKET_TYPE_COUNT ? tx_classes[(ubyte) type] : TxClass::NORMAL;
+    if (tx_scheduler.empty() && get_tx_ready_time() <= get_time()) {
+        packet->send();
+        tx_scheduler.on_sent(tx_class, packet->size, get_time());
+        delete packet;
+        return;
+    }
+
+    tx_scheduler.push(tx_class, packet);
+}
+
+void LogicalDeviceManager::flush_tx() {
+    while (!tx_scheduler.empty() && get_tx_ready_time() <= get_time()) {
+        TxClass tx_class;
+        auto packet = tx_scheduler.pop(tx_class);
+        packet->send();
+        tx_scheduler.on_sent(tx_class, packet->size, get_time());
+        delete packet;
+    }
+}
+
+void LogicalDeviceManager::send_action_execute_batch(MeshProto::far_addr_t dst_phy, ushort src_port,
+                                                     const ActionBatchEntry* entries, ubyte count, ubyte request_id,
+                                                     ActionExecuteFlags flags, OverlayProtoType ovl_type) {
+    if (dst_phy == get_self_phy()) {
+        ActionExecuteStatus statuses[255];
+        for (int i = 0; i < count; ++i) {
+            auto device = accept_local(entries[i].port, src_port, LogicalPacketType::ACTION_EXECUTE_BATCH);
+            statuses[i] = device ? execute_action(device, entries[i].action_id, entries[i].data, entries[i].size,
+                                                  {dst_phy, src_port}, request_id, flags)
+                                 : ActionExecuteStatus::ACTION_NOT_FOUND;
+        }
+
+        if (flags & ActionExecuteFlags::REQUIRE_STATUS_RESPONSE)
+            send_action_execute_batch_result({dst_phy, src_port}, request_id, statuses, count);
+        return;
+    }
+
+    uint size = 0;
+    for (int i = 0; i < count; ++i) {
+        if (entries[i].size > 0xFFFF) {
+            printf("send_action_execute_batch: payload of entry %d is too large (%u)\n", i, entries[i].size);
+            return;
+        }
+        size += ActionEntryItemLayout::size(entries[i].size);
+    }
+    if (size + LogicalPacket::get_packet_size(LogicalPacketType::ACTION_EXECUTE_BATCH) > 0xFFFF) {
+        printf("send_action_execute_batch: batch is too large (%u), split it\n", size);
+        return;
+    }
+
+    // the receiving manager handles the batch whatever the port is, see logical_proto.h
+    ushort dst_port = count ? entries[0].port : 0;
+    auto log = alloc_logical_packet_ptr({dst_phy, dst_port}, src_port, size, ovl_type,
+                                        LogicalPacketType::ACTION_EXECUTE_BATCH);
+    net_store(log.ptr()->action_execute_batch.request_id, request_id);
+    net_store(log.ptr()->action_execute_batch.flags, flags);
+    net_store(log.ptr()->action_execute_batch.entries_count, count);
+
+    ListWriter writer(log.ptr()->action_execute_batch.entries);
+    for (int i = 0; i < count; ++i)
+        writer.write_action_entry(entries[i].port, entries[i].action_id, entries[i].data, entries[i].size);
+    finish_ptr(log);
+}
+
+void LogicalDeviceManager::send_action_execute_batch_result(LogicalAddress dst_addr, ubyte request_id,
+                                                            const ActionExecuteStatus* statuses, ubyte count) {
+    if (is_local_unicast(dst_addr)) {
+        auto device = accept_local(dst_addr.log, BROADCAST_PORT, LogicalPacketType::ACTION_EXECUTE_BATCH_RESULT);
+        if (device)
+            device->on_action_batch_result(statuses, count, dst_addr.phy, request_id);
+        return;
+    }
+
+    auto log = alloc_logical_packet_ptr(dst_addr, BROADCAST_PORT, count * sizeof(ActionExecuteStatus),
+                                        OverlayProtoType::UNRELIABLE, LogicalPacketType::ACTION_EXECUTE_BATCH_RESULT);
+    net_store(log.ptr()->action_execute_batch_result.request_id, request_id);
+    net_store(log.ptr()->action_execute_batch_result.entries_count, count);
+    net_memcpy(log.ptr()->action_execute_batch_result.statuses, statuses, count * sizeof(ActionExecuteStatus));
+    finish_ptr(log);
+}
+
+void LogicalDeviceManager::send_action_fetch_multi(MeshProto::far_addr_t dst_phy, ushort src_port,
+                                                   const ActionBatchEntry* entries, ubyte count, uint request_id) {
+    if (dst_phy == get_self_phy()) {
+        MultiResponse response;
+        response.requester = {dst_phy, src_port};
+        response.request_id = request_id;
+
+        auto outer = multi_response;
+        multi_response = &response;
+        for (int i = 0; i < count; ++i) {
+            auto device = accept_local(entries[i].port, src_port, LogicalPacketType::ACTION_FETCH_MULTI);
+            collect_action_get(device, entries[i].port, entries[i].action_id, entries[i].data, entries[i].size);
+        }
+        flush_multi_response();
+        multi_response = outer;
+        return;
+    }
+
+    uint size = 0;
+    for (int i = 0; i < count; ++i) {
+        if (entries[i].size > 0xFFFF) {
+            printf("send_action_fetch_multi: payload of entry %d is too large (%u)\n", i, entries[i].size);
+            return;
+        }
+        size += ActionEntryItemLayout::size(entries[i].size);
+    }
+    if (size + LogicalPacket::get_packet_size(LogicalPacketType::ACTION_FETCH_MULTI) > 0xFFFF) {
+        printf("send_action_fetch_multi: batch is too large (%u), split it\n", size);
+        return;
+    }
+
+    // the receiving manager handles the request whatever the port is, see logical_proto.h
+    ushort dst_port = count ? entries[0].port : 0;
+    auto log = alloc_logical_packet_ptr({dst_phy, dst_port}, src_port, size, OverlayProtoType::UNRELIABLE,
+                                        LogicalPacketType::ACTION_FETCH_MULTI);
+    net_store(log.ptr()->action_fetch_multi.request_id, request_id);
+    net_store(log.ptr()->action_fetch_multi.entries_count, count);
+
+    ListWriter writer(log.ptr()->action_fetch_multi.entries);
+    for (int i = 0; i < count; ++i)
+        writer.write_action_entry(entries[i].port, entries[i].action_id, entries[i].data, entries[i].size);
+    finish_ptr(log);
+}
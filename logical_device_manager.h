@@ -1,27 +1,46 @@
 #pragma once
 
+#include <array>
+#include <optional>
 #include <unordered_map>
+#include <vector>
 #include "pool_memory_allocator.h"
 #include "logical_device.h"
+#include "descriptor_codec.h"
+#include "monotonic_clock.h"
+#include "packet_capture.h"
 #include "protocols/overlay_proto.h"
-#include "mesh_stream_builder.h"
+#include "mesh_transport.h"
+#include "tx_scheduler.h"
 #include "to_fix.h"
 
 
+using LogicalPacketPool = PoolMemoryAllocator<LOG_PACKET_POOL_ALLOC_PART_SIZE, LOG_PACKET_POOL_ALLOC_COUNT>;
+
 class OverlayPacketBuilder
 {
 public:
-    static PoolMemoryAllocator<LOG_PACKET_POOL_ALLOC_PART_SIZE, LOG_PACKET_POOL_ALLOC_COUNT>* log_ovl_packet_alloc;
-
-    MeshStreamBuilder mesh;
+    LogicalPacketPool* pool;
+    MeshTransport* transport;
+    MeshProto::far_addr_t dst_phy;
+    uint size; // including overlay header
     OverlayProto::OverlayPacket* packet;
 
-    OverlayPacketBuilder(MeshProto::far_addr_t dst_phy, uint size, OverlayProto::OverlayProtoType ovl_type,
-                         void** user_write_addr_p);
+    OverlayPacketBuilder(LogicalPacketPool* pool_, MeshTransport* transport_, MeshProto::far_addr_t dst_phy_, uint size_,
+                         OverlayProto::OverlayProtoType ovl_type, void** user_write_addr_p);
+
+    // fills the overlay header of `ovl_type` and returns where the logical packet goes, nullptr for unknown types.
+    // also used for packets streamed without a builder
+    static ubyte* write_header(OverlayProto::OverlayPacket* packet, OverlayProto::OverlayProtoType ovl_type);
 
     void send();
 
     ~OverlayPacketBuilder();
+
+    // accounted in MemoryArea::PACKETS
+    static void* operator new(size_t size);
+
+    static void operator delete(void* ptr, size_t size);
 };
 
 
@@ -29,8 +48,9 @@ class LogicalPacketPtr
 {
     friend LogicalDeviceManager;
 public:
-    LogicalPacketPtr(LogicalProto::LogicalPacket* ptr_, OverlayPacketBuilder* ovl_, uint size_)
-    : _ptr(ptr_), ovl(ovl_), size(size_) {}
+    LogicalPacketPtr(LogicalProto::LogicalPacket* ptr_, OverlayPacketBuilder* ovl_, uint size_,
+                     MeshProto::far_addr_t dst_phy_)
+    : _ptr(ptr_), ovl(ovl_), size(size_), dst_phy(dst_phy_) {}
     LogicalPacketPtr() = default;
 
     inline LogicalProto::LogicalPacket* ptr() {
@@ -38,34 +58,417 @@ public:
     }
 
 protected:
-    LogicalProto::LogicalPacket* _ptr;
-    OverlayPacketBuilder* ovl;
-    uint size;
+    LogicalProto::LogicalPacket* _ptr = nullptr;
+    OverlayPacketBuilder* ovl = nullptr;
+    uint size = 0;
+    MeshProto::far_addr_t dst_phy = 0;
 };
 
 
 class LogicalDeviceManager
 {
 public:
-    std::unordered_map<ushort, LogicalDevice*> devices;
+    // a fetch of unknown descriptor is repeated if there's no response after this time
+    static constexpr u64 DESCRIPTOR_FETCH_TIMEOUT = 2'000'000; // us
+    // answers to HELLO_WORLD_COMPACT are delayed randomly up to this time
+    static constexpr u64 DISCOVERY_REPLY_JITTER = 500'000; // us
+    // device answers to HELLO_WORLD_COMPACT not more often than this, later answers are deferred
+    static constexpr u64 DISCOVERY_REPLY_INTERVAL = 5'000'000; // us
+    // remembered HELLO_WORLD_COMPACT announcers, a new one over it replaces the least recently heard peer
+    static constexpr uint KNOWN_PEERS_CAPACITY = 256;
+    // (local device, announcer) pairs waiting for one descriptor fetch, later ones get the descriptor from the cache
+    // with the next announcement of their peer
+    static constexpr uint MAX_DESCRIPTOR_WAITERS = 64;
+    // compact discovery falls back to HELLO_WORLD for this time after another node announced itself with HELLO_WORLD,
+    // firmware without compact discovery ignores HELLO_WORLD_COMPACT
+    static constexpr u64 LEGACY_PEER_TIMEOUT = 600'000'000; // us
+    // repeated ACTION_EXECUTE with DEDUPLICATE flag is recognized within this time
+    static constexpr u64 EXECUTE_HISTORY_TIMEOUT = 30'000'000; // us
+    // answers to ACTION_FETCH_MULTI entries given after their handler returned are recognized within this time
+    static constexpr u64 LATE_MULTI_ANSWER_TIMEOUT = 10'000'000; // us
+    // entries of ACTION_RESPONSE_MULTI exceeding this size are sent in the next packet
+    static constexpr uint ACTION_RESPONSE_MULTI_CAPACITY = 512; // bytes
+    // packets with a PayloadSource larger than this are streamed to the transport if they can leave right away,
+    // skipping the packet buffer (which would be malloc'ed at this size anyway)
+    static constexpr uint STREAM_THRESHOLD = LOG_PACKET_POOL_ALLOC_PART_SIZE; // bytes, with overlay header
+
+    struct DiscoveryReply
+    {
+        u64 due_time;  // system time, us. zero if there's no scheduled answer
+        u64 last_time; // system time, us
+    };
+
+    struct KnownPeer
+    {
+        uint hash;      // of the announced descriptor
+        u64 last_time;  // system time of the last announcement, us. the least recent peer is forgotten first
+    };
+
+    struct DescriptorWaiter
+    {
+        ushort local_port;
+        LogicalAddress src_addr;
+        bool is_response;
+    };
+
+    struct DescriptorFetch
+    {
+        u64 request_time; // system time, us
+        AccountedVector<DescriptorWaiter, MemoryArea::DISCOVERY> waiters;
+    };
+
+    // entry of `send_action_execute_batch` and `send_action_fetch_multi`, payload is copied
+    struct ActionBatchEntry
+    {
+        ushort port; // of the device on the destination physical device
+        ushort action_id;
+        const ubyte* data;
+        uint size;
+    };
+
+    AccountedMap<ushort, LogicalDevice*, MemoryArea::DEVICES> devices;
+    AccountedMap<ushort, AccountedVector<LogicalDevice*, MemoryArea::DEVICES>, MemoryArea::DEVICES>
+        group_members; // group id -> local members
+    AccountedVector<LogicalDevice*, MemoryArea::DEVICES>
+        broadcast_listeners[LogicalProto::LOGICAL_PACKET_TYPE_COUNT]; // by packet type
+    // announce local devices with HELLO_WORLD_COMPACT instead of HELLO_WORLD while no node without compact discovery
+    // is heard, see `use_compact_discovery`
+    bool compact_discovery = false;
+    DescriptorCache descriptor_cache;
+    // by descriptor hash, dropped after timeout
+    AccountedMap<uint, DescriptorFetch, MemoryArea::DISCOVERY> descriptor_fetches;
+    AccountedMap<u64, KnownPeer, MemoryArea::DISCOVERY> known_peers; // by logical address
+    AccountedMap<ushort, DiscoveryReply, MemoryArea::DEVICES> discovery_replies; // by local port
+    u64 legacy_peer_time = 0; // system time of the last HELLO_WORLD of another node, us, zero if none was heard
+    uint random_state = 0;
+    // scratch for `run_until`, devices may come and go from their callbacks
+    AccountedVector<ushort, MemoryArea::DEVICES> run_ports;
+    PacketCapture* capture = nullptr; // optional tap on serialized traffic, same-node typed sends aren't captured
+    TxScheduler tx_scheduler;
+    PropertyStore* property_store = &default_property_store; // of the devices, set it before constructing any
+    std::array<TxClass, LogicalProto::LOGICAL_PACKET_TYPE_COUNT> tx_classes = get_default_tx_classes(); // by packet type
+
+    // every manager has its own transport, packet pool and state, so independent instances (one per radio
+    // interface, for example) may run in parallel on different cores
+    explicit LogicalDeviceManager(MeshController& mesh);
+
+    // the transport must outlive the manager
+    explicit LogicalDeviceManager(MeshTransport* transport_);
+
+    LogicalDeviceManager(const LogicalDeviceManager&) = delete;
+    LogicalDeviceManager& operator=(const LogicalDeviceManager&) = delete;
+
+    ~LogicalDeviceManager();
+
+    // replaces the physical layer, e.g. with a simulated one. the transport must outlive the manager
+    void set_transport(MeshTransport* transport_);
+
+    inline MeshProto::far_addr_t get_self_phy() {
+        return transport->get_self_addr();
+    }
+
+    // replaces the time source, e.g. with VirtualClock. the clock must outlive the manager
+    void set_clock(Clock* clock_);
+
+    // monotonic time (us). during a tick of `run_until` or `dispatch_packet` it's sampled once and shared by all
+    // devices, so it's cheap to call. outside of ticks (devices updated from the firmware loop) the clock is read
+    inline u64 get_time() const {
+        return tick_depth ? tick_time : clock->now_us();
+    }
 
     void add_device(LogicalDevice* device);
 
     void remove_device(LogicalDevice* device);
 
+    // call it when result of `LogicalDevice::get_broadcast_interest` changes
+    void update_broadcast_interest(LogicalDevice* device);
+
     LogicalDevice* lookup_device(ushort port);
 
+    // services scheduled work of the manager itself, `run_until` calls it when it's due
+    void update();
+
+    // system time (us) of the earliest scheduled work: device updates, subscription timers, self updates,
+    // discovery replies, descriptor fetch timeouts and queued packets. ~0 if nothing is scheduled
+    u64 next_wakeup_us();
+
+    // services only the work that is due by now, returns the time the caller may sleep until
+    // (the earliest of `next_wakeup_us` and `deadline`). radio and other external events end the sleep earlier
+    u64 run_until(u64 deadline);
+
+    // true if `compact_discovery` is set and no other node announced itself with HELLO_WORLD within
+    // LEGACY_PEER_TIMEOUT. such nodes may run firmware without compact discovery, so local devices announce themselves
+    // in the full format until they're gone
+    bool use_compact_discovery();
+
+    // passes the descriptor of a known peer to `device->on_device_discover`, fetching it if it isn't cached
+    // returns false if the peer hasn't announced itself with HELLO_WORLD_COMPACT
+    bool request_descriptor(LogicalDevice* device, LogicalAddress peer);
+
+    // returns false if device can't join any more groups
+    bool join_group(LogicalDevice* device, ushort group_id);
+
+    void leave_group(LogicalDevice* device, ushort group_id);
+
+    void set_groups(LogicalDevice* device, const GroupMembership& membership);
+
+    // entry point for packets received from the transport, strips overlay header and calls `dispatch_packet`
+    void dispatch_overlay_packet(const ubyte* data, uint size, MeshProto::far_addr_t src_phy);
+
     void dispatch_packet(LogicalProto::LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy);
 
     void handle_packet(LogicalDevice* device, LogicalProto::LogicalPacket* packet, ushort size,
                        MeshProto::far_addr_t src_phy);
 
+    // checks that packet type is known and every variable-length part fits into `size`
+    bool validate_packet(LogicalProto::LogicalPacket* packet, ushort size);
+
     LogicalPacketPtr alloc_logical_packet_ptr(LogicalAddress dst_addr, ushort src_port, uint size,
                                               OverlayProto::OverlayProtoType ovl_type,
                                               LogicalProto::LogicalPacketType log_type);
 
+    // typed send api: same-node destinations are delivered straight to the device handlers, in host byte order and
+    // without allocating a packet. other destinations are serialized and sent as usual
+    void send_action_execute(LogicalAddress dst_addr, ushort src_port, ushort action_id, const ubyte* data, uint size,
+                             ubyte request_id, LogicalProto::ActionExecuteFlags flags,
+                             OverlayProto::OverlayProtoType ovl_type = OverlayProto::OverlayProtoType::UNRELIABLE);
+
+    void send_action_execute_result(LogicalAddress dst_addr, ushort src_port, ushort action_id, ubyte request_id,
+                                    LogicalProto::ActionExecuteStatus status);
+
+    void send_action_fetch(LogicalAddress dst_addr, ushort src_port, ushort action_id, const ubyte* data, uint size,
+                           ubyte request_id);
+
+    void send_action_response(LogicalAddress dst_addr, ushort src_port, ushort action_id, ubyte request_id,
+                              LogicalProto::ActionExecuteStatus status, const ubyte* data, uint size);
+
+    void send_subscription_callback(LogicalAddress dst_addr, ushort src_port, uint sub_id, const ubyte* data,
+                                    uint size);
+
+    // same as above with the payload serialized part by part right into the outgoing packet, see payload_source.h
+    // same-node destinations, ACTION_FETCH_MULTI answers and cached actions still take a contiguous copy
+    void send_action_response(LogicalAddress dst_addr, ushort src_port, ushort action_id, ubyte request_id,
+                              LogicalProto::ActionExecuteStatus status, PayloadSource& payload);
+
+    void send_subscription_callback(LogicalAddress dst_addr, ushort src_port, uint sub_id, PayloadSource& payload);
+
+    // executes actions of multiple devices hosted on `dst_phy` back-to-back, the statuses are returned to `src_port`
+    // with a single `on_action_batch_result` if REQUIRE_STATUS_RESPONSE is set
+    void send_action_execute_batch(MeshProto::far_addr_t dst_phy, ushort src_port, const ActionBatchEntry* entries,
+                                   ubyte count, ubyte request_id, LogicalProto::ActionExecuteFlags flags,
+                                   OverlayProto::OverlayProtoType ovl_type = OverlayProto::OverlayProtoType::UNRELIABLE);
+
+    void send_action_execute_batch_result(LogicalAddress dst_addr, ubyte request_id,
+                                          const LogicalProto::ActionExecuteStatus* statuses, ubyte count);
+
+    // fetches actions of multiple devices hosted on `dst_phy`, responses come back to `src_port` in
+    // `on_action_multi_response`. those given right from `on_action_get` are aggregated, later ones come one by one
+    void send_action_fetch_multi(MeshProto::far_addr_t dst_phy, ushort src_port, const ActionBatchEntry* entries,
+                                 ubyte count, uint request_id);
+
+    // group members on `dst_phy` will receive the packet, use broadcast address to reach all members in the network
+    // nothing is allocated for invalid group ids (see is_valid_group), `ptr()` is nullptr then
+    LogicalPacketPtr alloc_group_packet_ptr(MeshProto::far_addr_t dst_phy, ushort group_id, ushort src_port, uint size,
+                                            OverlayProto::OverlayProtoType ovl_type,
+                                            LogicalProto::LogicalPacketType log_type);
+
     LogicalPacketPtr alloc_raw_logical_ptr(MeshProto::far_addr_t dst_phy, uint log_size,
                                            OverlayProto::OverlayProtoType ovl_type);
 
     void finish_ptr(LogicalPacketPtr ptr);
+
+    // load of the tx path (see TxScheduler::get_pressure), used to stretch non-strict subscription periods
+    uint get_tx_pressure();
+
+    // hands queued packets over to the transport while it's ready, called on every run and dispatched packet
+    void flush_tx();
+
+protected:
+    std::optional<FreshMeshTransport> own_transport; // set when created over MeshController
+    MeshTransport* transport;
+    Clock* clock;
+    alignas(64) LogicalPacketPool packet_pool; // apart from the hot fields of neighbour instances
+    u64 tick_time = 0;
+    uint tick_depth = 0; // packets dispatched locally from a tick don't start a new one
+
+    // scope of a tick, the outermost one samples the clock
+    class Tick
+    {
+    public:
+        LogicalDeviceManager* manager;
+
+        explicit Tick(LogicalDeviceManager* manager_) : manager(manager_) {
+            if (manager->tick_depth++ == 0)
+                manager->tick_time = manager->clock->now_us();
+        }
+
+        ~Tick() {
+            manager->tick_depth--;
+        }
+    };
+
+    uint dispatch_depth = 0;            // nested iterations over `group_members` or `broadcast_listeners`
+    bool dispatch_lists_dirty = false;  // devices left those lists meanwhile, see `compact_dispatch_lists`
+
+    // scope of an iteration over a dispatch list. handlers may join or leave groups and devices may be removed, so
+    // until the outermost scope ends leaving devices are only cleared in the lists, never erased from them
+    class DispatchScope
+    {
+    public:
+        LogicalDeviceManager* manager;
+
+        explicit DispatchScope(LogicalDeviceManager* manager_) : manager(manager_) {
+            manager->dispatch_depth++;
+        }
+
+        ~DispatchScope() {
+            if (--manager->dispatch_depth == 0 && manager->dispatch_lists_dirty)
+                manager->compact_dispatch_lists();
+        }
+    };
+
+    // drops entries cleared during dispatch
+    void compact_dispatch_lists();
+
+    // takes the full capacity of containers from the static arenas, so they don't grow after init
+    void reserve_memory();
+
+    // system time (us) when both the transport and `tx_scheduler` rate allow to send the next packet
+    u64 get_tx_ready_time();
+
+    // sends right away if nothing is queued and the transport is ready, queues the packet otherwise
+    void queue_tx(OverlayPacketBuilder* packet, LogicalProto::LogicalPacketType type);
+
+    // sends `header` (fixed part of a packet to another node) followed by `payload`. large packets are streamed
+    // to the transport if nothing is queued and there's no capture, otherwise they're serialized into a packet buffer
+    void send_with_payload(LogicalProto::LogicalPacket* header, MeshProto::far_addr_t dst_phy,
+                           PayloadSource& payload);
+
+    // packet must be validated with `validate_packet`
+    void dispatch_valid_packet(LogicalProto::LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy);
+
+    // packet must be validated with `validate_packet`
+    void handle_valid_packet(LogicalDevice* device, LogicalProto::LogicalPacket* packet, ushort size,
+                             MeshProto::far_addr_t src_phy);
+
+    // shared between wire and local paths
+    void process_action_execute(LogicalDevice* device, ushort action_id, const ubyte* data, uint size,
+                                LogicalAddress src_addr, ubyte request_id, LogicalProto::ActionExecuteFlags flags);
+
+    // calls `on_action_set` unless it's a repeated request with DEDUPLICATE flag, also for every batch entry
+    LogicalProto::ActionExecuteStatus execute_action(LogicalDevice* device, ushort action_id, const ubyte* data,
+                                                     uint size, LogicalAddress src_addr, ubyte request_id,
+                                                     LogicalProto::ActionExecuteFlags flags);
+
+    // ACTION_RESPONSE_MULTI being collected from `send_action_response` calls of ACTION_FETCH_MULTI handlers
+    struct MultiResponse
+    {
+        LogicalAddress requester;
+        uint request_id;
+        ushort port = LogicalProto::BROADCAST_PORT; // of the entry being handled
+        ushort action_id;
+        bool answered = false; // the entry being handled got its response
+        ubyte count = 0;
+        uint size = 0;
+        ubyte entries[ACTION_RESPONSE_MULTI_CAPACITY]; // ActionResponseMultiEntry list
+    };
+
+    MultiResponse* multi_response = nullptr; // innermost ACTION_FETCH_MULTI being handled
+
+    // ACTION_FETCH_MULTI entry not answered by its handler right away. devices answer it with the lower byte of the
+    // request id only, the full id is restored from here. the oldest one is overwritten
+    struct LateMultiAnswer
+    {
+        u64 time; // system time, us. zero if the slot is empty
+        LogicalAddress requester;
+        ushort port;
+        ushort action_id;
+        uint request_id;
+    };
+
+    LateMultiAnswer late_multi_answers[KHAWASU_MAX_PENDING_REQUESTS] = {};
+    uint late_multi_answers_next = 0;
+
+    // returns nullptr if the response doesn't answer a pending multi-fetch entry
+    LateMultiAnswer* find_late_multi_answer(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                                            ubyte request_id);
+
+    // returns false if the response doesn't answer a pending multi-fetch entry
+    bool send_late_multi_answer(LogicalAddress dst_addr, ushort src_port, ushort action_id, ubyte request_id,
+                                LogicalProto::ActionExecuteStatus status, const ubyte* data, uint size);
+
+    // ACTION_EXECUTE with DEDUPLICATE flag, the oldest one is overwritten
+    struct ExecutedRequest
+    {
+        u64 time; // system time, us. zero if the slot is empty
+        LogicalAddress src_addr;
+        ushort dst_port;
+        ushort action_id;
+        ubyte request_id;
+        LogicalProto::ActionExecuteStatus status;
+    };
+
+    ExecutedRequest execute_history[KHAWASU_EXECUTE_HISTORY_SIZE] = {};
+    uint execute_history_next = 0;
+
+    // returns nullptr if the request wasn't executed recently
+    ExecutedRequest* find_executed_request(LogicalAddress src_addr, ushort dst_port, ushort action_id,
+                                           ubyte request_id);
+
+    // batches are handled by the manager regardless of the destination port, packet must be validated
+    void process_action_execute_batch(const LogicalProto::LogicalPacket* packet, MeshProto::far_addr_t src_phy);
+
+    // same as above, for ACTION_FETCH_MULTI
+    void process_action_fetch_multi(const LogicalProto::LogicalPacket* packet, MeshProto::far_addr_t src_phy);
+
+    // device of a batch or multi-fetch entry if it accepts the packet, see `LogicalDevice::on_general_packet_accept`
+    LogicalDevice* accept_batch_entry(const LogicalProto::LogicalPacket* packet, MeshProto::far_addr_t src_phy,
+                                      ushort port);
+
+    // calls `on_action_get` of the device with `multi_response` collecting its answers
+    void collect_action_get(LogicalDevice* device, ushort port, ushort action_id, const ubyte* data, uint size);
+
+    // returns false if the response doesn't belong to `multi_response`
+    bool append_multi_response(LogicalAddress dst_addr, ushort src_port, ushort action_id,
+                               LogicalProto::ActionExecuteStatus status, const ubyte* data, uint size);
+
+    void flush_multi_response();
+
+    bool is_local_unicast(LogicalAddress dst_addr);
+
+    // returns nullptr if there's no such device or it discarded the packet
+    LogicalDevice* accept_local(ushort dst_port, ushort src_port, LogicalProto::LogicalPacketType type);
+
+    void handle_hello_world_compact(LogicalDevice* device, LogicalProto::LogicalPacket* packet, ushort size,
+                                    MeshProto::far_addr_t src_phy);
+
+    void handle_descriptor_response(LogicalProto::LogicalPacket* packet, ushort size);
+
+    void fetch_descriptor(LogicalDevice* device, LogicalAddress src_addr, uint hash, bool is_response);
+
+    void expire_descriptor_fetches(u64 time);
+
+    bool is_known_peer(LogicalAddress addr, uint hash);
+
+    // called after HELLO_WORLD_COMPACT was dispatched to every local receiver
+    void remember_peer(LogicalProto::LogicalPacket* packet, MeshProto::far_addr_t src_phy);
+
+    void schedule_discovery_reply(LogicalDevice* device);
+
+    uint random();
+
+    // passes decoded descriptor to `on_device_discover` as HELLO_WORLD or HELLO_WORLD_RESPONSE
+    void deliver_descriptor(LogicalDevice* device, DescriptorPacket& packet, bool is_response,
+                            LogicalAddress src_addr);
+
+    void index_broadcast_interest(LogicalDevice* device);
+
+    void unindex_broadcast_interest(LogicalDevice* device);
+
+    void index_groups(LogicalDevice* device);
+
+    void unindex_groups(LogicalDevice* device);
+
+    void send_groups_list(LogicalDevice* device, LogicalProto::LogicalPacketType type, const ushort* groups,
+                          ubyte count, LogicalAddress dst_addr);
 };
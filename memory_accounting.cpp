@@ -0,0 +1,159 @@
+#include "memory_accounting.h"
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+
+
+const char* get_memory_area_name(MemoryArea area) {
+    switch (area) {
+        case MemoryArea::PACKETS:    return "packets";
+        case MemoryArea::TX_QUEUE:   return "tx queue";
+        case MemoryArea::DEVICES:    return "devices";
+        case MemoryArea::DISCOVERY:  return "discovery";
+        case MemoryArea::PROPERTIES: return "properties";
+    }
+    return "unknown";
+}
+
+static void account_alloc(MemoryArea area, size_t size) {
+    auto& stats = memory_stats[(ubyte) area];
+    auto live = stats.live.fetch_add(size, std::memory_order_relaxed) + size;
+    auto peak = stats.peak.load(std::memory_order_relaxed);
+    while (live > peak && !stats.peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) { }
+    stats.allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void account_free(MemoryArea area, size_t size) {
+    memory_stats[(ubyte) area].live.fetch_sub(size, std::memory_order_relaxed);
+}
+
+
+#if KHAWASU_STATIC_MEMORY
+// fixed buffer split into power-of-two blocks on demand, freed blocks are kept in per-size free lists
+class MemoryArena
+{
+public:
+    static constexpr uint MIN_BLOCK = 16; // also the alignment of every block
+    static constexpr uint CLASS_COUNT = 12; // blocks up to MIN_BLOCK << 11 (32 KiB)
+
+    ubyte* buffer;
+    size_t capacity;
+
+    MemoryArena(ubyte* buffer_, size_t capacity_) : buffer(buffer_), capacity(capacity_) { }
+
+    // nullptr if there's no room
+    void* alloc(size_t size) {
+        auto size_class = get_size_class(size);
+        if (size_class >= CLASS_COUNT)
+            return nullptr;
+
+        lock();
+        void* block = free_lists[size_class];
+        if (block)
+            free_lists[size_class] = *(void**) block;
+        else if (used + (MIN_BLOCK << size_class) <= capacity) {
+            block = buffer + used;
+            used += MIN_BLOCK << size_class;
+        }
+        unlock();
+        return block;
+    }
+
+    void free(void* ptr, size_t size) {
+        auto size_class = get_size_class(size);
+        lock();
+        *(void**) ptr = free_lists[size_class];
+        free_lists[size_class] = ptr;
+        unlock();
+    }
+
+private:
+    size_t used = 0;
+    void* free_lists[CLASS_COUNT] = {};
+    std::atomic_flag locked = ATOMIC_FLAG_INIT; // managers may run on different cores
+
+    static uint get_size_class(size_t size) {
+        auto block = std::bit_ceil(std::max<size_t>(size, MIN_BLOCK));
+        return std::countr_zero(block / MIN_BLOCK);
+    }
+
+    void lock() {
+        while (locked.test_and_set(std::memory_order_acquire)) { }
+    }
+
+    void unlock() {
+        locked.clear(std::memory_order_release);
+    }
+};
+
+alignas(MemoryArena::MIN_BLOCK) static ubyte packets_arena[KHAWASU_ARENA_PACKETS];
+alignas(MemoryArena::MIN_BLOCK) static ubyte tx_queue_arena[KHAWASU_ARENA_TX_QUEUE];
+alignas(MemoryArena::MIN_BLOCK) static ubyte devices_arena[KHAWASU_ARENA_DEVICES];
+alignas(MemoryArena::MIN_BLOCK) static ubyte discovery_arena[KHAWASU_ARENA_DISCOVERY];
+alignas(MemoryArena::MIN_BLOCK) static ubyte properties_arena[KHAWASU_ARENA_PROPERTIES];
+
+static MemoryArena arenas[MEMORY_AREA_COUNT] = {
+    {packets_arena, sizeof(packets_arena)},
+    {tx_queue_arena, sizeof(tx_queue_arena)},
+    {devices_arena, sizeof(devices_arena)},
+    {discovery_arena, sizeof(discovery_arena)},
+    {properties_arena, sizeof(properties_arena)},
+};
+
+size_t get_memory_arena_size(MemoryArea area) {
+    return arenas[(ubyte) area].capacity;
+}
+
+void* memory_alloc(MemoryArea area, size_t size) {
+    if (auto block = arenas[(ubyte) area].alloc(size)) {
+        account_alloc(area, size);
+        return block;
+    }
+
+    // the containers can't handle a failed allocation, and falling back to the heap would hide the wrong capacities
+    printf("memory_alloc: %s arena is exhausted (%zu of %zu bytes live, %zu requested), raise the capacities in "
+           "khawasu_config.h\n", get_memory_area_name(area), memory_stats[(ubyte) area].live.load(),
+           get_memory_arena_size(area), size);
+    print_memory_report();
+    fflush(stdout);
+    abort();
+}
+
+void memory_free(MemoryArea area, void* ptr, size_t size) {
+    if (ptr == nullptr)
+        return;
+
+    account_free(area, size);
+    arenas[(ubyte) area].free(ptr, size);
+}
+#else
+size_t get_memory_arena_size(MemoryArea area) {
+    return 0;
+}
+
+void* memory_alloc(MemoryArea area, size_t size) {
+    account_alloc(area, size);
+    return malloc(size);
+}
+
+void memory_free(MemoryArea area, void* ptr, size_t size) {
+    if (ptr == nullptr)
+        return;
+
+    account_free(area, size);
+    free(ptr);
+}
+#endif
+
+
+void print_memory_report() {
+    printf("%-10s %10s %10s %10s %12s\n", "area", "live", "peak", "arena", "allocations");
+    for (uint i = 0; i < MEMORY_AREA_COUNT; ++i) {
+        auto& stats = memory_stats[i];
+        printf("%-10s %10zu %10zu %10zu %12llu\n", get_memory_area_name((MemoryArea) i),
+               stats.live.load(std::memory_order_relaxed), stats.peak.load(std::memory_order_relaxed),
+               get_memory_arena_size((MemoryArea) i),
+               (unsigned long long) stats.allocations.load(std::memory_order_relaxed));
+    }
+}
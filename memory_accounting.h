@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "khawasu_config.h"
+#include "types.h"
+
+// heap usage of the core by area: live bytes, high-water mark and allocation count, shared by all managers
+//
+// containers of the core take AccountedAllocator of their area. with KHAWASU_STATIC_MEMORY every area is served
+// from a static arena sized at build time (see khawasu_config.h), freed blocks are reused by later allocations of
+// the same size class, so once the capacities are reached at init nothing comes from the heap. an allocation not
+// fitting into its arena aborts with the memory report: the capacities are too small for the application, or
+// KHAWASU_MAX_PACKET_SIZE was exceeded
+//
+// packet pools (LOG_PACKET_POOL_ALLOC_COUNT parts per manager) and subscriber slots (KHAWASU_SUBSCRIBERS_PER_DEVICE
+// per device) are a part of their owners and never touch the heap
+//
+// not accounted: PacketCapture buffers and the name tables of logical_proto.h (debugging and tools only)
+
+enum class MemoryArea : ubyte
+{
+    PACKETS = 0, // OverlayPacketBuilder, packet buffers not fitting into the packet pool, materialized payloads,
+                 // streams collected for transports without streaming
+    TX_QUEUE,    // TxScheduler queues
+    DEVICES,     // device map, group members, broadcast listeners, discovery replies, DeviceDescriptor contents,
+                 // serialized descriptors, action value caches
+    DISCOVERY,   // known peers, descriptor cache, pending descriptor fetches
+    PROPERTIES,  // PropertyStore index, file and memory-only store images
+};
+
+const uint MEMORY_AREA_COUNT = 5;
+
+struct MemoryAreaStats
+{
+    std::atomic<size_t> live{0};       // bytes
+    std::atomic<size_t> peak{0};       // bytes
+    std::atomic<u64> allocations{0};
+};
+
+inline MemoryAreaStats memory_stats[MEMORY_AREA_COUNT];
+
+const char* get_memory_area_name(MemoryArea area);
+
+// bytes of the static arena of the area, zero without KHAWASU_STATIC_MEMORY
+size_t get_memory_arena_size(MemoryArea area);
+
+void* memory_alloc(MemoryArea area, size_t size);
+
+// `size` must be the one passed to `memory_alloc`
+void memory_free(MemoryArea area, void* ptr, size_t size);
+
+// prints the table of all areas
+void print_memory_report();
+
+
+template <typename T, MemoryArea area>
+class AccountedAllocator
+{
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = AccountedAllocator<U, area>;
+    };
+
+    AccountedAllocator() = default;
+
+    template <typename U>
+    AccountedAllocator(const AccountedAllocator<U, area>&) { }
+
+    T* allocate(size_t count) {
+        return (T*) memory_alloc(area, count * sizeof(T));
+    }
+
+    void deallocate(T* ptr, size_t count) {
+        memory_free(area, ptr, count * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const AccountedAllocator<U, area>&) const {
+        return true;
+    }
+};
+
+template <typename T, MemoryArea area>
+using AccountedVector = std::vector<T, AccountedAllocator<T, area>>;
+
+template <typename T, MemoryArea area>
+using AccountedDeque = std::deque<T, AccountedAllocator<T, area>>;
+
+template <typename T, MemoryArea area>
+using AccountedList = std::list<T, AccountedAllocator<T, area>>;
+
+template <typename K, typename V, MemoryArea area>
+using AccountedMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                                        AccountedAllocator<std::pair<const K, V>, area>>;
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <mesh_controller.h>
+#include <mesh_stream_builder.h>
+#include <optional>
+#include "memory_accounting.h"
+#include "payload_source.h"
+#include "types.h"
+
+// physical layer under the overlay protocol, normally the fresh mesh
+// LogicalDeviceManager sends complete overlay packets through it, received overlay packets are passed back with
+// LogicalDeviceManager::dispatch_overlay_packet
+class MeshTransport
+{
+public:
+    virtual MeshProto::far_addr_t get_self_addr() = 0;
+
+    // `data` is a complete overlay packet, it's only valid during the call
+    virtual void send(MeshProto::far_addr_t dst_phy, const ubyte* data, uint size) = 0;
+
+    // system time (us) when the transport can take the next packet without queueing it on its own, see TxScheduler
+    // transports not knowing their state always accept packets
+    virtual u64 get_ready_time() {
+        return 0;
+    }
+
+    // streamed send of an overlay packet of `size` bytes: its parts are written to the returned sink in order, the
+    // packet leaves once all of them are written. transports without streaming collect the parts for `send`
+    virtual PayloadSink& begin_stream(MeshProto::far_addr_t dst_phy, uint size) {
+        collected_stream.begin(dst_phy, size);
+        return collected_stream;
+    }
+
+protected:
+    class CollectedStream : public PayloadSink
+    {
+    public:
+        MeshTransport* transport;
+        MeshProto::far_addr_t dst_phy = 0;
+        uint size = 0;
+        AccountedVector<ubyte, MemoryArea::PACKETS> data;
+
+        explicit CollectedStream(MeshTransport* transport_) : transport(transport_) { }
+
+        void begin(MeshProto::far_addr_t dst_phy_, uint size_) {
+            dst_phy = dst_phy_;
+            size = size_;
+            data.clear();
+        }
+
+        void write(const ubyte* part, uint part_size) override {
+            data.insert(data.end(), part, part + part_size);
+            if (data.size() < size)
+                return;
+
+            transport->send(dst_phy, data.data(), size);
+            data.clear();
+            data.shrink_to_fit(); // streams are large, not keeping the buffer around
+        }
+    };
+
+    CollectedStream collected_stream{this};
+};
+
+// the fresh mesh doesn't report when its radio is busy, TxScheduler paces it with KHAWASU_TX_RATE
+class FreshMeshTransport : public MeshTransport
+{
+public:
+    MeshController& mesh;
+
+    explicit FreshMeshTransport(MeshController& mesh_) : mesh(mesh_) { }
+
+    MeshProto::far_addr_t get_self_addr() override {
+        return mesh.self_addr;
+    }
+
+    void send(MeshProto::far_addr_t dst_phy, const ubyte* data, uint size) override {
+        MeshStreamBuilder stream(mesh, dst_phy, size);
+        stream.write(data, size);
+    }
+
+    // the parts go right into mesh stream chunks
+    PayloadSink& begin_stream(MeshProto::far_addr_t dst_phy, uint size) override {
+        builder_stream.builder.emplace(mesh, dst_phy, size);
+        builder_stream.left = size;
+        return builder_stream;
+    }
+
+protected:
+    class BuilderStream : public PayloadSink
+    {
+    public:
+        std::optional<MeshStreamBuilder> builder;
+        uint left = 0;
+
+        void write(const ubyte* part, uint part_size) override {
+            builder->write(part, part_size);
+            left -= part_size;
+            if (left == 0)
+                builder.reset();
+        }
+    };
+
+    BuilderStream builder_stream;
+};
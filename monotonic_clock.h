@@ -0,0 +1,47 @@
+#pragma once
+
+#include "platform.h"
+#include "types.h"
+
+// time source of a LogicalDeviceManager, microseconds that never go backwards
+// the manager samples it once per tick (see LogicalDeviceManager::get_time), so it's never read per device
+class Clock
+{
+public:
+    virtual ~Clock() = default;
+
+    virtual u64 now_us() = 0;
+};
+
+class SystemClock : public Clock
+{
+public:
+    u64 now_us() override {
+        return KhawasuOsApi::get_microseconds();
+    }
+};
+
+// advanced only by hand, for deterministic tests and simulations running faster than real time
+// starts at 1 as zero timestamps mean "never" in a few places
+class VirtualClock : public Clock
+{
+public:
+    explicit VirtualClock(u64 start_us = 1) : time(start_us) { }
+
+    u64 now_us() override {
+        return time;
+    }
+
+    inline void advance(u64 delta_us) {
+        time += delta_us;
+    }
+
+    // moves the clock forward to `time_us`, earlier times are ignored
+    inline void advance_to(u64 time_us) {
+        if (time_us > time)
+            time = time_us;
+    }
+
+private:
+    u64 time;
+};
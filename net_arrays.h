@@ -0,0 +1,84 @@
+#pragma once
+
+#include <bit>
+#include <cstring>
+#include <type_traits>
+#include "payload_source.h"
+#include "types.h"
+
+// bulk counterparts of net_store / net_load for arrays of integers (dimmer channels, histogram bins and so on)
+// multi-byte values are little-endian on the wire, so on little-endian hosts (ESP32, x86, ARM) an array is already
+// in wire order and the whole conversion is one memcpy, which libc does with the widest vector moves available.
+// big-endian hosts swap every value, the loop is simple enough to be vectorized by the compiler
+
+template <typename T>
+constexpr T byte_swap(T value) {
+    static_assert(std::is_integral_v<T>);
+    if constexpr (sizeof(T) == 1)
+        return value;
+    else if constexpr (sizeof(T) == 2)
+        return (T) __builtin_bswap16((ushort) value);
+    else if constexpr (sizeof(T) == 4)
+        return (T) __builtin_bswap32((uint) value);
+    else
+        return (T) __builtin_bswap64((u64) value);
+}
+
+// `dst` may be unaligned, e.g. a packet payload
+template <typename T>
+inline void net_store_array(void* dst, const T* src, uint count) {
+    if constexpr (std::endian::native == std::endian::little) {
+        memcpy(dst, src, count * sizeof(T));
+    } else {
+        auto out = (ubyte*) dst;
+        for (uint i = 0; i < count; ++i) {
+            auto value = byte_swap(src[i]);
+            memcpy(out + i * sizeof(T), &value, sizeof(T));
+        }
+    }
+}
+
+// `src` may be unaligned
+template <typename T>
+inline void net_load_array(T* dst, const void* src, uint count) {
+    memcpy(dst, src, count * sizeof(T));
+    if constexpr (std::endian::native != std::endian::little) {
+        for (uint i = 0; i < count; ++i)
+            dst[i] = byte_swap(dst[i]);
+    }
+}
+
+
+// array sent as a payload, see payload_source.h. written as is on little-endian hosts, so it's never copied before
+// reaching the packet, big-endian hosts convert it in small parts
+template <typename T>
+class ArrayPayload : public PayloadSource
+{
+public:
+    const T* values;
+    uint count;
+
+    ArrayPayload(const T* values_, uint count_) : values(values_), count(count_) { }
+
+    uint get_size() override {
+        return count * sizeof(T);
+    }
+
+    void write_to(PayloadSink& sink) override {
+        if constexpr (std::endian::native == std::endian::little) {
+            sink.write((const ubyte*) values, get_size());
+        } else {
+            constexpr uint PART_COUNT = 64 / sizeof(T);
+            ubyte part[PART_COUNT * sizeof(T)];
+            for (uint i = 0; i < count; i += PART_COUNT) {
+                auto part_count = std::min(PART_COUNT, count - i);
+                net_store_array(part, values + i, part_count);
+                sink.write(part, part_count * sizeof(T));
+            }
+        }
+    }
+
+    const ubyte* get_contiguous() override {
+        return std::endian::native == std::endian::little ? (const ubyte*) values : nullptr;
+    }
+};
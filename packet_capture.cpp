@@ -0,0 +1,84 @@
+#include "packet_capture.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+
+// ring
+CaptureRing::CaptureRing(uint capacity) : buffer(std::bit_ceil(std::max(capacity, 64u))), mask(buffer.size() - 1) { }
+
+void CaptureRing::copy_in(size_t pos, const void* src, uint size) {
+    auto offset = pos & mask;
+    auto first_part = std::min<size_t>(size, buffer.size() - offset);
+    memcpy(buffer.data() + offset, src, first_part);
+    memcpy(buffer.data(), (const ubyte*) src + first_part, size - first_part);
+}
+
+bool CaptureRing::push(const void* first, uint first_size, const void* second, uint second_size) {
+    auto pos = head.load(std::memory_order_relaxed);
+    auto free_space = buffer.size() - (pos - tail.load(std::memory_order_acquire));
+    if (first_size + second_size > free_space)
+        return false;
+
+    copy_in(pos, first, first_size);
+    copy_in(pos + first_size, second, second_size);
+    head.store(pos + first_size + second_size, std::memory_order_release);
+    return true;
+}
+
+uint CaptureRing::pop(void* dst, uint max_size) {
+    auto pos = tail.load(std::memory_order_relaxed);
+    auto size = (uint) std::min<size_t>(head.load(std::memory_order_acquire) - pos, max_size);
+
+    auto offset = pos & mask;
+    auto first_part = std::min<size_t>(size, buffer.size() - offset);
+    memcpy(dst, buffer.data() + offset, first_part);
+    memcpy((ubyte*) dst + first_part, buffer.data(), size - first_part);
+    tail.store(pos + size, std::memory_order_release);
+    return size;
+}
+
+
+// capture
+bool PacketCapture::write_header(FILE* file) {
+    CaptureFileHeader header{};
+    memcpy(header.magic, CaptureFileHeader::MAGIC, sizeof(header.magic));
+    net_store(header.version, CaptureFileHeader::VERSION);
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+size_t PacketCapture::drain(FILE* file) {
+    ubyte chunk[1024];
+    size_t written = 0;
+    while (auto size = ring.pop(chunk, sizeof(chunk)))
+        written += fwrite(chunk, 1, size, file);
+    return written;
+}
+
+
+// reader
+CaptureReader::CaptureReader(FILE* file_) : file(file_) {
+    CaptureFileHeader header;
+    if (!file || fread(&header, sizeof(header), 1, file) != 1)
+        return;
+    if (memcmp(header.magic, CaptureFileHeader::MAGIC, sizeof(header.magic)) != 0)
+        return;
+    if (net_load(header.version) != CaptureFileHeader::VERSION) {
+        printf("CaptureReader: unsupported capture version %d\n", net_load(header.version));
+        return;
+    }
+    valid = true;
+}
+
+bool CaptureReader::next(CaptureRecordHeader& header, std::vector<ubyte>& packet) {
+    if (!valid || fread(&header, sizeof(header), 1, file) != 1)
+        return false;
+
+    header.time = net_load(header.time);
+    header.src_phy = net_load(header.src_phy);
+    header.dst_phy = net_load(header.dst_phy);
+    header.size = net_load(header.size);
+
+    packet.resize(header.size);
+    return fread(packet.data(), 1, header.size, file) == header.size;
+}
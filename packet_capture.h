@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <vector>
+#include "net_utils.h"
+#include "types.h"
+
+// capture of logical traffic, see LogicalDeviceManager::capture
+//
+// file format, all fields in little-endian (stored with net_store, like the packets themselves):
+//  CaptureFileHeader, then for every packet: CaptureRecordHeader followed by `size` bytes of the logical packet
+// packets larger than 65535 bytes don't fit the record header and are dropped
+// the manager thread only appends records to a lock-free ring, another thread (or the idle part of the main loop)
+// drains it to the file. records which don't fit into the ring are dropped and counted, never waited for
+
+enum class CaptureDirection : ubyte
+{
+    RX = 0, // passed to dispatch_packet
+    TX = 1, // sent with finish_ptr
+};
+
+#pragma pack(push, 1)
+struct CaptureFileHeader
+{
+    static constexpr char MAGIC[4] = {'K', 'H', 'C', 'P'};
+    static constexpr ushort VERSION = 1;
+
+    char magic[4];
+    ushort version;
+    ushort reserved;
+};
+
+struct CaptureRecordHeader
+{
+    u64 time;     // manager time, us
+    uint src_phy;
+    uint dst_phy;
+    CaptureDirection direction;
+    ushort size;  // of the logical packet following this header
+};
+#pragma pack(pop)
+
+
+// single producer, single consumer byte ring
+class CaptureRing
+{
+public:
+    // capacity is rounded up to a power of two
+    explicit CaptureRing(uint capacity);
+
+    // appends both parts or nothing, producer side
+    bool push(const void* first, uint first_size, const void* second, uint second_size);
+
+    // takes up to `max_size` bytes, consumer side
+    uint pop(void* dst, uint max_size);
+
+private:
+    std::vector<ubyte> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // written by producer
+    alignas(64) std::atomic<size_t> tail{0}; // written by consumer
+
+    void copy_in(size_t pos, const void* src, uint size);
+};
+
+
+class PacketCapture
+{
+public:
+    explicit PacketCapture(uint ring_size = 64 * 1024) : ring(ring_size) { }
+
+    // producer side, called by LogicalDeviceManager
+    inline void record(CaptureDirection direction, u64 time, uint src_phy, uint dst_phy, const void* packet,
+                       uint size) {
+        if (size > 0xFFFF) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        CaptureRecordHeader header;
+        net_store(header.time, time);
+        net_store(header.src_phy, src_phy);
+        net_store(header.dst_phy, dst_phy);
+        header.direction = direction;
+        net_store(header.size, size);
+        if (!ring.push(&header, sizeof(header), packet, size))
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static bool write_header(FILE* file);
+
+    // consumer side, moves everything captured so far to `file`. returns amount of bytes written
+    size_t drain(FILE* file);
+
+    // records not captured because the ring was full or the packet was too large
+    inline u64 get_dropped() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    CaptureRing ring;
+    std::atomic<u64> dropped{0};
+};
+
+
+class CaptureReader
+{
+public:
+    // reads and checks the file header, check `is_valid` before use
+    explicit CaptureReader(FILE* file_);
+
+    inline bool is_valid() const {
+        return valid;
+    }
+
+    // returns false at the end of the file or on a truncated record. `header` is converted to host order
+    bool next(CaptureRecordHeader& header, std::vector<ubyte>& packet);
+
+private:
+    FILE* file;
+    bool valid = false;
+};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include "memory_accounting.h"
+#include "types.h"
+
+// payloads serialized part by part straight into the outgoing packet (or into the transport stream for large
+// packets), so a payload assembled from several buffers or generated on the fly is never materialized in RAM first
+
+
+// receives the parts of a payload in order
+class PayloadSink
+{
+public:
+    virtual ~PayloadSink() = default;
+
+    virtual void write(const ubyte* data, uint size) = 0;
+};
+
+// payload of a known size. `write_to` must write exactly `get_size` bytes and may be called more than once
+// (subscription filters read the payload before it's sent)
+class PayloadSource
+{
+public:
+    virtual ~PayloadSource() = default;
+
+    virtual uint get_size() = 0;
+
+    virtual void write_to(PayloadSink& sink) = 0;
+
+    // the whole payload if it's already in one buffer, nullptr otherwise
+    virtual const ubyte* get_contiguous() {
+        return nullptr;
+    }
+};
+
+
+struct PayloadSlice
+{
+    const ubyte* data;
+    uint size;
+};
+
+// iovec-like payload, the slices are written back-to-back. slices must outlive the payload
+class SlicedPayload : public PayloadSource
+{
+    PayloadSlice single{};
+
+public:
+    const PayloadSlice* slices;
+    uint count;
+
+    SlicedPayload(const PayloadSlice* slices_, uint count_) : slices(slices_), count(count_) { }
+
+    // single buffer
+    SlicedPayload(const ubyte* data, uint size) : single{data, size}, slices(&single), count(1) { }
+
+    SlicedPayload(const SlicedPayload&) = delete;
+
+    uint get_size() override {
+        uint size = 0;
+        for (uint i = 0; i < count; ++i)
+            size += slices[i].size;
+        return size;
+    }
+
+    void write_to(PayloadSink& sink) override {
+        for (uint i = 0; i < count; ++i)
+            sink.write(slices[i].data, slices[i].size);
+    }
+
+    const ubyte* get_contiguous() override {
+        return count == 1 ? slices[0].data : nullptr;
+    }
+};
+
+// payload generated by `writer(sink)` on every `write_to`, e.g. values serialized one by one
+template <typename TWriter>
+class WriterPayload : public PayloadSource
+{
+public:
+    uint size;
+    TWriter writer;
+
+    WriterPayload(uint size_, TWriter writer_) : size(size_), writer(writer_) { }
+
+    uint get_size() override {
+        return size;
+    }
+
+    void write_to(PayloadSink& sink) override {
+        writer(sink);
+    }
+};
+
+
+// writes into a buffer of a fixed size, parts beyond it are dropped
+class BufferSink : public PayloadSink
+{
+public:
+    ubyte* buffer;
+    uint capacity;
+    uint size = 0;
+
+    BufferSink(ubyte* buffer_, uint capacity_) : buffer(buffer_), capacity(capacity_) { }
+
+    void write(const ubyte* data, uint size_) override {
+        auto part = std::min(size_, capacity - size);
+        memcpy(buffer + size, data, part);
+        size += part;
+    }
+};
+
+// contiguous copy of the payload, for the paths that need one (same-node delivery, caches)
+inline AccountedVector<ubyte, MemoryArea::PACKETS> materialize_payload(PayloadSource& payload) {
+    AccountedVector<ubyte, MemoryArea::PACKETS> data(payload.get_size());
+    BufferSink sink(data.data(), data.size());
+    payload.write_to(sink);
+    return data;
+}
@@ -15,8 +15,9 @@ namespace KhawasuOsApi
 #include <chrono>
 namespace KhawasuOsApi
 {
+    // steady_clock is monotonic, unlike high_resolution_clock which may follow wall time
     inline u64 get_microseconds() {
-        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
     }
 }
 #endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "types.h"
+#include "memory_accounting.h"
 #include <bitset>
 
 
@@ -13,22 +14,23 @@ public:
 
     void* alloc(uint size) {
         if (size > piece_size)
-            return malloc(size);
+            return memory_alloc(MemoryArea::PACKETS, size);
         if (used_bits.all())
-            return malloc(size);
+            return memory_alloc(MemoryArea::PACKETS, size);
         for (int i = 0; i < count; ++i) {
             if (!used_bits[i]) {
                 used_bits[i] = 1;
                 return packets[i];
             }
         }
-        return malloc(size);
+        return memory_alloc(MemoryArea::PACKETS, size);
     }
 
-    void free(void* ptr_) {
+    // `size` must be the one passed to `alloc`
+    void free(void* ptr_, uint size) {
         auto ptr = (ubyte*) ptr_;
         if (&packets[0][0] > ptr || ptr > &packets[count - 1][piece_size - 1])
-            free(ptr);
+            memory_free(MemoryArea::PACKETS, ptr, size);
         else {
             auto index = (ptr - &packets[0][0]) / piece_size;
             used_bits[index] = 0;
@@ -1,131 +1,76 @@
 #pragma once
 #include <cstring>
+#include <new>
+#include <type_traits>
 #include "types.h"
+#include "crc32.h"
+#include "property_store.h"
 
-constexpr uint crc32(const ubyte* message, uint size) {
-    uint crc = 0xFFFFFFFF;
-
-    for (int i = 0; i < size; ++i) {
-        uint byte = message[i];            // Get next byte.
-        crc = crc ^ byte;
-        for (int j = 7; j >= 0; j--) {    // Do eight times.
-            uint mask = -(crc & 1);
-            crc = (crc >> 1) ^ (0xEDB88320 & mask);
-        }
-    }
-    return ~crc;
+// id of the stored type, it must not depend on the toolchain. arithmetic types and enums are identified by their kind,
+// other types name their layout with `static constexpr ushort PROPERTY_TYPE_ID` (bump it when the meaning of the
+// fields changes). zero for types without it, their values are checked by size only
+template <typename T>
+constexpr ushort get_property_type_id() {
+    if constexpr (requires { T::PROPERTY_TYPE_ID; })
+        return T::PROPERTY_TYPE_ID;
+    else if constexpr (std::is_array_v<T>)
+        return get_property_type_id<std::remove_extent_t<T>>();
+    else if constexpr (std::is_same_v<T, bool>)
+        return 0xFF01;
+    else if constexpr (std::is_enum_v<T>)
+        return 0xFF02;
+    else if constexpr (std::is_floating_point_v<T>)
+        return 0xFF03;
+    else if constexpr (std::is_integral_v<T>)
+        return std::is_signed_v<T> ? 0xFF04 : 0xFF05;
+    else
+        return 0;
 }
 
-#ifdef ESP_PLATFORM
-#include <nvs.h>
-class Storage
-{
-public:
-    nvs_handle_t handle = -1;
-
-    void init() {
-        if(handle == -1)
-            open();
-    }
-
-    void open() {
-        nvs_open("preprop", NVS_READWRITE, &handle);
-    }
-
-    template<typename T>
-    void save(const char* key, const T& value) {
-        nvs_set_blob(handle, key, &value, sizeof(T));
-        nvs_commit(handle);
-    }
-
-    template <typename T>
-    bool read(const char* key, T& value) {
-        size_t size = sizeof(T);
-        auto err = nvs_get_blob(handle, key, &value, &size);
-
-        if (err == ESP_ERR_NVS_NOT_FOUND) {
-            return false;
-        } else if(err != ESP_OK || size != sizeof(T)) {
-            printf("PreProp failed NVS for %s\n", key);
-            return false;
-        }
-
-        return true;
-    }
-};
-#else
-#include <unordered_map>
-class Storage
-{
-public:
-    std::unordered_map<const char*, void*> data;
-
-    void init() {
-        //
-    }
-
-    void open() {
-        //
-    }
-
-    template<typename T>
-    void save(const char* key, const T& value) {
-        data[key] = (void*)value;
-    }
-
-    template <typename T>
-    bool read(const char* key, T& value) {
-        auto value_it = data.find(key);
-        if (value_it == data.end())
-            return false;
-
-        value = *(T*)value_it->second;
+// tag stored with the value, mixes the type id with the size. zero if the type has no id
+template <typename T>
+constexpr ushort get_property_type_tag() {
+    uint id = get_property_type_id<T>();
+    if (id == 0)
+        return 0;
 
-        return true;
-    }
-};
-#endif
+    uint hash = 2166136261u;
+    for (uint part : {id & 0xFF, id >> 8, (uint) sizeof(T) & 0xFF, (uint) sizeof(T) >> 8})
+        hash = (hash ^ part) * 16777619u;
 
-inline Storage storage;
+    auto tag = (ushort) (hash ^ (hash >> 16));
+    return tag ? tag : 1;
+}
 
-// todo: invalidate nvs on new firmware
+// value kept across reboots in a PropertyStore, keyed by the instance (usually the device port) and the name
 template <typename T>
 class PreservedProperty {
+    static_assert(std::is_trivially_copyable_v<T>, "stored as raw bytes");
+
+    static constexpr ushort TYPE_TAG = get_property_type_tag<T>();
+
+    PropertyStore* store;
     ushort instance_id;
-    const char* name;
+    ushort name_crc;
     T value;
-    char nvs_key[16];
 
 public:
 
     template <typename... TArgs>
-    explicit PreservedProperty(ushort instance_id_, const char* name_, TArgs... args) : instance_id(instance_id_), name(name_) {
-        storage.init();
-        getFilename(nvs_key); // Caching key
+    explicit PreservedProperty(PropertyStore* store_, ushort instance_id_, const char* name_, TArgs... args)
+    : store(store_), instance_id(instance_id_), name_crc((ushort) crc32((const ubyte*) name_, strlen(name_))) {
         load(args...);
     }
 
-    // Get filename to "key"
-    void getFilename(char key[16]) {
-        char instance_id_str[5];
-        itoa(instance_id, instance_id_str, 16);
-
-        char name_crc_str[5];
-        auto name_crc = (ushort)crc32((const uint8_t*)name, strlen(name));
-        itoa(name_crc, name_crc_str, 16);
-
-        strcpy(key, instance_id_str);
-        strcat(key, ":");
-        strcat(key, name_crc_str);
-    }
+    // kept in the default store
+    template <typename... TArgs>
+    explicit PreservedProperty(ushort instance_id_, const char* name_, TArgs... args)
+    : PreservedProperty(&default_property_store, instance_id_, name_, args...) { }
 
     template <typename... TArgs>
     void load(TArgs... args) {
-        auto err = storage.read(nvs_key, value);
-
-        if (!err){
+        if (!store->read(instance_id, name_crc, &value, sizeof(T), TYPE_TAG))
             new (&value) T { args... };
-        }
     }
 
     const T& operator=(const T& new_value) {
@@ -134,7 +79,7 @@ public:
             return value;
 
         value = new_value;
-        storage.save(nvs_key, value);
+        store->write(instance_id, name_crc, &value, sizeof(T), TYPE_TAG);
 
         return value;
     }
@@ -142,7 +87,12 @@ public:
     const T& operator* () {
         return value;
     }
+
+    const T* operator-> () {
+        return &value;
+    }
 };
 
 
-#define PROPERTY(type, name, ...) PreservedProperty<type> name{self_port, #name, __VA_ARGS__};
+// properties of logical devices are kept in the store of their LogicalDeviceManager
+#define PROPERTY(type, name, ...) PreservedProperty<type> name{get_property_store(), self_port, #name, __VA_ARGS__};
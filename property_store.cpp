@@ -0,0 +1,400 @@
+#include "property_store.h"
+#include <algorithm>
+#include <cstring>
+#include "crc32.h"
+
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+#include <nvs.h>
+#endif
+
+
+// region
+#ifdef ESP_PLATFORM
+bool PropertyStore::map_region(const char* name) {
+    auto part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, name);
+    if (part == nullptr) {
+        printf("PropertyStore: no %s partition\n", name);
+        return false;
+    }
+
+    const void* ptr;
+    esp_partition_mmap_handle_t handle;
+    if (esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &ptr, &handle) != ESP_OK) {
+        printf("PropertyStore: can't map %s partition\n", name);
+        return false;
+    }
+
+    partition = part;
+    mmap_handle = handle;
+    region = (const ubyte*) ptr;
+    bank_size = part->size / 2 / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE; // banks are erased by sectors
+    return true;
+}
+
+void PropertyStore::unmap_region() {
+    if (partition)
+        esp_partition_munmap(mmap_handle);
+    if (nvs_store)
+        nvs_close(nvs_store);
+    partition = nullptr;
+    nvs_store = 0;
+    region = nullptr;
+}
+
+bool PropertyStore::write_region(uint offset, const void* data, uint size) {
+    if (partition == nullptr) {
+        memcpy(image.data() + offset, data, size);
+        return true;
+    }
+    return esp_partition_write((const esp_partition_t*) partition, offset, data, size) == ESP_OK;
+}
+
+bool PropertyStore::erase_bank(int bank_index) {
+    if (partition == nullptr) {
+        memset(image.data() + bank_index * bank_size, 0xFF, bank_size);
+        return true;
+    }
+    return esp_partition_erase_range((const esp_partition_t*) partition, bank_index * bank_size, bank_size) == ESP_OK;
+}
+
+void PropertyStore::open_default() {
+    if (map_region(KHAWASU_PROPERTY_PARTITION)) {
+        load();
+        if (bank == -1)
+            import_nvs();
+    } else if (open_nvs())
+        printf("PropertyStore: keeping properties in NVS\n");
+    else
+        printf("PropertyStore: NVS isn't available, properties won't be preserved\n");
+}
+
+static void get_nvs_key(char* key, ushort instance_id, ushort name_crc) {
+    snprintf(key, NVS_KEY_NAME_MAX_SIZE, "%x:%x", instance_id, name_crc);
+}
+
+bool PropertyStore::open_nvs() {
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+        return false;
+
+    nvs_store = handle;
+    return true;
+}
+
+bool PropertyStore::read_nvs(ushort instance_id, ushort name_crc, void* value, uint size) {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    get_nvs_key(key, instance_id, name_crc);
+
+    size_t stored_size = size;
+    auto err = nvs_get_blob(nvs_store, key, value, &stored_size);
+    if (err == ESP_ERR_NVS_NOT_FOUND)
+        return false;
+    if (err != ESP_OK || stored_size != size) {
+        printf("PropertyStore: can't read %s from NVS\n", key);
+        return false;
+    }
+    return true;
+}
+
+bool PropertyStore::write_nvs(ushort instance_id, ushort name_crc, const void* value, uint size) {
+    char key[NVS_KEY_NAME_MAX_SIZE];
+    get_nvs_key(key, instance_id, name_crc);
+    return nvs_set_blob(nvs_store, key, value, size) == ESP_OK && nvs_commit(nvs_store) == ESP_OK;
+}
+
+void PropertyStore::import_nvs() {
+    nvs_handle_t handle;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+        return; // nothing was stored by older firmware
+
+    // the blobs are left in NVS, so a downgraded firmware still finds them
+    uint imported = 0;
+    AccountedVector<ubyte, MemoryArea::PROPERTIES> value;
+    nvs_iterator_t iter = nullptr;
+    auto err = nvs_entry_find(NVS_DEFAULT_PART_NAME, NVS_NAMESPACE, NVS_TYPE_BLOB, &iter);
+    while (err == ESP_OK) {
+        nvs_entry_info_t info;
+        nvs_entry_info(iter, &info);
+
+        uint instance_id, name_crc;
+        size_t size = 0;
+        if (sscanf(info.key, "%x:%x", &instance_id, &name_crc) == 2 && instance_id <= 0xFFFF && name_crc <= 0xFFFF
+            && nvs_get_blob(handle, info.key, nullptr, &size) == ESP_OK) {
+            value.resize(size);
+            if (nvs_get_blob(handle, info.key, value.data(), &size) == ESP_OK
+                && write(instance_id, name_crc, value.data(), size))
+                imported++;
+        }
+        err = nvs_entry_next(&iter);
+    }
+    nvs_release_iterator(iter);
+    nvs_close(handle);
+
+    if (imported)
+        printf("PropertyStore: imported %u properties from NVS\n", imported);
+}
+#else
+// the file is read as a whole and written through, so values are read from memory as on ESP32
+bool PropertyStore::map_region(const char* name) {
+    file = fopen(name, "r+b");
+    if (file == nullptr)
+        file = fopen(name, "w+b");
+    if (file == nullptr) {
+        printf("PropertyStore: can't open %s, properties won't be preserved\n", name);
+        return false;
+    }
+
+    bank_size = KHAWASU_PROPERTY_BANK_SIZE;
+    image.assign(bank_size * 2, 0xFF);
+    fread(image.data(), 1, image.size(), file);
+
+    // new or truncated files get their full size
+    fseek(file, 0, SEEK_SET);
+    fwrite(image.data(), 1, image.size(), file);
+    fflush(file);
+
+    region = image.data();
+    return true;
+}
+
+void PropertyStore::unmap_region() {
+    if (file)
+        fclose(file);
+    file = nullptr;
+    region = nullptr;
+}
+
+void PropertyStore::open_default() {
+    // PC stores are opened with `open` only
+}
+
+bool PropertyStore::write_region(uint offset, const void* data, uint size) {
+    memcpy(image.data() + offset, data, size);
+    if (file == nullptr)
+        return true;
+
+    fseek(file, offset, SEEK_SET);
+    auto written = fwrite(data, 1, size, file) == size;
+    return fflush(file) == 0 && written;
+}
+
+bool PropertyStore::erase_bank(int bank_index) {
+    memset(image.data() + bank_index * bank_size, 0xFF, bank_size);
+    return write_region(bank_index * bank_size, image.data() + bank_index * bank_size, bank_size);
+}
+#endif
+
+void PropertyStore::map_memory() {
+    bank_size = KHAWASU_PROPERTY_BANK_SIZE;
+    image.assign(bank_size * 2, 0xFF);
+    region = image.data();
+}
+
+
+// store
+PropertyStore::~PropertyStore() {
+    unmap_region();
+}
+
+bool PropertyStore::open(const char* name, uint schema_hash_) {
+    unmap_region();
+    schema_hash = schema_hash_;
+    open_attempted = true;
+
+    auto mapped = map_region(name);
+    if (!mapped)
+        map_memory();
+    load();
+    return mapped;
+}
+
+void PropertyStore::ensure_open() {
+    if (open_attempted)
+        return;
+
+    open_attempted = true;
+    open_default();
+}
+
+void PropertyStore::ensure_writable() {
+    ensure_open();
+#ifdef ESP_PLATFORM
+    if (nvs_store)
+        return;
+#endif
+    if (region)
+        return;
+
+    map_memory();
+    load();
+}
+
+bool PropertyStore::read(ushort instance_id, ushort name_crc, void* value, uint size, ushort type_tag) {
+    ensure_open();
+#ifdef ESP_PLATFORM
+    if (nvs_store)
+        return read_nvs(instance_id, name_crc, value, size);
+#endif
+    if (region == nullptr)
+        return false;
+
+    auto record = index.find((uint) instance_id << 16 | name_crc);
+    if (record == index.end())
+        return false;
+
+    auto header = (const PropertyRecordHeader*) (region + bank * bank_size + record->second);
+    if (header->size != size || (header->type_tag && type_tag && header->type_tag != type_tag))
+        return false; // stored by a firmware with another type of this property
+
+    memcpy(value, header + 1, size);
+    return true;
+}
+
+bool PropertyStore::write(ushort instance_id, ushort name_crc, const void* value, uint size, ushort type_tag) {
+    ensure_writable();
+    if (size > 0xFFFF)
+        return false;
+#ifdef ESP_PLATFORM
+    if (nvs_store)
+        return write_nvs(instance_id, name_crc, value, size);
+#endif
+
+    auto record_size = get_record_size(size);
+    if (bank == -1 || needs_compaction || append_offset + record_size > bank_size) {
+        if (!compact() || append_offset + record_size > bank_size) {
+            printf("PropertyStore: no space for property %04x:%04x\n", instance_id, name_crc);
+            return false;
+        }
+    }
+
+    // the padding is left erased
+    PropertyRecordHeader header{instance_id, name_crc, (ushort) size, type_tag, 0};
+    header.crc = get_record_crc(header, value);
+    auto offset = bank * bank_size + append_offset;
+    if (!write_region(offset, &header, sizeof(header)) || !write_region(offset + sizeof(header), value, size)) {
+        needs_compaction = true; // the record may be half-written
+        return false;
+    }
+
+    index[(uint) instance_id << 16 | name_crc] = append_offset;
+    append_offset += record_size;
+    return true;
+}
+
+bool PropertyStore::compact() {
+    ensure_writable();
+
+    uint snapshot_size = 0;
+    for (auto& [key, offset] : index)
+        snapshot_size += get_record_size(((const PropertyRecordHeader*) (region + bank * bank_size + offset))->size);
+
+    if (sizeof(PropertyBankHeader) + snapshot_size > bank_size) {
+        printf("PropertyStore: %u bytes of properties don't fit into %u bytes\n", snapshot_size, bank_size);
+        return false;
+    }
+
+    auto target = bank == -1 ? 0 : 1 - bank;
+    if (!erase_bank(target))
+        return false;
+
+    // the latest record of every property, copied as is in small parts (flash can't be written from its own mapping)
+    uint snapshot_crc = 0;
+    auto snapshot_offset = target * bank_size + sizeof(PropertyBankHeader);
+    ubyte part[64];
+    for (auto& [key, offset] : index) {
+        auto record = region + bank * bank_size + offset;
+        auto record_size = get_record_size(((const PropertyRecordHeader*) record)->size);
+        for (uint done = 0; done < record_size; done += sizeof(part)) {
+            auto part_size = std::min<uint>(sizeof(part), record_size - done);
+            memcpy(part, record + done, part_size);
+            if (!write_region(snapshot_offset, part, part_size))
+                return false;
+            snapshot_offset += part_size;
+        }
+        snapshot_crc = crc32(record, record_size, snapshot_crc);
+    }
+
+    // written last, the bank becomes valid only when the snapshot is complete
+    PropertyBankHeader header{};
+    memcpy(header.magic, PropertyBankHeader::MAGIC, sizeof(header.magic));
+    header.version = PropertyBankHeader::VERSION;
+    header.generation = generation + 1;
+    header.schema_hash = schema_hash;
+    header.snapshot_size = snapshot_size;
+    header.snapshot_crc = snapshot_crc;
+    header.header_crc = crc32((const ubyte*) &header, offsetof(PropertyBankHeader, header_crc));
+    if (!write_region(target * bank_size, &header, sizeof(header)))
+        return false;
+
+    load();
+    return true;
+}
+
+void PropertyStore::load() {
+    bank = -1;
+    index.clear();
+    append_offset = 0;
+    needs_compaction = false;
+
+    for (int i = 0; i < 2; ++i) {
+        uint bank_generation;
+        if (is_valid_bank(i, bank_generation) && (bank == -1 || (int) (bank_generation - generation) > 0)) {
+            bank = i;
+            generation = bank_generation;
+        }
+    }
+
+    if (bank != -1)
+        append_offset = index_records(sizeof(PropertyBankHeader));
+}
+
+bool PropertyStore::is_valid_bank(int bank_index, uint& bank_generation) {
+    auto base = region + bank_index * bank_size;
+    auto header = (const PropertyBankHeader*) base;
+    if (memcmp(header->magic, PropertyBankHeader::MAGIC, sizeof(header->magic)) != 0
+        || header->version != PropertyBankHeader::VERSION
+        || header->header_crc != crc32(base, offsetof(PropertyBankHeader, header_crc)))
+        return false;
+
+    // the firmware changed stored types, old values are useless
+    if (header->schema_hash != schema_hash)
+        return false;
+
+    if (sizeof(PropertyBankHeader) + header->snapshot_size > bank_size
+        || header->snapshot_crc != crc32(base + sizeof(PropertyBankHeader), header->snapshot_size))
+        return false;
+
+    bank_generation = header->generation;
+    return true;
+}
+
+uint PropertyStore::index_records(uint offset) {
+    auto base = region + bank * bank_size;
+    while (offset + sizeof(PropertyRecordHeader) <= bank_size) {
+        auto header = (const PropertyRecordHeader*) (base + offset);
+        if (header->instance_id == 0xFFFF && header->size == 0xFFFF && header->crc == 0xFFFFFFFF)
+            break; // erased, the end of the journal
+
+        auto record_size = get_record_size(header->size);
+        if (offset + record_size > bank_size || header->crc != get_record_crc(*header, header + 1)) {
+            needs_compaction = true; // torn by a power loss, appending after it would lose the next records
+            break;
+        }
+
+        index[(uint) header->instance_id << 16 | header->name_crc] = offset;
+        offset += record_size;
+    }
+    return offset;
+}
+
+uint PropertyStore::get_record_size(uint value_size) {
+    auto size = sizeof(PropertyRecordHeader) + value_size;
+    return (size + PropertyRecordHeader::ALIGNMENT - 1) / PropertyRecordHeader::ALIGNMENT
+           * PropertyRecordHeader::ALIGNMENT;
+}
+
+uint PropertyStore::get_record_crc(const PropertyRecordHeader& header, const void* value) {
+    auto crc = crc32((const ubyte*) &header, offsetof(PropertyRecordHeader, crc));
+    return crc32((const ubyte*) value, header.size, crc);
+}
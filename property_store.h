@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdio>
+#include "khawasu_config.h"
+#include "memory_accounting.h"
+#include "types.h"
+
+// packed storage of PreservedProperty values, one per physical device (or per simulated node)
+//
+// the region (a data partition on ESP32, a file on PC, or memory only) is split into two banks used in turns
+// a bank starts with PropertyBankHeader followed by the snapshot: the latest value of every property, packed
+// contiguously by the last compaction. changed values are appended after it as journal records, the latest record
+// of a property wins. when the journal fills the bank, the snapshot is rebuilt in the other bank, its header is
+// written last, so a power loss during compaction leaves the previous bank in use
+//
+// the region is memory-mapped, so reading a value is a lookup in the in-memory index and a copy from flash
+// every record carries a type tag derived from the id and the size of the property type (see get_property_type_id),
+// values of a property whose type or size changed in the new firmware are ignored. the whole store is dropped when its schema hash
+// differs from KHAWASU_PROPERTY_SCHEMA
+//
+// on ESP32 without the partition values are kept in NVS as one blob per property ("<instance id>:<name crc>" keys in
+// hex, the layout used before PropertyStore), and such blobs are imported into an empty partition on the first boot
+
+#pragma pack(push, 1)
+struct PropertyBankHeader
+{
+    static constexpr char MAGIC[4] = {'K', 'H', 'P', 'S'};
+    static constexpr ushort VERSION = 1;
+
+    char magic[4];
+    ushort version;
+    ushort reserved;
+    uint generation;    // bank with the greater generation is the current one
+    uint schema_hash;
+    uint snapshot_size; // bytes of records following this header
+    uint snapshot_crc;
+    uint header_crc;    // of the fields above
+};
+
+struct PropertyRecordHeader
+{
+    static constexpr uint ALIGNMENT = 4; // records are padded for flash writes
+
+    ushort instance_id;
+    ushort name_crc;
+    ushort size;        // of the value following this header
+    ushort type_tag;    // zero if unknown (imported from NVS, types without id), such values are checked by size only
+    uint crc;           // of the fields above and the value
+};
+#pragma pack(pop)
+
+
+class PropertyStore
+{
+public:
+    PropertyStore() = default;
+    PropertyStore(const PropertyStore&) = delete;
+    PropertyStore& operator=(const PropertyStore&) = delete;
+
+    ~PropertyStore();
+
+    // maps the data partition with this label on ESP32 or the file at this path on PC, creating it if needed
+    // until it's called (or if it fails) values are kept in memory only. default store opens
+    // KHAWASU_PROPERTY_PARTITION on ESP32 by itself
+    bool open(const char* name, uint schema_hash = KHAWASU_PROPERTY_SCHEMA);
+
+    // returns false if there's no value of this size and type
+    bool read(ushort instance_id, ushort name_crc, void* value, uint size, ushort type_tag = 0);
+
+    // appends a journal record, compacting the store when the current bank is full
+    bool write(ushort instance_id, ushort name_crc, const void* value, uint size, ushort type_tag = 0);
+
+    // rebuilds the snapshot in the other bank, dropping overwritten journal records
+    bool compact();
+
+    // bytes used in the current bank
+    inline uint get_used_size() const {
+        return append_offset;
+    }
+
+    inline uint get_bank_size() const {
+        return bank_size;
+    }
+
+private:
+    const ubyte* region = nullptr; // mapped, both banks
+    uint bank_size = 0;
+    uint schema_hash = KHAWASU_PROPERTY_SCHEMA;
+    int bank = -1;                 // current one, -1 if there's no valid bank yet
+    uint generation = 0;
+    uint append_offset = 0;        // in the current bank
+    bool needs_compaction = false; // a torn journal record is in the way of appends
+    bool open_attempted = false;
+    AccountedMap<uint, uint, MemoryArea::PROPERTIES> index; // (instance_id << 16 | name_crc) -> record offset in the current bank
+
+    // contents of the file or of the memory-only store, erased bytes are 0xFF like in flash
+    AccountedVector<ubyte, MemoryArea::PROPERTIES> image;
+#ifdef ESP_PLATFORM
+    static constexpr const char* NVS_NAMESPACE = "preprop";
+
+    const void* partition = nullptr; // esp_partition_t
+    uint mmap_handle = 0;
+    uint nvs_store = 0;              // nvs_handle_t, set when values are kept in NVS
+#else
+    FILE* file = nullptr;
+#endif
+
+    // maps the default region on the first use
+    void ensure_open();
+
+    // falls back to memory if there's no region, memory-only stores don't take memory until the first write
+    void ensure_writable();
+
+    // returns false if the region can't be mapped
+    bool map_region(const char* name);
+
+    void map_memory();
+
+    void unmap_region();
+
+    // region of the default store on ESP32, NVS if there's no partition
+    void open_default();
+
+#ifdef ESP_PLATFORM
+    bool open_nvs();
+
+    bool read_nvs(ushort instance_id, ushort name_crc, void* value, uint size);
+
+    bool write_nvs(ushort instance_id, ushort name_crc, const void* value, uint size);
+
+    // copies values stored in NVS by older firmware into the empty store
+    void import_nvs();
+#endif
+
+    bool write_region(uint offset, const void* data, uint size);
+
+    bool erase_bank(int bank_index);
+
+    // finds the current bank and indexes its records
+    void load();
+
+    // returns false if the bank header is broken or belongs to another schema
+    bool is_valid_bank(int bank_index, uint& bank_generation);
+
+    // walks records from `offset`, returns the end of the last valid one
+    uint index_records(uint offset);
+
+    static uint get_record_size(uint value_size);
+
+    static uint get_record_crc(const PropertyRecordHeader& header, const void* value);
+};
+
+inline PropertyStore default_property_store;
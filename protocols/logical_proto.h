@@ -33,18 +33,58 @@
 // DATA_REQUEST is used to request some data from device, and the response will be a DATA_RESPONSE packet
 // DATA_TRANSFER is used to transfer connectionless data directly to device, e.g. to change some state
 //
+// compact discovery:
+// HELLO_WORLD_COMPACT replaces both HELLO_WORLD and HELLO_WORLD_RESPONSE, peers answer in the format of the request
+// instead of the full descriptor it carries a hash of the compact descriptor (varint-encoded, with well-known names
+// replaced by indices in a shared dictionary, see descriptor_codec.h). small descriptors are carried inline
+// peers which already cached the descriptor with this hash use the cached one, others fetch it with DESCRIPTOR_REQUEST
+// only when they need it (usually controllers and admin panels)
+// peers answer HELLO_WORLD_COMPACT only if they don't know the announcer yet (or its descriptor has changed),
+// or if the announcer knows no peers at all (FRESH flag). answers are broadcasted after a random delay and not more
+// often than once in a while, so one answer serves every node that announced itself meanwhile, e.g. after a restart
+// of the whole network
+// firmware without compact discovery ignores HELLO_WORLD_COMPACT, so nodes using it announce themselves with HELLO_WORLD
+// for a while after hearing a HELLO_WORLD of another node. nodes which never announce themselves in that time stay
+// unaware of compact announcers until they send HELLO_WORLD
+//
+// groups API:
+// logical device may be a member of a few groups (e.g. "all lights in the living room"), membership is preserved across reboots
+// a group is addressed by a logical port from the group port range, so the packet is dispatched to every member
+// hosted on the destination physical device. sending it to broadcast physical address reaches all members in the network
+// with a single frame per physical device
+// GROUPS_ADD, GROUPS_REMOVE and GROUPS_EDIT (replaces the whole membership) are answered with GROUPS_LIST_RESPONSE
+// when addressed to the device port directly
+//
 // subscription API:
 // subscriptions are a dedicated API inside logical protocol, used to implement callbacks between devices
 // the main three packets are: SUBSCRIPTION_START, SUBSCRIPTION_STOP, and SUBSCRIPTION_CALLBACK
+// SUBSCRIPTION_START_EXT is SUBSCRIPTION_START with flags enabling the optional features below. notifiers predating
+// it ignore it, so subscribers not getting SUBSCRIPTION_DONE for it may fall back to SUBSCRIPTION_START
+// notifier acknowledges every SUBSCRIPTION_START(_EXT) with SUBSCRIPTION_DONE, carrying the subscription state
+// leases of many subscriptions to the same notifier are renewed at once with SUBSCRIPTION_RENEW,
+// notifier answers it with SUBSCRIPTION_DONE only for unknown subscriptions, so subscriber can start them again
 // each subscription has a few parameters:
 // - id: used to implement multiple simultaneous subscriptions between the same devices
 // - duration: how many seconds the subscription will be active. you can renew it by sending the same START packet before or after the current subscription stopped
-// - period:
+// - period: how often the notifier calls back for regularly updated devices, zero disables periodic callbacks
 // - period strictness: non-strict period allows the notifier device to increase period if makes no sense to send callbacks at specified frequency
+//   strict period (the default, and the only one of SUBSCRIPTION_START) requires exactly the specified period
+//   non-strict period (STRETCHABLE_PERIOD flag) is stretched by the notifier when its tx path is loaded, or when the
+//   callback payload didn't change since the last callback (unchanged payloads are suppressed, but not for too long)
+// - filter (optional, HAS_FILTER flag): dead-band and minimum interval evaluated by the notifier before sending a callback,
+//   so noise-level changes of sensor values never reach the network. it's placed at the beginning of info payload
 // - format specifier: device-class-specific format, specifying the events or targets you want to subscribe
-
-// todo add a strict/non-strict subscription periods, where strict will require exactly the specified period,
-//  and non-strict means the notifier may increase the period if it makes no sense for it to send callbacks more often
+//
+// batched actions:
+// ACTION_EXECUTE_BATCH carries multiple (port, action, payload) entries for devices hosted on the destination physical
+// device, e.g. to apply a scene. it's handled by the logical device manager regardless of the destination port, which
+// is the port of the first entry (group ports and BROADCAST_PORT would make it reach the other nodes). the entries are executed back-to-back in their order and, if REQUIRE_STATUS_RESPONSE is set,
+// a single ACTION_EXECUTE_BATCH_RESULT with the status of every entry is returned to the sender from BROADCAST_PORT.
+// entries of devices not hosted there or not accepting the packet get ACTION_NOT_FOUND
+// ACTION_FETCH_MULTI does the same for ACTION_FETCH: responses given by the devices right from their handlers are
+// collected into ACTION_RESPONSE_MULTI (split into a few packets if they don't fit into one), answers given later
+// come in ACTION_RESPONSE_MULTI of their own. multi packets carry a 32-bit request id, so thousands of them may be
+// in flight
 
 
 #pragma pack(push, 1)
@@ -52,6 +92,27 @@ namespace LogicalProto
 {
     const ushort BROADCAST_PORT = 65535;
 
+    // logical ports in [GROUP_PORT_FIRST, BROADCAST_PORT) address groups instead of devices
+    const ushort GROUP_PORT_FIRST = 0xF000;
+    const ushort GROUP_COUNT = BROADCAST_PORT - GROUP_PORT_FIRST;
+
+    inline bool is_group_port(ushort port) {
+        return port >= GROUP_PORT_FIRST && port != BROADCAST_PORT;
+    }
+
+    // ids not below GROUP_COUNT would map to BROADCAST_PORT or wrap around to device ports
+    inline bool is_valid_group(ushort group_id) {
+        return group_id < GROUP_COUNT;
+    }
+
+    inline ushort group_to_port(ushort group_id) {
+        return GROUP_PORT_FIRST + group_id;
+    }
+
+    inline ushort port_to_group(ushort port) {
+        return port - GROUP_PORT_FIRST;
+    }
+
     enum class LogicalPacketType : ubyte
     {
         UNKNOWN = 0,
@@ -78,8 +139,27 @@ namespace LogicalProto
         SUBSCRIPTION_DONE,          // response to previous
         SUBSCRIPTION_CALLBACK,      // event callback to subscriber
         SUBSCRIPTION_STOP,          // stops existing subscription (from subscriber side)
+        SUBSCRIPTION_RENEW,         // renews leases of multiple existing subscriptions
+
+        HELLO_WORLD_COMPACT,        // HELLO_WORLD and HELLO_WORLD_RESPONSE carrying compact descriptor hash
+        DESCRIPTOR_REQUEST,         // request compact descriptor by its hash
+        DESCRIPTOR_RESPONSE,        // response to previous
+
+        ACTION_EXECUTE_BATCH,        // execute actions of multiple devices hosted on the same physical device
+        ACTION_EXECUTE_BATCH_RESULT, // aggregated result statuses for ACTION_EXECUTE_BATCH
+        ACTION_FETCH_MULTI,          // request data of actions of multiple devices hosted on the same physical device
+        ACTION_RESPONSE_MULTI,       // aggregated response to previous
+
+        SUBSCRIPTION_START_EXT,      // SUBSCRIPTION_START with flags
     };
 
+    // update it when adding new packet types
+    const ubyte LOGICAL_PACKET_TYPE_COUNT = (ubyte) LogicalPacketType::SUBSCRIPTION_START_EXT + 1;
+
+    constexpr u64 packet_type_bit(LogicalPacketType type) {
+        return 1ull << (ubyte) type;
+    }
+
     enum class DeviceClassEnum : uint
     {
         UNKNOWN = 0,
@@ -126,6 +206,42 @@ namespace LogicalProto
     enum ActionExecuteFlags : ubyte
     {
         REQUIRE_STATUS_RESPONSE = 1 << 0,
+        DEDUPLICATE             = 1 << 1, // request_id is unique among recent ACTION_EXECUTE(_BATCH)es of the
+                                          // sender, repeated ones (retransmissions) are answered without executing
+                                          // again. batch entries are remembered one by one, so large batches push
+                                          // older requests out of the history (KHAWASU_EXECUTE_HISTORY_SIZE)
+    };
+
+    enum SubscriptionStartFlags : ubyte
+    {
+        STRETCHABLE_PERIOD = 1 << 0, // notifier may stretch the period, it's kept exactly otherwise
+        HAS_FILTER         = 1 << 1, // info payload starts with SubscriptionFilter
+    };
+
+    enum class FilterValueFormat : ubyte
+    {
+        NONE = 0, // no dead-band, only minimum interval is applied
+        UINT8,
+        INT8,
+        UINT16,
+        INT16,
+        UINT32,
+        INT32,
+        FLOAT32,
+    };
+
+    enum SubscriptionFilterFlags : ubyte
+    {
+        RELATIVE_DEAD_BAND = 1 << 0, // dead band is relative to the last sent value
+    };
+
+    struct SubscriptionFilter
+    {
+        FilterValueFormat value_format; // how the filtered value is stored in callback payload
+        ubyte value_offset;             // offset of the filtered value in callback payload, in bytes
+        SubscriptionFilterFlags flags;
+        uint dead_band;                 // absolute: in 1/1000 of value units, relative: in 1/1000 of the last sent value
+        ushort min_interval;            // minimal delay between two callbacks, in milliseconds
     };
 
     // todo think of device attribute utilization
@@ -154,6 +270,34 @@ namespace LogicalProto
         //
     };
 
+    const ubyte DESCRIPTOR_FORMAT_VERSION = 1;
+
+    enum HelloWorldCompactFlags : ubyte
+    {
+        IS_RESPONSE    = 1 << 0, // answer to HELLO_WORLD_COMPACT, must not be answered
+        HAS_DESCRIPTOR = 1 << 1, // compact descriptor is carried inline
+        FRESH          = 1 << 2, // announcer knows no peers, every peer should answer
+    };
+
+    struct HelloWorldCompactPacket
+    {
+        ubyte version;         // DESCRIPTOR_FORMAT_VERSION, packets with unknown version are ignored
+        HelloWorldCompactFlags flags;
+        uint descriptor_hash;  // crc32 of compact descriptor
+        ubyte descriptor[0];   // only if HAS_DESCRIPTOR flag is set
+    };
+
+    struct DescriptorRequestPacket
+    {
+        uint descriptor_hash;
+    };
+
+    struct DescriptorResponsePacket
+    {
+        uint descriptor_hash;
+        ubyte descriptor[0];
+    };
+
     struct FieldDictionaryRequestPacket
     {
         // no fields
@@ -176,32 +320,37 @@ namespace LogicalProto
     struct GroupsListResponsePacket
     {
         ubyte groups_count;
-        // todo groups layout
+        ushort groups[0]; // real size is `groups_count`
     };
 
     struct GroupsAddPacket
     {
-        //
+        ubyte groups_count;
+        ushort groups[0]; // real size is `groups_count`
     };
 
     struct GroupsEditPacket
     {
-        //
+        ubyte groups_count;
+        ushort groups[0]; // new membership, real size is `groups_count`
     };
 
     struct GroupsRemovePacket
     {
-        //
+        ubyte groups_count;
+        ushort groups[0]; // real size is `groups_count`
     };
 
     struct GroupsFindUsersRequestPacket
     {
-        //
+        ubyte groups_count;
+        ushort groups[0]; // real size is `groups_count`
     };
 
     struct GroupsFindUsersResponsePacket
     {
-        //
+        ubyte groups_count;
+        ushort groups[0]; // requested groups this device is a member of, real size is `groups_count`
     };
 
     struct ActionExecutePacket
@@ -219,6 +368,52 @@ namespace LogicalProto
         ActionExecuteStatus status;
     };
 
+    struct ActionExecuteBatchEntry
+    {
+        ushort port;         // of the device on the destination physical device
+        ushort action_id;
+        ushort payload_size;
+        ubyte payload[0];    // real size is `payload_size`
+    };
+
+    struct ActionExecuteBatchPacket
+    {
+        ubyte request_id;
+        ActionExecuteFlags flags;  // applied to the whole batch
+        ubyte entries_count;
+        ubyte entries[0];          // `entries_count` of ActionExecuteBatchEntry, one right after another's payload
+    };
+
+    struct ActionExecuteBatchResultPacket
+    {
+        ubyte request_id;
+        ubyte entries_count;
+        ActionExecuteStatus statuses[0]; // in the order of batch entries, real size is `entries_count`
+    };
+
+    struct ActionFetchMultiPacket
+    {
+        uint request_id;
+        ubyte entries_count;
+        ubyte entries[0];          // `entries_count` of ActionExecuteBatchEntry
+    };
+
+    struct ActionResponseMultiEntry
+    {
+        ushort port;         // of the responder device
+        ushort action_id;
+        ActionExecuteStatus status;
+        ushort payload_size;
+        ubyte payload[0];    // real size is `payload_size`
+    };
+
+    struct ActionResponseMultiPacket
+    {
+        uint request_id;
+        ubyte entries_count;
+        ubyte entries[0];          // `entries_count` of ActionResponseMultiEntry
+    };
+
     struct ActionFetchPacket
     {
         ushort action_id;
@@ -243,10 +438,25 @@ namespace LogicalProto
         ubyte info_payload[0]; // description of events for subscription
     };
 
+    struct SubscriptionStartExtPacket
+    {
+        SubscriptionStartPacket start;
+        SubscriptionStartFlags flags;
+        ubyte info_payload[0]; // optional SubscriptionFilter, then description of events for subscription
+    };
+
+    enum class SubscriptionDoneState : uint
+    {
+        OK = 0,
+        NOT_FOUND,      // renewed subscription doesn't exist, start it again
+        INVALID_FORMAT, // info payload can't be parsed
+        CAPACITY_EXHAUSTED, // notifier has no free subscriber slots, retry later or elsewhere
+    };
+
     struct SubscriptionDonePacket
     {
         uint id;
-        uint state; // zero - "OK", others - error
+        SubscriptionDoneState state; // zero - "OK", others - error
     };
 
     struct SubscriptionCallbackPacket
@@ -260,6 +470,13 @@ namespace LogicalProto
         uint id;
     };
 
+    struct SubscriptionRenewPacket
+    {
+        ushort duration; // new duration for every listed subscription. in seconds
+        ubyte count;
+        uint ids[0];     // real size is `count`
+    };
+
     struct SubscriptionTerminatedPacket
     {
         uint id;
@@ -295,6 +512,18 @@ namespace LogicalProto
             SubscriptionDonePacket subscription_done;
             SubscriptionCallbackPacket subscription_callback;
             SubscriptionStopPacket subscription_stop;
+            SubscriptionRenewPacket subscription_renew;
+
+            HelloWorldCompactPacket hello_world_compact;
+            DescriptorRequestPacket descriptor_request;
+            DescriptorResponsePacket descriptor_response;
+
+            ActionExecuteBatchPacket action_execute_batch;
+            ActionExecuteBatchResultPacket action_execute_batch_result;
+            ActionFetchMultiPacket action_fetch_multi;
+            ActionResponseMultiPacket action_response_multi;
+
+            SubscriptionStartExtPacket subscription_start_ext;
 
             ubyte payload[0];
         };
@@ -325,6 +554,15 @@ namespace LogicalProto
                 case LogicalPacketType::SUBSCRIPTION_DONE: return LOG_PACKET_SIZE(subscription_done);
                 case LogicalPacketType::SUBSCRIPTION_CALLBACK: return LOG_PACKET_SIZE(subscription_callback);
                 case LogicalPacketType::SUBSCRIPTION_STOP: return LOG_PACKET_SIZE(subscription_stop);
+                case LogicalPacketType::SUBSCRIPTION_RENEW: return LOG_PACKET_SIZE(subscription_renew);
+                case LogicalPacketType::HELLO_WORLD_COMPACT: return LOG_PACKET_SIZE(hello_world_compact);
+                case LogicalPacketType::DESCRIPTOR_REQUEST: return LOG_PACKET_SIZE(descriptor_request);
+                case LogicalPacketType::DESCRIPTOR_RESPONSE: return LOG_PACKET_SIZE(descriptor_response);
+                case LogicalPacketType::ACTION_EXECUTE_BATCH: return LOG_PACKET_SIZE(action_execute_batch);
+                case LogicalPacketType::ACTION_EXECUTE_BATCH_RESULT: return LOG_PACKET_SIZE(action_execute_batch_result);
+                case LogicalPacketType::ACTION_FETCH_MULTI: return LOG_PACKET_SIZE(action_fetch_multi);
+                case LogicalPacketType::ACTION_RESPONSE_MULTI: return LOG_PACKET_SIZE(action_response_multi);
+                case LogicalPacketType::SUBSCRIPTION_START_EXT: return LOG_PACKET_SIZE(subscription_start_ext);
             }
             return 0;
         }
@@ -0,0 +1,387 @@
+#pragma once
+
+#include <string_view>
+#include "logical_proto.h"
+#include "net_utils.h"
+
+// zero-copy views over variable-length logical packets
+//
+// packets with zero-length arrays (HELLO_WORLD, FIELD_DICTIONARY_RESPONSE) are validated with a single pass over
+// their lists, after that the handlers iterate over the same bytes without any further bounds checks
+// writers use the same layout definitions, so the sizes of static descriptors can be computed at compile time
+
+namespace LogicalProto
+{
+    // compile-time layout checks, these layouts are a part of the protocol
+    static_assert(offsetof(LogicalPacket, src_addr) == 1 && offsetof(LogicalPacket, dst_addr) == 3);
+    static_assert(offsetof(LogicalPacket, hello_world) == 5);
+    static_assert(offsetof(HelloWorldPacket, name) == 7);
+    static_assert(offsetof(HelloWorldPacket::HelloWorldDeviceAttrib, key) == 2);
+    static_assert(offsetof(HelloWorldPacket::ActionData, name) == 2);
+    static_assert(offsetof(FieldDictionaryResponsePacket, fields) == 2);
+    static_assert(offsetof(FieldDictionaryResponsePacket::ApiFieldLayout, string) == 1);
+    static_assert(offsetof(ActionExecuteBatchEntry, payload) == 6);
+    static_assert(offsetof(ActionResponseMultiEntry, payload) == 7);
+
+    // layout of a single list item: fixed header followed by a variable part described by the header
+    struct ApiFieldItemLayout
+    {
+        using Header = FieldDictionaryResponsePacket::ApiFieldLayout;
+        using Item = std::string_view;
+
+        static constexpr uint size(uint length) {
+            return sizeof(Header) + length;
+        }
+
+        static uint size(const ubyte* ptr) {
+            return size(net_load(((const Header*) ptr)->length));
+        }
+
+        static Item read(const ubyte* ptr) {
+            auto header = (const Header*) ptr;
+            return {(const char*) header->string, net_load(header->length)};
+        }
+    };
+
+    struct HelloWorldAttribItemLayout
+    {
+        using Header = HelloWorldPacket::HelloWorldDeviceAttrib;
+        struct Item
+        {
+            std::string_view key;
+            std::string_view value;
+        };
+
+        static constexpr uint size(uint key_len, uint value_len) {
+            return sizeof(Header) + key_len + value_len;
+        }
+
+        static uint size(const ubyte* ptr) {
+            auto header = (const Header*) ptr;
+            return size(net_load(header->key_len), net_load(header->value_len));
+        }
+
+        static Item read(const ubyte* ptr) {
+            auto header = (const Header*) ptr;
+            auto key_len = net_load(header->key_len);
+            return {{(const char*) header->key, key_len},
+                    {(const char*) header->key + key_len, net_load(header->value_len)}};
+        }
+    };
+
+    struct HelloWorldActionItemLayout
+    {
+        using Header = HelloWorldPacket::ActionData;
+        struct Item
+        {
+            ActionType type;
+            std::string_view name;
+        };
+
+        static constexpr uint size(uint name_len) {
+            return sizeof(Header) + name_len;
+        }
+
+        static uint size(const ubyte* ptr) {
+            return size(net_load(((const Header*) ptr)->name_length));
+        }
+
+        static Item read(const ubyte* ptr) {
+            auto header = (const Header*) ptr;
+            return {net_load(header->type), {(const char*) header->name, net_load(header->name_length)}};
+        }
+    };
+
+    // entries of ACTION_EXECUTE_BATCH and ACTION_FETCH_MULTI
+    struct ActionEntryItemLayout
+    {
+        using Header = ActionExecuteBatchEntry;
+        struct Item
+        {
+            ushort port;
+            ushort action_id;
+            const ubyte* payload;
+            uint payload_size;
+        };
+
+        static constexpr uint size(uint payload_size) {
+            return sizeof(Header) + payload_size;
+        }
+
+        static uint size(const ubyte* ptr) {
+            return size(net_load(((const Header*) ptr)->payload_size));
+        }
+
+        static Item read(const ubyte* ptr) {
+            auto header = (const Header*) ptr;
+            return {net_load(header->port), net_load(header->action_id), header->payload,
+                    net_load(header->payload_size)};
+        }
+    };
+
+    struct ActionResponseItemLayout
+    {
+        using Header = ActionResponseMultiEntry;
+        struct Item
+        {
+            ushort port;
+            ushort action_id;
+            ActionExecuteStatus status;
+            const ubyte* payload;
+            uint payload_size;
+        };
+
+        static constexpr uint size(uint payload_size) {
+            return sizeof(Header) + payload_size;
+        }
+
+        static uint size(const ubyte* ptr) {
+            return size(net_load(((const Header*) ptr)->payload_size));
+        }
+
+        static Item read(const ubyte* ptr) {
+            auto header = (const Header*) ptr;
+            return {net_load(header->port), net_load(header->action_id), net_load(header->status), header->payload,
+                    net_load(header->payload_size)};
+        }
+    };
+
+    // returns the end of the list or nullptr if it doesn't fit into [begin, end)
+    template <typename Layout>
+    inline const ubyte* validate_list(const ubyte* begin, const ubyte* end, uint count) {
+        for (uint i = 0; i < count; ++i) {
+            if (begin + sizeof(typename Layout::Header) > end)
+                return nullptr;
+            begin += Layout::size(begin);
+        }
+        return begin > end ? nullptr : begin;
+    }
+
+    // iterable range over a validated list
+    template <typename Layout>
+    class ListView
+    {
+    public:
+        class Iterator
+        {
+        public:
+            Iterator(const ubyte* ptr_, uint index_) : ptr(ptr_), index(index_) { }
+
+            typename Layout::Item operator*() const {
+                return Layout::read(ptr);
+            }
+
+            Iterator& operator++() {
+                ptr += Layout::size(ptr);
+                index++;
+                return *this;
+            }
+
+            bool operator!=(const Iterator& other) const {
+                return index != other.index;
+            }
+
+        private:
+            const ubyte* ptr;
+            uint index;
+        };
+
+        ListView() : begin_ptr(nullptr), count(0) { }
+        ListView(const ubyte* begin_, uint count_) : begin_ptr(begin_), count(count_) { }
+
+        Iterator begin() const { return {begin_ptr, 0}; }
+        Iterator end() const { return {nullptr, count}; }
+        uint size() const { return count; }
+        const ubyte* data() const { return begin_ptr; }
+
+    private:
+        const ubyte* begin_ptr;
+        uint count;
+    };
+
+    class FieldDictionaryView
+    {
+    public:
+        // validates the packet, check `is_valid` before use
+        FieldDictionaryView(const LogicalPacket* packet, uint size) {
+            if (LOG_PACKET_SIZE(field_dictionary_response) > size)
+                return;
+
+            auto begin = (const ubyte*) packet->field_dictionary_response.fields;
+            auto count = net_load(packet->field_dictionary_response.field_count);
+            if (!validate_list<ApiFieldItemLayout>(begin, (const ubyte*) packet + size, count))
+                return;
+
+            fields_view = {begin, count};
+            valid = true;
+        }
+
+        // for packets already validated by LogicalDeviceManager::validate_packet, no checks at all
+        static FieldDictionaryView from_validated(const LogicalPacket* packet) {
+            FieldDictionaryView view;
+            view.fields_view = {(const ubyte*) packet->field_dictionary_response.fields,
+                                net_load(packet->field_dictionary_response.field_count)};
+            view.valid = true;
+            return view;
+        }
+
+        bool is_valid() const { return valid; }
+
+        const ListView<ApiFieldItemLayout>& fields() const { return fields_view; }
+
+    private:
+        FieldDictionaryView() = default;
+
+        ListView<ApiFieldItemLayout> fields_view;
+        bool valid = false;
+    };
+
+    class HelloWorldView
+    {
+    public:
+        // validates the packet, check `is_valid` before use. works for HELLO_WORLD_RESPONSE as well
+        HelloWorldView(const LogicalPacket* packet, uint size) {
+            if (LOG_PACKET_SIZE(hello_world) > size)
+                return;
+
+            auto& hello = packet->hello_world;
+            auto end = (const ubyte*) packet + size;
+            auto attribs_begin = hello.name + net_load(hello.name_len);
+            if (attribs_begin > end)
+                return;
+
+            auto attrib_count = net_load(hello.special_attrib_count);
+            auto actions_begin = validate_list<HelloWorldAttribItemLayout>(attribs_begin, end, attrib_count);
+            if (!actions_begin)
+                return;
+
+            auto action_count = net_load(hello.action_count);
+            if (!validate_list<HelloWorldActionItemLayout>(actions_begin, end, action_count))
+                return;
+
+            device_class_value = net_load(hello.device_class);
+            name_view = {(const char*) hello.name, net_load(hello.name_len)};
+            attribs_view = {attribs_begin, attrib_count};
+            actions_view = {actions_begin, action_count};
+            valid = true;
+        }
+
+        // for packets already validated by LogicalDeviceManager::validate_packet, only skips over attributes
+        static HelloWorldView from_validated(const LogicalPacket* packet) {
+            HelloWorldView view;
+            auto& hello = packet->hello_world;
+            auto attribs_begin = hello.name + net_load(hello.name_len);
+            auto attrib_count = net_load(hello.special_attrib_count);
+            auto actions_begin = attribs_begin;
+            for (uint i = 0; i < attrib_count; ++i)
+                actions_begin += HelloWorldAttribItemLayout::size(actions_begin);
+
+            view.device_class_value = net_load(hello.device_class);
+            view.name_view = {(const char*) hello.name, net_load(hello.name_len)};
+            view.attribs_view = {attribs_begin, attrib_count};
+            view.actions_view = {actions_begin, net_load(hello.action_count)};
+            view.valid = true;
+            return view;
+        }
+
+        bool is_valid() const { return valid; }
+
+        DeviceClassEnum device_class() const { return device_class_value; }
+
+        std::string_view name() const { return name_view; }
+
+        const ListView<HelloWorldAttribItemLayout>& attribs() const { return attribs_view; }
+
+        const ListView<HelloWorldActionItemLayout>& actions() const { return actions_view; }
+
+    private:
+        HelloWorldView() = default;
+
+        DeviceClassEnum device_class_value = DeviceClassEnum::UNKNOWN;
+        std::string_view name_view;
+        ListView<HelloWorldAttribItemLayout> attribs_view;
+        ListView<HelloWorldActionItemLayout> actions_view;
+        bool valid = false;
+    };
+
+    // sequential writer of list items, the buffer must be sized with the `*_payload_size` functions below
+    class ListWriter
+    {
+    public:
+        explicit ListWriter(ubyte* ptr_) : ptr(ptr_) { }
+
+        void write_bytes(const void* data, uint size) {
+            net_memcpy(ptr, data, size);
+            ptr += size;
+        }
+
+        void write_field(const char* string, ubyte length) {
+            net_store(((ApiFieldItemLayout::Header*) ptr)->length, length);
+            ptr += sizeof(ApiFieldItemLayout::Header);
+            write_bytes(string, length);
+        }
+
+        void write_attrib(const char* key, ubyte key_len, const char* value, ubyte value_len) {
+            auto header = (HelloWorldAttribItemLayout::Header*) ptr;
+            net_store(header->key_len, key_len);
+            net_store(header->value_len, value_len);
+            ptr += sizeof(HelloWorldAttribItemLayout::Header);
+            write_bytes(key, key_len);
+            write_bytes(value, value_len);
+        }
+
+        void write_action_entry(ushort port, ushort action_id, const ubyte* payload, ushort payload_size) {
+            auto header = (ActionEntryItemLayout::Header*) ptr;
+            net_store(header->port, port);
+            net_store(header->action_id, action_id);
+            net_store(header->payload_size, payload_size);
+            ptr += sizeof(ActionEntryItemLayout::Header);
+            write_bytes(payload, payload_size);
+        }
+
+        void write_action_response(ushort port, ushort action_id, ActionExecuteStatus status, const ubyte* payload,
+                                   ushort payload_size) {
+            auto header = (ActionResponseItemLayout::Header*) ptr;
+            net_store(header->port, port);
+            net_store(header->action_id, action_id);
+            net_store(header->status, status);
+            net_store(header->payload_size, payload_size);
+            ptr += sizeof(ActionResponseItemLayout::Header);
+            write_bytes(payload, payload_size);
+        }
+
+        void write_action(ActionType type, const char* name, ubyte name_len) {
+            auto header = (HelloWorldActionItemLayout::Header*) ptr;
+            net_store(header->type, type);
+            net_store(header->name_length, name_len);
+            ptr += sizeof(HelloWorldActionItemLayout::Header);
+            write_bytes(name, name_len);
+        }
+
+        ubyte* position() const { return ptr; }
+
+    private:
+        ubyte* ptr;
+    };
+
+    // payload sizes (beyond LogicalPacket::get_packet_size), usable at compile time for static descriptors
+    // `Field` has `length`, `Attrib` has `name_len` and `value_len`, `Action` has `length`
+    template <typename Field>
+    constexpr uint field_dictionary_payload_size(const Field* fields, uint field_count) {
+        uint size = 0;
+        for (uint i = 0; i < field_count; ++i)
+            size += ApiFieldItemLayout::size(fields[i].length);
+        return size;
+    }
+
+    template <typename Attrib, typename Action>
+    constexpr uint hello_world_payload_size(uint name_len, const Attrib* attribs, uint attrib_count,
+                                            const Action* actions, uint action_count) {
+        uint size = name_len;
+        for (uint i = 0; i < attrib_count; ++i)
+            size += HelloWorldAttribItemLayout::size(attribs[i].name_len, attribs[i].value_len);
+        for (uint i = 0; i < action_count; ++i)
+            size += HelloWorldActionItemLayout::size(actions[i].length);
+        return size;
+    }
+}
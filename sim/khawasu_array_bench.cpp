@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "net_arrays.h"
+#include "net_utils.h"
+
+// net_store_array / net_load_array against per-value net_store / net_load loops
+//
+//  khawasu_array_bench [values per array] [rounds]
+//
+// arrays are written at an odd offset like a payload after an odd-sized packet header
+
+
+template <typename T>
+__attribute__((noinline)) static void store_scalar(ubyte* dst, const T* src, uint count) {
+    auto values = (T*) dst;
+    for (uint i = 0; i < count; ++i)
+        net_store(values[i], src[i]);
+}
+
+template <typename T>
+__attribute__((noinline)) static void store_bulk(ubyte* dst, const T* src, uint count) {
+    net_store_array(dst, src, count);
+}
+
+template <typename T>
+__attribute__((noinline)) static void load_scalar(T* dst, const ubyte* src, uint count) {
+    auto values = (const T*) src;
+    for (uint i = 0; i < count; ++i)
+        dst[i] = net_load(values[i]);
+}
+
+template <typename T>
+__attribute__((noinline)) static void load_bulk(T* dst, const ubyte* src, uint count) {
+    net_load_array(dst, src, count);
+}
+
+// ns per array
+template <typename TFunc>
+static double measure(TFunc func, uint rounds) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint i = 0; i < rounds; ++i)
+        func(i);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / rounds;
+}
+
+template <typename T>
+static void run(const char* name, uint count, uint rounds) {
+    std::vector<T> values(count), decoded(count);
+    std::vector<ubyte> packet(count * sizeof(T) + 1);
+    auto payload = packet.data() + 1;
+
+    auto store_scalar_ns = measure([&](uint i) { values[i % count] = i; store_scalar(payload, values.data(), count); },
+                                   rounds);
+    auto store_bulk_ns = measure([&](uint i) { values[i % count] = i; store_bulk(payload, values.data(), count); },
+                                 rounds);
+    auto load_scalar_ns = measure([&](uint i) { payload[i % count] = i; load_scalar(decoded.data(), payload, count); },
+                                  rounds);
+    auto load_bulk_ns = measure([&](uint i) { payload[i % count] = i; load_bulk(decoded.data(), payload, count); },
+                                rounds);
+
+    printf("%s x %u: store %.1f ns scalar, %.1f ns bulk (%.1fx), load %.1f ns scalar, %.1f ns bulk (%.1fx)\n", name,
+           count, store_scalar_ns, store_bulk_ns, store_scalar_ns / store_bulk_ns, load_scalar_ns, load_bulk_ns,
+           load_scalar_ns / load_bulk_ns);
+}
+
+int main(int argc, char** argv) {
+    uint count = argc > 1 ? std::max(1, atoi(argv[1])) : 256;
+    uint rounds = argc > 2 ? std::max(1, atoi(argv[2])) : 1'000'000;
+
+    run<ushort>("u16", count, rounds);
+    run<uint>("u32", count, rounds);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include "logical_device_manager.h"
+#include "packet_capture.h"
+
+// feeds RX packets of a capture (see packet_capture.h) back through LogicalDeviceManager::dispatch_packet
+//
+//  khawasu_replay <capture file> [--realtime]
+//
+// every port the captured node used gets a default device, so the packets go through the usual handlers. packets sent
+// in response are counted and discarded. without --realtime packets are replayed as fast as possible, the manager
+// clock still follows the capture timestamps
+
+using namespace LogicalProto;
+
+
+class DiscardTransport : public MeshTransport
+{
+public:
+    MeshProto::far_addr_t addr;
+    u64 packets = 0;
+    u64 bytes = 0;
+
+    explicit DiscardTransport(MeshProto::far_addr_t addr_) : addr(addr_) { }
+
+    MeshProto::far_addr_t get_self_addr() override {
+        return addr;
+    }
+
+    void send(MeshProto::far_addr_t dst_phy, const ubyte* data, uint size) override {
+        packets++;
+        bytes += size;
+    }
+};
+
+
+class ReplayDevice : public LogicalDevice
+{
+public:
+    using LogicalDevice::LogicalDevice;
+
+    void on_device_discover(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) override {
+        //
+    }
+};
+
+
+struct ReplayRecord
+{
+    CaptureRecordHeader header;
+    std::vector<ubyte> packet;
+};
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: %s <capture file> [--realtime]\n", argv[0]);
+        return 1;
+    }
+    auto realtime = argc > 2 && !strcmp(argv[2], "--realtime");
+
+    auto file = fopen(argv[1], "rb");
+    if (!file) {
+        printf("can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    CaptureReader reader(file);
+    if (!reader.is_valid()) {
+        printf("%s is not a capture\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    // loading everything first, so file reading doesn't affect the timing
+    std::vector<ReplayRecord> records;
+    std::vector<ushort> ports; // of the captured node devices
+    uint tx_records = 0;
+    ReplayRecord record;
+    while (reader.next(record.header, record.packet)) {
+        if (record.packet.size() < LOG_PACKET_SIZE(dst_addr))
+            continue;
+
+        auto packet = (LogicalPacket*) record.packet.data();
+        if (record.header.direction == CaptureDirection::TX) {
+            tx_records++;
+            ports.push_back(net_load(packet->src_addr));
+            continue;
+        }
+
+        ports.push_back(net_load(packet->dst_addr));
+        records.push_back(record);
+    }
+    fclose(file);
+
+    if (records.empty()) {
+        printf("no RX packets in %s (%u TX)\n", argv[1], tx_records);
+        return 1;
+    }
+
+    DiscardTransport transport(records.front().header.dst_phy);
+    VirtualClock clock(records.front().header.time);
+    LogicalDeviceManager manager(&transport);
+    manager.set_clock(&clock);
+
+    std::unordered_map<ushort, std::unique_ptr<ReplayDevice>> devices;
+    for (auto port : ports) {
+        if (port == BROADCAST_PORT || is_group_port(port) || devices.count(port))
+            continue;
+
+        auto& device = devices[port] = std::make_unique<ReplayDevice>(&manager, "replay", port);
+        manager.add_device(device.get());
+    }
+    transport.packets = transport.bytes = 0; // not counting announcements of the replay devices
+
+    std::vector<ubyte> scratch; // handlers may modify the packet
+    auto first_time = records.front().header.time;
+    auto wall_start = std::chrono::steady_clock::now();
+    for (auto& item : records) {
+        if (realtime)
+            std::this_thread::sleep_until(wall_start + std::chrono::microseconds(item.header.time - first_time));
+
+        clock.advance_to(item.header.time);
+        manager.run_until(0ull - 1);
+
+        scratch = item.packet;
+        manager.dispatch_packet((LogicalPacket*) scratch.data(), scratch.size(), item.header.src_phy);
+    }
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+
+    printf("replayed %zu RX packets (%u TX skipped) to %zu devices in %.3f s, %.0f packets/s, %.0f ns per packet\n",
+           records.size(), tx_records, devices.size(), wall.count(), records.size() / wall.count(),
+           wall.count() * 1e9 / records.size());
+    printf("capture spans %.3f s, manager sent %llu packets (%llu bytes) in response\n",
+           (records.back().header.time - first_time) / 1e6, (unsigned long long) transport.packets,
+           (unsigned long long) transport.bytes);
+    return 0;
+}
@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include "mesh_simulator.h"
+
+// load benchmarks over the simulated network
+//
+//  khawasu_sim discovery [options] - every node boots with one device and discovers all others
+//  khawasu_sim fanout [options]    - devices of node 1 notify one subscriber on every other node
+//
+// options: --nodes N, --seconds S (simulated), --period MS (fanout), --latency US, --jitter US,
+//          --loss P, --bandwidth BYTES_PER_S, --seed N,
+//          --capture FILE (traffic of one node for khawasu_replay), --capture-node ADDR (default 2)
+
+using namespace LogicalProto;
+using namespace OverlayProto;
+
+
+struct BenchResults
+{
+    std::vector<u64> latencies; // us
+    u64 sent = 0;
+    u64 received = 0;
+    u64 rejected = 0;
+};
+
+static SimNetwork* g_network;
+static BenchResults g_results;
+static std::vector<u64> g_boot_times; // by node address
+static PacketCapture g_capture(16 * 1024 * 1024);
+static FILE* g_capture_file;
+static MeshProto::far_addr_t g_capture_node = 2;
+
+static void attach_capture(SimNode& node) {
+    if (g_capture_file && node.transport.addr == g_capture_node)
+        node.manager.capture = &g_capture;
+}
+
+// runs the network, draining the capture every 100 ms of simulated time
+static void advance(SimNetwork& network, u64 time) {
+    if (!g_capture_file) {
+        network.run_until(time);
+        return;
+    }
+
+    while (network.clock.now_us() < time) {
+        network.run_until(std::min(time, network.clock.now_us() + 100'000));
+        g_capture.drain(g_capture_file);
+    }
+}
+
+
+// scheduled only by its subscriptions, silent about discovered peers
+class BenchDevice : public LogicalDevice
+{
+public:
+    using LogicalDevice::LogicalDevice;
+
+    u64 get_next_update_time() override {
+        return 0ull - 1;
+    }
+
+    void on_device_discover(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) override {
+        //
+    }
+};
+
+
+class DiscoveryDevice : public BenchDevice
+{
+public:
+    OVERRIDE_DEV_CLASS(DeviceClassEnum::RELAY)
+    OVERRIDE_ACTIONS(DeviceApiAction(ActionType::TOGGLE, "state"))
+
+    std::vector<bool> discovered;
+
+    DiscoveryDevice(LogicalDeviceManager* manager_, uint node_count)
+    : BenchDevice(manager_, "bench", 1), discovered(node_count + 1) { }
+
+    bool wants_peer_descriptors() override {
+        return true;
+    }
+
+    void on_device_discover(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) override {
+        if (src_phy >= discovered.size() || discovered[src_phy])
+            return;
+
+        discovered[src_phy] = true;
+        g_results.received++;
+        g_results.latencies.push_back(dev_manager->get_time() - g_boot_times[src_phy]);
+    }
+};
+
+
+class NotifierDevice : public BenchDevice
+{
+public:
+    OVERRIDE_DEV_CLASS(DeviceClassEnum::TEMPERATURE_SENSOR)
+    OVERRIDE_ACTIONS(DeviceApiAction(ActionType::TEMPERATURE, "temperature"))
+
+    NotifierDevice(LogicalDeviceManager* manager_, ushort port_) : BenchDevice(manager_, "notifier", port_) { }
+
+    void on_subscription_timer_update(LogicalAddress addr, uint sub_id, ushort act_id, const void* format) override {
+        // payload is the send time, so subscribers can measure the latency
+        u64 time = dev_manager->get_time();
+        g_results.sent++;
+        subscriptions.send_callback_data(addr, sub_id, (const ubyte*) &time, sizeof(time));
+    }
+};
+
+
+class SubscriberDevice : public BenchDevice
+{
+public:
+    explicit SubscriberDevice(LogicalDeviceManager* manager_) : BenchDevice(manager_, "subscriber", 1) { }
+
+    void subscribe(LogicalAddress notifier, ushort duration, uint period) {
+        auto log = dev_manager->alloc_logical_packet_ptr(notifier, self_port, 0, OverlayProtoType::UNRELIABLE,
+                                                         LogicalPacketType::SUBSCRIPTION_START);
+        net_store(log.ptr()->subscription_start.id, 1);
+        net_store(log.ptr()->subscription_start.action_id, 0);
+        net_store(log.ptr()->subscription_start.duration, duration);
+        net_store(log.ptr()->subscription_start.period, period);
+        dev_manager->finish_ptr(log);
+    }
+
+    void on_subscription_data(const ubyte* data, uint size, LogicalAddress addr, uint sub_id) override {
+        if (size < sizeof(u64))
+            return;
+
+        u64 send_time;
+        memcpy(&send_time, data, sizeof(send_time));
+        g_results.received++;
+        g_results.latencies.push_back(dev_manager->get_time() - send_time);
+    }
+
+    void on_subscription_done(LogicalAddress addr, uint sub_id, SubscriptionDoneState state) override {
+        if (state != SubscriptionDoneState::OK)
+            g_results.rejected++;
+    }
+};
+
+
+struct BenchOptions
+{
+    SimLinkConfig link;
+    uint nodes = 100;
+    uint seconds = 10;
+    uint period = 1000; // ms
+    uint seed = 1;
+};
+
+static u64 percentile(std::vector<u64>& values, float fraction) {
+    if (values.empty())
+        return 0;
+    auto nth = values.begin() + (size_t) ((values.size() - 1) * fraction);
+    std::nth_element(values.begin(), nth, values.end());
+    return *nth;
+}
+
+static void print_results(const char* name, const BenchOptions& options, u64 expected, double wall_seconds) {
+    auto& stats = g_network->stats;
+    printf("%s: %u nodes, %u s simulated, %.2f s wall, %llu node runs\n", name, options.nodes, options.seconds,
+           wall_seconds, (unsigned long long) stats.node_runs);
+    printf("  sent %llu packets (%llu bytes), delivered %llu, lost %llu\n", (unsigned long long) stats.sent_packets,
+           (unsigned long long) stats.sent_bytes, (unsigned long long) stats.delivered_packets,
+           (unsigned long long) stats.lost_packets);
+    printf("  received %llu / %llu (%.2f%%), rejected %llu, %.1f per simulated second\n",
+           (unsigned long long) g_results.received, (unsigned long long) expected,
+           expected ? 100.0 * g_results.received / expected : 0.0, (unsigned long long) g_results.rejected,
+           (double) g_results.received / options.seconds);
+    printf("  latency p50 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+           percentile(g_results.latencies, 0.5f) / 1000.0, percentile(g_results.latencies, 0.99f) / 1000.0,
+           percentile(g_results.latencies, 0.999f) / 1000.0, percentile(g_results.latencies, 1.f) / 1000.0);
+
+    u64 dropped[TX_CLASS_COUNT] = {};
+    for (auto& node : g_network->nodes) {
+        for (uint i = 0; i < TX_CLASS_COUNT; ++i)
+            dropped[i] += node->manager.tx_scheduler.stats[i].dropped;
+    }
+    printf("  tx queue drops: interactive %llu, normal %llu, bulk %llu\n", (unsigned long long) dropped[0],
+           (unsigned long long) dropped[1], (unsigned long long) dropped[2]);
+    printf("  memory of all nodes, %zu bytes of manager per node:\n", sizeof(LogicalDeviceManager));
+    print_memory_report();
+}
+
+static void run_discovery(const BenchOptions& options) {
+    SimNetwork network(options.link, options.seed);
+    g_network = &network;
+    g_boot_times.assign(options.nodes + 1, 0);
+
+    std::vector<std::unique_ptr<DiscoveryDevice>> devices;
+    for (uint i = 0; i < options.nodes; ++i) {
+        auto& node = network.add_node();
+        node.manager.compact_discovery = true;
+        attach_capture(node);
+    }
+
+    // nodes boot during the first second in random order
+    std::vector<std::pair<u64, SimNode*>> boots;
+    for (auto& node : network.nodes)
+        boots.emplace_back(network.clock.now_us() + network.random() % 1'000'000, node.get());
+    std::sort(boots.begin(), boots.end(), [](auto& a, auto& b) { return a.first < b.first; });
+
+    auto wall_start = std::chrono::steady_clock::now();
+    auto start = network.clock.now_us();
+    for (auto& [time, node] : boots) {
+        advance(network, time);
+        g_boot_times[node->transport.addr] = time;
+        auto& device = devices.emplace_back(std::make_unique<DiscoveryDevice>(&node->manager, options.nodes));
+        node->manager.add_device(device.get());
+        network.wake(*node);
+    }
+    advance(network, start + options.seconds * 1'000'000ull);
+
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+    print_results("discovery", options, (u64) options.nodes * (options.nodes - 1), wall.count());
+}
+
+static void run_fanout(const BenchOptions& options) {
+    SimNetwork network(options.link, options.seed);
+    g_network = &network;
+
+    // enough notifiers on node 1 to serve every subscriber
+    auto& notifier_node = network.add_node();
+    notifier_node.manager.compact_discovery = true;
+    attach_capture(notifier_node);
+    auto subscriber_count = options.nodes - 1;
+    auto notifier_count = (subscriber_count + SubscriptionManager::CAPACITY - 1) / SubscriptionManager::CAPACITY;
+    std::vector<std::unique_ptr<LogicalDevice>> devices;
+    for (uint i = 0; i < notifier_count; ++i) {
+        auto& device = devices.emplace_back(std::make_unique<NotifierDevice>(&notifier_node.manager, i + 1));
+        notifier_node.manager.add_device(device.get());
+    }
+
+    auto wall_start = std::chrono::steady_clock::now();
+    auto start = network.clock.now_us();
+    for (uint i = 0; i < subscriber_count; ++i) {
+        auto& node = network.add_node();
+        node.manager.compact_discovery = true;
+        attach_capture(node);
+        auto device = std::make_unique<SubscriberDevice>(&node.manager);
+        node.manager.add_device(device.get());
+        device->subscribe({notifier_node.transport.addr, (ushort) (1 + i / SubscriptionManager::CAPACITY)},
+                          options.seconds + 10, options.period);
+        devices.push_back(std::move(device));
+        network.wake(node);
+    }
+    network.wake(notifier_node);
+    advance(network, start + options.seconds * 1'000'000ull);
+
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wall_start;
+    print_results("fanout", options, g_results.sent, wall.count());
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("usage: %s <discovery|fanout> [--nodes N] [--seconds S] [--period MS] [--latency US] [--jitter US] "
+               "[--loss P] [--bandwidth BYTES_PER_S] [--seed N] [--capture FILE] [--capture-node ADDR]\n", argv[0]);
+        return 1;
+    }
+
+    BenchOptions options;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        auto key = argv[i];
+        auto value = argv[i + 1];
+        if (!strcmp(key, "--nodes"))          options.nodes = std::max(2, atoi(value));
+        else if (!strcmp(key, "--seconds"))   options.seconds = std::max(1, atoi(value));
+        else if (!strcmp(key, "--period"))    options.period = std::max(1, atoi(value));
+        else if (!strcmp(key, "--latency"))   options.link.latency = strtoull(value, nullptr, 10);
+        else if (!strcmp(key, "--jitter"))    options.link.jitter = strtoull(value, nullptr, 10);
+        else if (!strcmp(key, "--loss"))      options.link.loss = (float) atof(value);
+        else if (!strcmp(key, "--bandwidth")) options.link.bandwidth = strtoul(value, nullptr, 10);
+        else if (!strcmp(key, "--seed"))      options.seed = strtoul(value, nullptr, 10);
+        else if (!strcmp(key, "--capture-node")) g_capture_node = strtoul(value, nullptr, 10);
+        else if (!strcmp(key, "--capture")) {
+            g_capture_file = fopen(value, "wb");
+            if (!g_capture_file || !PacketCapture::write_header(g_capture_file)) {
+                printf("can't write %s\n", value);
+                return 1;
+            }
+        }
+        else {
+            printf("unknown option %s\n", key);
+            return 1;
+        }
+    }
+
+    if (KHAWASU_STATIC_MEMORY && options.nodes > KHAWASU_MAX_MANAGERS) {
+        printf("static arenas are sized for %d nodes, build with a greater KHAWASU_MAX_MANAGERS\n",
+               KHAWASU_MAX_MANAGERS);
+        return 1;
+    }
+
+    if (!strcmp(argv[1], "discovery"))
+        run_discovery(options);
+    else if (!strcmp(argv[1], "fanout"))
+        run_fanout(options);
+    else {
+        printf("unknown benchmark %s\n", argv[1]);
+        return 1;
+    }
+
+    if (g_capture_file) {
+        g_capture.drain(g_capture_file);
+        fclose(g_capture_file);
+        if (g_capture.get_dropped())
+            printf("capture dropped %llu packets\n", (unsigned long long) g_capture.get_dropped());
+    }
+    return 0;
+}
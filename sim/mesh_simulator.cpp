@@ -0,0 +1,123 @@
+#include "mesh_simulator.h"
+#include <algorithm>
+
+
+// transport
+void SimTransport::send(MeshProto::far_addr_t dst_phy, const ubyte* data, uint size) {
+    network.transmit(*this, dst_phy, data, size);
+}
+
+
+// node
+SimNode::SimNode(SimNetwork& network, MeshProto::far_addr_t addr) : transport(network, addr), manager(&transport) {
+    manager.set_clock(&network.clock);
+    manager.property_store = &properties;
+    // the simulated radio reports its airtime by itself, deep queues show where the network saturates
+    manager.tx_scheduler.rate = 0;
+    manager.tx_scheduler.config[(ubyte) TxClass::NORMAL].queue_limit = 1024;
+}
+
+
+// network
+SimNetwork::SimNetwork(const SimLinkConfig& config_, uint seed) : config(config_), random_state(seed | 1) { }
+
+SimNode& SimNetwork::add_node() {
+    auto& node = nodes.emplace_back(std::make_unique<SimNode>(*this, nodes.size() + 1));
+    wake(*node);
+    return *node;
+}
+
+SimNode* SimNetwork::get_node(MeshProto::far_addr_t addr) {
+    if (addr == 0 || addr > nodes.size())
+        return nullptr;
+    return nodes[addr - 1].get();
+}
+
+void SimNetwork::wake(SimNode& node) {
+    node.wakeup = std::max(node.manager.next_wakeup_us(), clock.now_us());
+    wakeups.push({node.wakeup, node.transport.addr});
+}
+
+void SimNetwork::run_node(SimNode& node) {
+    stats.node_runs++;
+    auto next = node.manager.run_until(0ull - 1);
+
+    // devices polled on every run would keep the node busy forever at the same virtual time
+    if (next <= clock.now_us())
+        next = clock.now_us() + config.poll_interval;
+
+    node.wakeup = next;
+    wakeups.push({next, node.transport.addr});
+}
+
+void SimNetwork::run_until(u64 time) {
+    while (true) {
+        while (!wakeups.empty() && wakeups.top().time != get_node(wakeups.top().addr)->wakeup)
+            wakeups.pop();
+
+        auto next_packet = in_flight.empty() ? 0ull - 1 : in_flight.top().time;
+        auto next_run = wakeups.empty() ? 0ull - 1 : wakeups.top().time;
+        auto next = std::min(next_packet, next_run);
+        if (next > time)
+            break;
+
+        clock.advance_to(next);
+        if (next_packet <= next_run) {
+            auto packet = in_flight.top();
+            in_flight.pop();
+
+            auto node = get_node(packet.dst);
+            stats.delivered_packets++;
+            node->manager.dispatch_overlay_packet(packet.data->data(), packet.data->size(), packet.src);
+            wake(*node);
+        } else {
+            auto node = get_node(wakeups.top().addr);
+            wakeups.pop();
+            run_node(*node);
+        }
+    }
+
+    clock.advance_to(time);
+}
+
+void SimNetwork::transmit(SimTransport& src, MeshProto::far_addr_t dst_phy, const ubyte* data, uint size) {
+    stats.sent_packets++;
+    stats.sent_bytes += size;
+
+    // transmitter sends one packet at a time, broadcasts occupy it once
+    auto start = std::max(clock.now_us(), src.tx_busy_until);
+    src.tx_busy_until = start + (config.bandwidth ? (u64) size * 1'000'000 / config.bandwidth : 0);
+    auto arrival = src.tx_busy_until + config.latency;
+
+    auto buffer = std::make_shared<const std::vector<ubyte>>(data, data + size);
+    if (dst_phy == MeshProto::BROADCAST_FAR_ADDR) {
+        for (auto& node : nodes) {
+            if (node->transport.addr != src.addr)
+                enqueue(arrival, src.addr, node->transport.addr, buffer);
+        }
+    }
+    else if (get_node(dst_phy))
+        enqueue(arrival, src.addr, dst_phy, buffer);
+    else
+        stats.lost_packets++;
+}
+
+void SimNetwork::enqueue(u64 time, MeshProto::far_addr_t src, MeshProto::far_addr_t dst,
+                         const std::shared_ptr<const std::vector<ubyte>>& data) {
+    if (config.loss > 0 && random() < (u64) (config.loss * 4294967296.0)) {
+        stats.lost_packets++;
+        return;
+    }
+
+    if (config.jitter)
+        time += random() % (config.jitter + 1);
+    in_flight.push({time, seq++, src, dst, data});
+}
+
+uint SimNetwork::random() {
+    // xorshift32, same as LogicalDeviceManager::random
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <memory>
+#include <queue>
+#include <vector>
+#include "logical_device_manager.h"
+#include "mesh_transport.h"
+#include "monotonic_clock.h"
+
+// deterministic single-hop network of many LogicalDeviceManager instances in one process, driven by a virtual
+// clock. every node transmits through its own SimTransport, packets are delivered in the order of arrival time
+// with configurable latency, loss and bandwidth. same seed and config give the same run
+
+struct SimLinkConfig
+{
+    u64 latency = 5'000;        // us, transmission end to delivery
+    u64 jitter = 1'000;         // us, random extra latency, per receiver
+    float loss = 0;             // probability to drop a packet, per receiver
+    uint bandwidth = 31'250;    // bytes per second of a node transmitter (250 kbit/s), zero - unlimited
+    u64 poll_interval = 1'000;  // us, how often nodes with devices polled on every run (see get_next_update_time) run
+};
+
+struct SimStats
+{
+    u64 sent_packets;
+    u64 sent_bytes;
+    u64 delivered_packets;
+    u64 lost_packets;
+    u64 node_runs;
+};
+
+class SimNetwork;
+
+class SimTransport : public MeshTransport
+{
+public:
+    SimNetwork& network;
+    MeshProto::far_addr_t addr;
+    u64 tx_busy_until = 0; // virtual time, us
+
+    SimTransport(SimNetwork& network_, MeshProto::far_addr_t addr_) : network(network_), addr(addr_) { }
+
+    MeshProto::far_addr_t get_self_addr() override {
+        return addr;
+    }
+
+    void send(MeshProto::far_addr_t dst_phy, const ubyte* data, uint size) override;
+
+    u64 get_ready_time() override {
+        return tx_busy_until;
+    }
+};
+
+struct SimNode
+{
+    SimTransport transport;
+    PropertyStore properties; // memory-only, nodes don't share group memberships
+    LogicalDeviceManager manager;
+    u64 wakeup = 0; // virtual time of the next scheduled run, us
+
+    SimNode(SimNetwork& network, MeshProto::far_addr_t addr);
+};
+
+class SimNetwork
+{
+public:
+    VirtualClock clock;
+    SimLinkConfig config;
+    SimStats stats{};
+    std::vector<std::unique_ptr<SimNode>> nodes; // node with address `n` is at index `n - 1`
+
+    SimNetwork(const SimLinkConfig& config_, uint seed);
+
+    // nodes are addressed from 1 in order of creation
+    SimNode& add_node();
+
+    // returns nullptr for unknown address
+    SimNode* get_node(MeshProto::far_addr_t addr);
+
+    // reschedules the node after it was changed from outside (devices added, packets sent)
+    void wake(SimNode& node);
+
+    // delivers packets and runs nodes in time order until virtual `time`, then leaves the clock at `time`
+    void run_until(u64 time);
+
+    // called by SimTransport
+    void transmit(SimTransport& src, MeshProto::far_addr_t dst_phy, const ubyte* data, uint size);
+
+    uint random();
+
+protected:
+    struct InFlight
+    {
+        u64 time;
+        u64 seq; // keeps the order of packets arriving at the same time
+        MeshProto::far_addr_t src;
+        MeshProto::far_addr_t dst;
+        std::shared_ptr<const std::vector<ubyte>> data; // shared by all receivers of a broadcast
+
+        inline bool operator>(const InFlight& other) const {
+            return time != other.time ? time > other.time : seq > other.seq;
+        }
+    };
+
+    struct Wakeup
+    {
+        u64 time;
+        MeshProto::far_addr_t addr;
+
+        inline bool operator>(const Wakeup& other) const {
+            return time != other.time ? time > other.time : addr > other.addr;
+        }
+    };
+
+    std::priority_queue<InFlight, std::vector<InFlight>, std::greater<>> in_flight;
+    std::priority_queue<Wakeup, std::vector<Wakeup>, std::greater<>> wakeups; // stale entries are skipped
+    u64 seq = 0;
+    uint random_state;
+
+    void enqueue(u64 time, MeshProto::far_addr_t src, MeshProto::far_addr_t dst,
+                 const std::shared_ptr<const std::vector<ubyte>>& data);
+
+    void run_node(SimNode& node);
+};
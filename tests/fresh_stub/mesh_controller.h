@@ -0,0 +1,17 @@
+#pragma once
+
+#include "types.h"
+
+namespace MeshProto
+{
+    typedef uint far_addr_t;
+
+    const far_addr_t BROADCAST_FAR_ADDR = 0xFFFFFFFF;
+}
+
+// no radio behind it, the stub builds use their own MeshTransport (see sim/mesh_simulator.h)
+class MeshController
+{
+public:
+    MeshProto::far_addr_t self_addr = 1;
+};
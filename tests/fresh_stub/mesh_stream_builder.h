@@ -0,0 +1,14 @@
+#pragma once
+
+#include "mesh_controller.h"
+
+// drops everything written, see mesh_controller.h
+class MeshStreamBuilder
+{
+public:
+    uint stream_size;
+
+    MeshStreamBuilder(MeshController& mesh, MeshProto::far_addr_t dst, uint size) : stream_size(size) { }
+
+    void write(const ubyte* data, uint size) { }
+};
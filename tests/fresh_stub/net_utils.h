@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstring>
+#include "types.h"
+
+// values are little-endian on the wire, the stub is only meant for little-endian hosts, so it just copies them
+// (packets are packed, fields may be unaligned)
+
+template <typename T>
+inline T net_load(const T& src) {
+    T dst;
+    memcpy(&dst, &src, sizeof(T));
+    return dst;
+}
+
+template <typename T, typename U>
+inline void net_store(T& dst, U src) {
+    auto value = (T) src;
+    memcpy(&dst, &value, sizeof(T));
+}
+
+inline void net_memcpy(void* dst, const void* src, size_t size) {
+    memcpy(dst, src, size);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+// host stand-in for the fresh library, just enough of it to build the core, the simulator and the unit tests
+// without the mesh, selected with KHAWASU_FRESH_STUB (see CMakeLists.txt)
+
+typedef uint8_t ubyte;
+typedef int8_t byte;
+typedef uint16_t ushort;
+typedef uint32_t uint;
+typedef uint64_t u64;
+typedef int64_t i64;
+
+inline char* itoa(int value, char* str, int base) {
+    snprintf(str, 12, base == 16 ? "%x" : "%d", value);
+    return str;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdio>
+#include "logical_device_manager.h"
+#include "monotonic_clock.h"
+
+// failed checks are printed and counted, `main` of a test returns `test_result()`
+
+inline uint test_failures = 0;
+
+#define CHECK(condition)                                                                \
+    do {                                                                                \
+        if (!(condition)) {                                                             \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);        \
+            test_failures++;                                                            \
+        }                                                                               \
+    } while (0)
+
+inline int test_result() {
+    if (test_failures)
+        printf("%u checks failed\n", test_failures);
+    return test_failures ? 1 : 0;
+}
+
+
+// counts sent overlay packets, nothing leaves the process
+class TestTransport : public MeshTransport
+{
+public:
+    MeshProto::far_addr_t self_addr = 1;
+    uint sent_packets = 0;
+
+    MeshProto::far_addr_t get_self_addr() override {
+        return self_addr;
+    }
+
+    void send(MeshProto::far_addr_t dst_phy, const ubyte* data, uint size) override {
+        sent_packets++;
+    }
+};
@@ -0,0 +1,137 @@
+#include <string>
+#include <string_view>
+#include "crc32.h"
+#include "descriptor_codec.h"
+#include "net_utils.h"
+#include "protocols/logical_views.h"
+#include "test_common.h"
+
+using namespace LogicalProto;
+
+static const DeviceAttrib ATTRIBS[] = {
+    {"location", "kitchen"},  // well-known key, literal value
+    {"vendor", "acme"},
+};
+
+static const DeviceApiAction ACTIONS[] = {
+    {ActionType::TOGGLE, "toggle"},           // well-known
+    {ActionType::RANGE, "brightness"},
+    {ActionType::IMMEDIATE, "restart_radio"}, // literal
+};
+
+static std::vector<ubyte> encode(const char* name, const DeviceAttrib* attribs, ubyte attrib_count,
+                                 const DeviceApiAction* actions, ubyte action_count) {
+    auto size = DescriptorCodec::encode(nullptr, DeviceClassEnum::RELAY, name, strlen(name), attribs, attrib_count,
+                                        actions, action_count);
+    std::vector<ubyte> data(size);
+    CHECK(DescriptorCodec::encode(data.data(), DeviceClassEnum::RELAY, name, strlen(name), attribs, attrib_count,
+                                  actions, action_count) == size);
+    return data;
+}
+
+static void test_round_trip() {
+    auto data = encode("hall light", ATTRIBS, 2, ACTIONS, 3);
+
+    DescriptorPacket packet;
+    CHECK(DescriptorCodec::decode_to_hello_world(data.data(), data.size(), packet));
+
+    HelloWorldView view((const LogicalPacket*) packet.data(), packet.size());
+    CHECK(view.is_valid());
+    CHECK(view.device_class() == DeviceClassEnum::RELAY);
+    CHECK(view.name() == "hall light");
+
+    CHECK(view.attribs().size() == 2);
+    uint i = 0;
+    for (auto attrib : view.attribs()) {
+        CHECK(attrib.key == std::string_view(ATTRIBS[i].name, ATTRIBS[i].name_len));
+        CHECK(attrib.value == std::string_view(ATTRIBS[i].value, ATTRIBS[i].value_len));
+        i++;
+    }
+
+    CHECK(view.actions().size() == 3);
+    i = 0;
+    for (auto action : view.actions()) {
+        CHECK(action.type == ACTIONS[i].type);
+        CHECK(action.name == std::string_view(ACTIONS[i].name, ACTIONS[i].length));
+        i++;
+    }
+}
+
+static void test_well_known_words() {
+    // a well-known word takes one byte, a literal takes its length and one more
+    auto known = encode("", nullptr, 0, ACTIONS, 1);
+    const DeviceApiAction literal_action[] = {{ActionType::TOGGLE, "flip"}};
+    auto literal = encode("", nullptr, 0, literal_action, 1);
+    CHECK(literal.size() == known.size() + 4);
+
+    auto empty = encode("", nullptr, 0, nullptr, 0);
+    CHECK(empty.size() <= DescriptorCodec::INLINE_LIMIT);
+}
+
+static void test_malformed() {
+    auto data = encode("hall light", ATTRIBS, 2, ACTIONS, 3);
+    DescriptorPacket packet;
+
+    // every truncation is rejected
+    for (uint size = 0; size < data.size(); ++size)
+        CHECK(!DescriptorCodec::decode_to_hello_world(data.data(), size, packet));
+
+    // a string longer than the rest of the descriptor
+    auto broken = data;
+    broken[1] = 0x7E; // literal of 63 bytes in place of the name
+    CHECK(!DescriptorCodec::decode_to_hello_world(broken.data(), broken.size(), packet));
+
+    // a well-known word outside of the dictionary
+    broken = data;
+    broken[1] = (ubyte) ((DescriptorCodec::WELL_KNOWN_WORD_COUNT << 1) | 1);
+    CHECK(!DescriptorCodec::decode_to_hello_world(broken.data(), broken.size(), packet));
+}
+
+static void test_cache() {
+    auto data = encode("hall light", ATTRIBS, 2, ACTIONS, 3);
+    auto hash = crc32(data.data(), data.size());
+
+    DescriptorCache cache;
+    CHECK(cache.find(hash) == nullptr);
+    CHECK(cache.insert(hash + 1, data.data(), data.size()) == nullptr); // hash mismatch
+    CHECK(cache.insert(hash, data.data(), data.size()) != nullptr);
+    CHECK(cache.find(hash) != nullptr);
+
+    // the least recently used descriptor is evicted
+    for (uint i = 0; i < DescriptorCache::CAPACITY; ++i) {
+        auto name = std::to_string(i);
+        auto other = encode(name.c_str(), nullptr, 0, nullptr, 0);
+        cache.insert(crc32(other.data(), other.size()), other.data(), other.size());
+    }
+    CHECK(cache.find(hash) == nullptr);
+}
+
+static void test_legacy_fallback() {
+    TestTransport transport;
+    VirtualClock clock;
+    LogicalDeviceManager manager(&transport);
+    manager.set_clock(&clock);
+    manager.compact_discovery = true;
+    CHECK(manager.use_compact_discovery());
+
+    // a HELLO_WORLD of another node may come from firmware without compact discovery
+    ubyte data[LOG_PACKET_SIZE(hello_world)] = {};
+    auto packet = (LogicalPacket*) data;
+    net_store(packet->type, LogicalPacketType::HELLO_WORLD);
+    net_store(packet->src_addr, 1);
+    net_store(packet->dst_addr, BROADCAST_PORT);
+    manager.dispatch_packet(packet, sizeof(data), 5);
+    CHECK(!manager.use_compact_discovery());
+
+    clock.advance(LogicalDeviceManager::LEGACY_PEER_TIMEOUT);
+    CHECK(manager.use_compact_discovery());
+}
+
+int main() {
+    test_round_trip();
+    test_well_known_words();
+    test_malformed();
+    test_cache();
+    test_legacy_fallback();
+    return test_result();
+}
@@ -0,0 +1,216 @@
+#include <vector>
+#include "preserved_property.h"
+#include "property_store.h"
+#include "test_common.h"
+
+// power losses are simulated by editing the store file between two opens
+
+static const char* STORE_PATH = "test_property_store.bin";
+
+static std::vector<ubyte> read_file() {
+    std::vector<ubyte> data(2 * KHAWASU_PROPERTY_BANK_SIZE);
+    auto file = fopen(STORE_PATH, "rb");
+    CHECK(file && fread(data.data(), 1, data.size(), file) == data.size());
+    if (file)
+        fclose(file);
+    return data;
+}
+
+static void write_file(const std::vector<ubyte>& data) {
+    auto file = fopen(STORE_PATH, "wb");
+    CHECK(file && fwrite(data.data(), 1, data.size(), file) == data.size());
+    if (file)
+        fclose(file);
+}
+
+// bank with the greater generation among the valid-looking ones
+static uint get_current_bank(const std::vector<ubyte>& data) {
+    uint current = 0, current_generation = 0;
+    for (uint i = 0; i < 2; ++i) {
+        auto header = (const PropertyBankHeader*) (data.data() + i * KHAWASU_PROPERTY_BANK_SIZE);
+        if (memcmp(header->magic, PropertyBankHeader::MAGIC, sizeof(header->magic)) == 0
+            && header->generation >= current_generation) {
+            current = i;
+            current_generation = header->generation;
+        }
+    }
+    return current;
+}
+
+static uint read_value(PropertyStore& store, ushort instance_id, uint fallback) {
+    uint value = fallback;
+    store.read(instance_id, 1, &value, sizeof(value));
+    return value;
+}
+
+static void test_round_trip() {
+    remove(STORE_PATH);
+    {
+        PropertyStore store;
+        CHECK(store.open(STORE_PATH));
+        uint value = 0;
+        CHECK(!store.read(1, 1, &value, sizeof(value)));
+
+        // enough writes to compact several times
+        for (uint i = 0; i < 5000; ++i)
+            CHECK(store.write(i % 50, 1, &i, sizeof(i)));
+        CHECK(store.get_used_size() <= store.get_bank_size());
+
+        ushort tagged = 7;
+        CHECK(store.write(100, 1, &tagged, sizeof(tagged), 0x1234));
+    }
+
+    {
+        PropertyStore store;
+        CHECK(store.open(STORE_PATH));
+        CHECK(read_value(store, 3, 0) == 4953);
+        CHECK(read_value(store, 49, 0) == 4999);
+
+        ushort tagged = 0;
+        CHECK(store.read(100, 1, &tagged, sizeof(tagged), 0x1234) && tagged == 7);
+        CHECK(!store.read(100, 1, &tagged, sizeof(tagged), 0x4321)); // the type changed
+        uint wider;
+        CHECK(!store.read(100, 1, &wider, sizeof(wider), 0x1234));    // the size changed
+    }
+
+    // another schema drops everything
+    PropertyStore other_schema;
+    CHECK(other_schema.open(STORE_PATH, KHAWASU_PROPERTY_SCHEMA + 1));
+    CHECK(read_value(other_schema, 3, 0) == 0);
+}
+
+static void test_torn_record() {
+    remove(STORE_PATH);
+    uint torn_offset;
+    {
+        PropertyStore store;
+        store.open(STORE_PATH);
+        uint value = 1;
+        store.write(1, 1, &value, sizeof(value));
+        store.write(2, 1, &value, sizeof(value));
+        torn_offset = store.get_used_size();
+        value = 2;
+        store.write(2, 1, &value, sizeof(value));
+    }
+
+    // the value of the last record was only partly written
+    auto data = read_file();
+    auto bank = get_current_bank(data);
+    data[bank * KHAWASU_PROPERTY_BANK_SIZE + torn_offset + sizeof(PropertyRecordHeader)] ^= 0xFF;
+    write_file(data);
+
+    {
+        PropertyStore store;
+        store.open(STORE_PATH);
+        CHECK(read_value(store, 1, 0) == 1);
+        CHECK(read_value(store, 2, 0) == 1); // the previous record wins
+
+        // appends move past the torn record
+        uint value = 3;
+        CHECK(store.write(2, 1, &value, sizeof(value)));
+    }
+
+    PropertyStore store;
+    store.open(STORE_PATH);
+    CHECK(read_value(store, 1, 0) == 1);
+    CHECK(read_value(store, 2, 0) == 3);
+}
+
+static void test_interrupted_compaction() {
+    remove(STORE_PATH);
+    {
+        PropertyStore store;
+        store.open(STORE_PATH);
+        for (uint i = 1; i <= 10; ++i)
+            store.write(i, 1, &i, sizeof(i));
+    }
+    auto before = read_file();
+    auto old_bank = get_current_bank(before);
+    {
+        PropertyStore store;
+        store.open(STORE_PATH);
+        uint value = 100;
+        store.write(1, 1, &value, sizeof(value));
+        CHECK(store.compact());
+    }
+    auto after = read_file();
+    auto new_bank = get_current_bank(after);
+    CHECK(new_bank != old_bank);
+
+    // power lost before the header of the new bank was written
+    auto lost_header = after;
+    memset(lost_header.data() + new_bank * KHAWASU_PROPERTY_BANK_SIZE, 0xFF, sizeof(PropertyBankHeader));
+    write_file(lost_header);
+    {
+        PropertyStore store;
+        store.open(STORE_PATH);
+        CHECK(read_value(store, 1, 0) == 100); // journal of the old bank
+        CHECK(read_value(store, 10, 0) == 10);
+    }
+
+    // header written, but a part of the snapshot wasn't
+    auto torn_snapshot = after;
+    torn_snapshot[new_bank * KHAWASU_PROPERTY_BANK_SIZE + sizeof(PropertyBankHeader) + 1] ^= 0xFF;
+    write_file(torn_snapshot);
+    {
+        PropertyStore store;
+        store.open(STORE_PATH);
+        CHECK(read_value(store, 1, 0) == 100);
+        CHECK(read_value(store, 10, 0) == 10);
+    }
+
+    write_file(after);
+    PropertyStore store;
+    store.open(STORE_PATH);
+    CHECK(read_value(store, 1, 0) == 100);
+    CHECK(read_value(store, 10, 0) == 10);
+}
+
+struct Untagged
+{
+    uint value;
+};
+
+struct Tagged
+{
+    static constexpr ushort PROPERTY_TYPE_ID = 100;
+    uint value;
+};
+
+static void test_type_tags() {
+    // tags are on flash, they must not change between builds
+    CHECK(get_property_type_tag<uint>() == 0x9570);
+    CHECK(get_property_type_tag<int>() == 0x731C);
+    CHECK(get_property_type_tag<float>() == 0xBF58);
+    CHECK(get_property_type_tag<ushort[4]>() == 0x67BA);
+    CHECK(get_property_type_tag<Untagged>() == 0);
+    CHECK(get_property_type_tag<Tagged>() != 0 && get_property_type_tag<Tagged>() != get_property_type_tag<uint>());
+
+    PropertyStore store;
+    {
+        PreservedProperty<uint> property(&store, 1, "value", 5u);
+        property = 7u;
+    }
+    PreservedProperty<int> other_type(&store, 1, "value", -1);
+    CHECK(*other_type == -1);
+    PreservedProperty<uint> same_type(&store, 1, "value", 0u);
+    CHECK(*same_type == 7);
+}
+
+static void test_memory_only() {
+    PropertyStore store;
+    uint value = 5;
+    CHECK(!store.read(1, 1, &value, sizeof(value)));
+    CHECK(store.write(1, 1, &value, sizeof(value)));
+    CHECK(read_value(store, 1, 0) == 5);
+}
+
+int main() {
+    test_round_trip();
+    test_torn_record();
+    test_interrupted_compaction();
+    test_type_tags();
+    test_memory_only();
+    remove(STORE_PATH);
+    return test_result();
+}
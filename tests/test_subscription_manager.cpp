@@ -0,0 +1,259 @@
+#include "net_utils.h"
+#include "test_common.h"
+
+using namespace LogicalProto;
+using namespace OverlayProto;
+
+class TestDevice : public LogicalDevice
+{
+public:
+    uint received = 0;
+    uint timer_updates = 0;
+    uint done_count = 0;
+    uint last_done_id = 0;
+    SubscriptionDoneState last_done_state = SubscriptionDoneState::OK;
+
+    using LogicalDevice::LogicalDevice;
+
+    void on_device_discover(LogicalPacket* packet, ushort size, MeshProto::far_addr_t src_phy) override { }
+
+    void on_subscription_data(const ubyte* data, uint size, LogicalAddress addr, uint sub_id) override {
+        received++;
+    }
+
+    void on_subscription_timer_update(LogicalAddress addr, uint sub_id, ushort act_id, const void* format) override {
+        timer_updates++;
+    }
+
+    void on_subscription_done(LogicalAddress addr, uint sub_id, SubscriptionDoneState state) override {
+        done_count++;
+        last_done_id = sub_id;
+        last_done_state = state;
+    }
+};
+
+// notifier and subscriber on the same node, callbacks are delivered right away
+struct Fixture
+{
+    TestTransport transport;
+    VirtualClock clock;
+    LogicalDeviceManager manager{&transport};
+    TestDevice notifier{&manager, "notifier", 1};
+    TestDevice subscriber{&manager, "subscriber", 2};
+
+    Fixture() {
+        manager.set_clock(&clock);
+        manager.add_device(&notifier);
+        manager.add_device(&subscriber);
+    }
+
+    SubscriptionDoneState start(uint sub_id, ushort duration, uint period, SubscriptionStartFlags flags = {},
+                                const SubscriptionFilter* filter = nullptr) {
+        SubscriptionStartPacket packet;
+        net_store(packet.id, sub_id);
+        net_store(packet.action_id, 0);
+        net_store(packet.duration, duration);
+        net_store(packet.period, period);
+        return notifier.subscriptions.add_subscriber(&packet, flags, (const ubyte*) filter,
+                                                     filter ? sizeof(SubscriptionFilter) : 0, {1, 2});
+    }
+
+    // SUBSCRIPTION_START sent by the subscriber device, answered with SUBSCRIPTION_DONE
+    void send_start(uint sub_id, ushort duration) {
+        auto log = manager.alloc_logical_packet_ptr({1, 1}, 2, 0, OverlayProtoType::UNRELIABLE,
+                                                    LogicalPacketType::SUBSCRIPTION_START);
+        net_store(log.ptr()->subscription_start.id, sub_id);
+        net_store(log.ptr()->subscription_start.action_id, 0);
+        net_store(log.ptr()->subscription_start.duration, duration);
+        net_store(log.ptr()->subscription_start.period, 0);
+        manager.finish_ptr(log);
+    }
+
+    void send(uint sub_id, ubyte value) {
+        notifier.subscriptions.send_callback_data({1, 2}, sub_id, &value, 1);
+    }
+};
+
+static SubscriptionFilter make_filter(uint dead_band, ushort min_interval,
+                                      SubscriptionFilterFlags flags = (SubscriptionFilterFlags) 0) {
+    SubscriptionFilter filter{};
+    net_store(filter.value_format, FilterValueFormat::UINT8);
+    net_store(filter.flags, flags);
+    net_store(filter.dead_band, dead_band);
+    net_store(filter.min_interval, min_interval);
+    return filter;
+}
+
+static void test_capacity_and_stop() {
+    Fixture fixture;
+    auto& subscriptions = fixture.notifier.subscriptions;
+    for (uint id = 1; id <= SubscriptionManager::CAPACITY; ++id)
+        CHECK(fixture.start(id, 60, 0) == SubscriptionDoneState::OK);
+    CHECK(fixture.start(1000, 60, 0) == SubscriptionDoneState::CAPACITY_EXHAUSTED);
+
+    // a renewed START takes no new slot
+    CHECK(fixture.start(1, 60, 0) == SubscriptionDoneState::OK);
+    CHECK(subscriptions.count == SubscriptionManager::CAPACITY);
+
+    // the last subscriber moves into the freed slot and is still found through the index
+    SubscriptionStopPacket stop;
+    net_store(stop.id, 2);
+    subscriptions.stop_subscription(&stop, {1, 2});
+    CHECK(subscriptions.count == SubscriptionManager::CAPACITY - 1);
+    CHECK(subscriptions.subscribers[1].subscription_id == SubscriptionManager::CAPACITY);
+    CHECK(fixture.start(SubscriptionManager::CAPACITY, 60, 0) == SubscriptionDoneState::OK);
+    CHECK(subscriptions.count == SubscriptionManager::CAPACITY - 1);
+    CHECK(fixture.start(1000, 60, 0) == SubscriptionDoneState::OK);
+    CHECK(fixture.start(1001, 60, 0) == SubscriptionDoneState::CAPACITY_EXHAUSTED);
+}
+
+static void test_periodic_and_expiry() {
+    Fixture fixture;
+    auto& subscriptions = fixture.notifier.subscriptions;
+    auto start_time = fixture.clock.now_us();
+    fixture.start(1, 1, 100);
+
+    for (uint i = 1; i <= 9; ++i) {
+        fixture.clock.advance_to(start_time + i * 100'000);
+        subscriptions.update_periodic();
+    }
+    CHECK(fixture.notifier.timer_updates == 9);
+
+    fixture.clock.advance_to(start_time + 1'000'000);
+    subscriptions.update_periodic();
+    CHECK(subscriptions.count == 0);
+}
+
+static void test_long_lease() {
+    Fixture fixture;
+    auto& subscriptions = fixture.notifier.subscriptions;
+    auto start_time = fixture.clock.now_us();
+
+    // durations over 2147 s don't fit into int microseconds
+    fixture.start(1, 3000, 0);
+    fixture.clock.advance_to(start_time + 2200'000'000ull);
+    subscriptions.update_periodic();
+    CHECK(subscriptions.count == 1);
+
+    fixture.clock.advance_to(start_time + 3000'000'000ull);
+    subscriptions.update_periodic();
+    CHECK(subscriptions.count == 0);
+}
+
+static void test_dead_band_keep_alive() {
+    Fixture fixture;
+    auto filter = make_filter(5000, 0); // 5 units
+    CHECK(fixture.start(1, 60, 100, SubscriptionStartFlags::HAS_FILTER, &filter) == SubscriptionDoneState::OK);
+    CHECK(fixture.start(2, 60, 100, SubscriptionStartFlags::HAS_FILTER, nullptr)
+          == SubscriptionDoneState::INVALID_FORMAT);
+
+    // the first value passes, then every MAX_SUPPRESSED_CALLBACKS + 1-th unchanged one is sent as a keep-alive
+    for (uint i = 0; i < 2 * (SubscriptionManager::MAX_SUPPRESSED_CALLBACKS + 1) + 1; ++i) {
+        fixture.clock.advance(1000);
+        fixture.send(1, 10);
+    }
+    CHECK(fixture.subscriber.received == 3);
+
+    // changes within the dead-band are suppressed, a change beyond it passes right away
+    fixture.send(1, 14);
+    CHECK(fixture.subscriber.received == 3);
+    fixture.send(1, 20);
+    CHECK(fixture.subscriber.received == 4);
+}
+
+static void test_relative_dead_band() {
+    Fixture fixture;
+    auto filter = make_filter(100, 0, SubscriptionFilterFlags::RELATIVE_DEAD_BAND); // 10% of the last sent value
+    fixture.start(1, 60, 100, SubscriptionStartFlags::HAS_FILTER, &filter);
+
+    fixture.send(1, 100);
+    fixture.send(1, 105);
+    CHECK(fixture.subscriber.received == 1);
+    fixture.send(1, 111);
+    CHECK(fixture.subscriber.received == 2);
+}
+
+static void test_min_interval() {
+    Fixture fixture;
+    auto filter = make_filter(0, 50); // 50 ms
+    fixture.start(1, 60, 100, SubscriptionStartFlags::HAS_FILTER, &filter);
+
+    // a new value every 10 ms, one of five is sent
+    for (uint i = 0; i <= 20; ++i) {
+        fixture.send(1, (ubyte) i);
+        fixture.clock.advance(10'000);
+    }
+    CHECK(fixture.subscriber.received == 5);
+}
+
+static void test_renewed_start() {
+    Fixture fixture;
+    auto& subscriber = fixture.notifier.subscriptions.subscribers[0];
+    auto filter = make_filter(5000, 0);
+    fixture.start(1, 60, 100, SubscriptionStartFlags::HAS_FILTER, &filter);
+    fixture.send(1, 10);
+    fixture.send(1, 11);
+    CHECK(fixture.subscriber.received == 1);
+
+    // a renewed START replaces the period, the flags and the filter
+    CHECK(fixture.start(1, 60, 500, SubscriptionStartFlags::STRETCHABLE_PERIOD) == SubscriptionDoneState::OK);
+    CHECK(fixture.notifier.subscriptions.count == 1);
+    CHECK(subscriber.period == 500);
+    CHECK(!subscriber.is_strict());
+    CHECK(subscriber.filter.dead_band == 0);
+    fixture.send(1, 12);
+    CHECK(fixture.subscriber.received == 2);
+}
+
+static void test_subscription_done() {
+    Fixture fixture;
+    auto& subscriber = fixture.subscriber;
+
+    fixture.send_start(7, 60);
+    CHECK(subscriber.done_count == 1);
+    CHECK(subscriber.last_done_id == 7);
+    CHECK(subscriber.last_done_state == SubscriptionDoneState::OK);
+
+    for (uint id = 100; fixture.notifier.subscriptions.count < SubscriptionManager::CAPACITY; ++id)
+        fixture.start(id, 60, 0);
+    fixture.send_start(8, 60);
+    CHECK(subscriber.done_count == 2);
+    CHECK(subscriber.last_done_id == 8);
+    CHECK(subscriber.last_done_state == SubscriptionDoneState::CAPACITY_EXHAUSTED);
+}
+
+static void test_lease_renewal() {
+    Fixture fixture;
+    auto& subscriptions = fixture.notifier.subscriptions;
+    auto start_time = fixture.clock.now_us();
+    fixture.send_start(1, 1);
+    fixture.send_start(2, 1);
+
+    // one RENEW extends both leases, unknown ids are answered with NOT_FOUND
+    fixture.clock.advance_to(start_time + 500'000);
+    const uint ids[] = {1, 2, 3};
+    fixture.subscriber.send_subscription_renew({1, 1}, 10, ids, 3);
+    CHECK(fixture.subscriber.last_done_id == 3);
+    CHECK(fixture.subscriber.last_done_state == SubscriptionDoneState::NOT_FOUND);
+
+    fixture.clock.advance_to(start_time + 2'000'000);
+    subscriptions.update_periodic();
+    CHECK(subscriptions.count == 2);
+
+    fixture.clock.advance_to(start_time + 11'000'000);
+    subscriptions.update_periodic();
+    CHECK(subscriptions.count == 0);
+}
+
+int main() {
+    test_capacity_and_stop();
+    test_periodic_and_expiry();
+    test_long_lease();
+    test_dead_band_keep_alive();
+    test_relative_dead_band();
+    test_min_interval();
+    test_renewed_start();
+    test_subscription_done();
+    test_lease_renewal();
+    return test_result();
+}
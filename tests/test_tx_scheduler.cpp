@@ -0,0 +1,116 @@
+#include "test_common.h"
+#include "tx_scheduler.h"
+
+using namespace OverlayProto;
+
+struct Fixture
+{
+    LogicalPacketPool pool;
+    TestTransport transport;
+    TxScheduler scheduler;
+
+    OverlayPacketBuilder* make_packet(uint size) {
+        void* data;
+        return new OverlayPacketBuilder(&pool, &transport, 2, size, OverlayProtoType::UNRELIABLE, &data);
+    }
+
+    bool push(TxClass tx_class, uint size = 64) {
+        return scheduler.push(tx_class, make_packet(size));
+    }
+
+    // class of the popped packet
+    TxClass pop() {
+        TxClass tx_class = TxClass::BULK;
+        delete scheduler.pop(tx_class);
+        return tx_class;
+    }
+};
+
+static void test_strict_priority() {
+    Fixture fixture;
+    fixture.push(TxClass::BULK);
+    fixture.push(TxClass::NORMAL);
+    fixture.push(TxClass::INTERACTIVE);
+    fixture.push(TxClass::NORMAL);
+    CHECK(fixture.scheduler.size() == 4);
+
+    CHECK(fixture.pop() == TxClass::INTERACTIVE);
+    CHECK(fixture.pop() == TxClass::NORMAL);
+    CHECK(fixture.pop() == TxClass::NORMAL);
+    CHECK(fixture.pop() == TxClass::BULK);
+    CHECK(fixture.scheduler.empty());
+
+    TxClass tx_class;
+    CHECK(fixture.scheduler.pop(tx_class) == nullptr);
+}
+
+static void test_queue_limit() {
+    Fixture fixture;
+    fixture.scheduler.config[(ubyte) TxClass::BULK].queue_limit = 2;
+    CHECK(fixture.push(TxClass::BULK));
+    CHECK(fixture.push(TxClass::BULK));
+    CHECK(!fixture.push(TxClass::BULK));
+    CHECK(fixture.push(TxClass::NORMAL));
+    CHECK(fixture.scheduler.stats[(ubyte) TxClass::BULK].dropped == 1);
+    CHECK(fixture.scheduler.size() == 3);
+
+    fixture.scheduler.clear();
+    CHECK(fixture.scheduler.empty());
+}
+
+static void test_deficit_round_robin() {
+    Fixture fixture;
+    fixture.scheduler.mode = TxScheduler::Mode::DEFICIT_ROUND_ROBIN;
+    for (uint i = 0; i < 20; ++i) {
+        fixture.push(TxClass::INTERACTIVE, 120);
+        fixture.push(TxClass::NORMAL, 120);
+        fixture.push(TxClass::BULK, 120);
+    }
+
+    // quanta of 1024, 512 and 256 bytes share the bandwidth about 4:2:1, no class is starved
+    uint popped[TX_CLASS_COUNT] = {};
+    for (uint i = 0; i < 21; ++i)
+        popped[(ubyte) fixture.pop()]++;
+    CHECK(popped[(ubyte) TxClass::INTERACTIVE] > popped[(ubyte) TxClass::NORMAL]);
+    CHECK(popped[(ubyte) TxClass::NORMAL] > popped[(ubyte) TxClass::BULK]);
+    CHECK(popped[(ubyte) TxClass::BULK] > 0);
+}
+
+static void test_rate_and_pressure() {
+    Fixture fixture;
+    auto& scheduler = fixture.scheduler;
+    u64 time = 1'000'000;
+
+    // the default rate spaces packets out even if the transport takes all of them
+    scheduler.on_sent(TxClass::NORMAL, KHAWASU_TX_RATE, time);
+    CHECK(scheduler.get_ready_time() == time + 1'000'000);
+
+    // without a rate packets may go right away, the pressure follows the recent traffic
+    time += 2'000'000;
+    scheduler.rate = 0;
+    scheduler.on_sent(TxClass::NORMAL, 100, time);
+    CHECK(scheduler.get_ready_time() <= time);
+    CHECK(scheduler.get_pressure(time) == 0);
+    scheduler.on_sent(TxClass::NORMAL, KHAWASU_TX_NOMINAL_RATE / 2, time);
+    CHECK(scheduler.get_pressure(time) >= 2);
+    CHECK(scheduler.get_pressure(time + 300'000) == 0);
+
+    fixture.push(TxClass::NORMAL);
+    CHECK(scheduler.get_pressure(time + 300'000) == 1);
+
+    // 1000 bytes per second, so 100 bytes take 100 ms
+    scheduler.rate = 1000;
+    scheduler.on_sent(TxClass::NORMAL, 100, time + 300'000);
+    CHECK(scheduler.get_ready_time() == time + 400'000);
+    scheduler.on_sent(TxClass::NORMAL, 100, time + 300'000);
+    CHECK(scheduler.get_ready_time() == time + 500'000);
+    CHECK(scheduler.stats[(ubyte) TxClass::NORMAL].sent == 5);
+}
+
+int main() {
+    test_strict_priority();
+    test_queue_limit();
+    test_deficit_round_robin();
+    test_rate_and_pressure();
+    return test_result();
+}
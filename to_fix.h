@@ -1,8 +1,4 @@
 #pragma once
 
-#include <mesh_controller.h>
-
-inline MeshController* g_fresh_mesh;
-
 const int LOG_PACKET_POOL_ALLOC_PART_SIZE = 1024;
 const int LOG_PACKET_POOL_ALLOC_COUNT = 4;
@@ -0,0 +1,100 @@
+#include "tx_scheduler.h"
+#include "logical_device_manager.h"
+#include <algorithm>
+
+
+TxScheduler::~TxScheduler() {
+    clear();
+}
+
+bool TxScheduler::push(TxClass tx_class, OverlayPacketBuilder* packet) {
+    auto index = (ubyte) tx_class;
+    if (queues[index].size() >= config[index].queue_limit
+        || (KHAWASU_STATIC_MEMORY && total >= KHAWASU_MAX_IN_FLIGHT_PACKETS)) {
+        stats[index].dropped++;
+        delete packet;
+        return false;
+    }
+
+    queues[index].push_back(packet);
+    total++;
+    return true;
+}
+
+OverlayPacketBuilder* TxScheduler::pop(TxClass& tx_class) {
+    if (total == 0)
+        return nullptr;
+
+    if (mode == Mode::STRICT_PRIORITY) {
+        for (uint i = 0; i < TX_CLASS_COUNT; ++i) {
+            if (queues[i].empty())
+                continue;
+
+            auto packet = queues[i].front();
+            queues[i].pop_front();
+            total--;
+            tx_class = (TxClass) i;
+            return packet;
+        }
+    }
+
+    // deficit round robin, at least one queue isn't empty, so every round adds to its deficit
+    while (true) {
+        auto& queue = queues[current];
+        if (queue.empty()) {
+            deficits[current] = 0; // idle classes don't save up
+            current = (current + 1) % TX_CLASS_COUNT;
+            quantum_added = false;
+            continue;
+        }
+
+        if (!quantum_added) {
+            deficits[current] += std::max(config[current].quantum, 1u);
+            quantum_added = true;
+        }
+
+        auto packet = queue.front();
+        if (packet->size <= deficits[current]) {
+            deficits[current] -= packet->size;
+            queue.pop_front();
+            total--;
+            tx_class = (TxClass) current;
+            return packet;
+        }
+
+        current = (current + 1) % TX_CLASS_COUNT;
+        quantum_added = false;
+    }
+}
+
+void TxScheduler::on_sent(TxClass tx_class, uint size, u64 time) {
+    stats[(ubyte) tx_class].sent++;
+    if (rate)
+        next_send_time = std::max(next_send_time, time) + (u64) size * 1'000'000 / rate;
+
+    if (time - window_start >= PRESSURE_WINDOW) {
+        previous_window_bytes = time - window_start < 2 * PRESSURE_WINDOW ? window_bytes : 0;
+        window_bytes = 0;
+        window_start = time;
+    }
+    window_bytes += size;
+}
+
+uint TxScheduler::get_pressure(u64 time) const {
+    auto elapsed = time - window_start;
+    u64 recent_bytes = elapsed < PRESSURE_WINDOW ? window_bytes + previous_window_bytes
+                       : elapsed < 2 * PRESSURE_WINDOW ? window_bytes : 0;
+
+    // bytes the rate allows during two windows
+    auto share = std::max<u64>((u64) (rate ? rate : KHAWASU_TX_NOMINAL_RATE) * 2 * PRESSURE_WINDOW / 1'000'000, 1);
+    return total + (uint) (recent_bytes / share);
+}
+
+void TxScheduler::clear() {
+    for (auto& queue : queues) {
+        for (auto packet : queue)
+            delete packet;
+        queue.clear();
+    }
+    total = 0;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include "khawasu_config.h"
+#include "memory_accounting.h"
+#include "protocols/logical_proto.h"
+#include "types.h"
+
+// prioritized queue between LogicalDeviceManager::finish_ptr and the transport
+//
+// packets are sent right away while the transport is ready and nothing is queued, otherwise they wait in the queue
+// of their class and the manager hands them over as soon as the transport gets ready again (see
+// MeshTransport::get_ready_time and `rate`). a class whose queue is full drops new packets
+// with strict priority a lower class is served only when all higher ones are empty, with deficit round robin every
+// class gets bandwidth in proportion to its quantum, so bulk traffic isn't starved completely
+
+class OverlayPacketBuilder;
+
+enum class TxClass : ubyte
+{
+    INTERACTIVE = 0, // actions executed and fetched by users, their results
+    NORMAL,          // subscriptions, groups, multi-fetches
+    BULK,            // discovery and descriptors
+};
+
+const uint TX_CLASS_COUNT = 3;
+
+constexpr TxClass get_default_tx_class(LogicalProto::LogicalPacketType type) {
+    using LogicalProto::LogicalPacketType;
+    switch (type) {
+        case LogicalPacketType::ACTION_EXECUTE:
+        case LogicalPacketType::ACTION_EXECUTE_RESULT:
+        case LogicalPacketType::ACTION_FETCH:
+        case LogicalPacketType::ACTION_RESPONSE:
+        case LogicalPacketType::ACTION_EXECUTE_BATCH:
+        case LogicalPacketType::ACTION_EXECUTE_BATCH_RESULT:
+            return TxClass::INTERACTIVE;
+        case LogicalPacketType::HELLO_WORLD:
+        case LogicalPacketType::HELLO_WORLD_RESPONSE:
+        case LogicalPacketType::FIELD_DICTIONARY_REQUEST:
+        case LogicalPacketType::FIELD_DICTIONARY_RESPONSE:
+        case LogicalPacketType::HELLO_WORLD_COMPACT:
+        case LogicalPacketType::DESCRIPTOR_REQUEST:
+        case LogicalPacketType::DESCRIPTOR_RESPONSE:
+            return TxClass::BULK;
+        default:
+            return TxClass::NORMAL;
+    }
+}
+
+constexpr std::array<TxClass, LogicalProto::LOGICAL_PACKET_TYPE_COUNT> get_default_tx_classes() {
+    std::array<TxClass, LogicalProto::LOGICAL_PACKET_TYPE_COUNT> classes{};
+    for (uint type = 0; type < classes.size(); ++type)
+        classes[type] = get_default_tx_class((LogicalProto::LogicalPacketType) type);
+    return classes;
+}
+
+class TxScheduler
+{
+public:
+    enum class Mode : ubyte
+    {
+        STRICT_PRIORITY,
+        DEFICIT_ROUND_ROBIN,
+    };
+
+    struct ClassConfig
+    {
+        uint queue_limit; // packets
+        uint quantum;     // bytes per round, deficit round robin only
+    };
+
+    struct ClassStats
+    {
+        u64 sent = 0;
+        u64 dropped = 0;
+    };
+
+    Mode mode = Mode::STRICT_PRIORITY;
+    ClassConfig config[TX_CLASS_COUNT] = {
+        {KHAWASU_TX_QUEUE_INTERACTIVE, 1024},
+        {KHAWASU_TX_QUEUE_NORMAL, 512},
+        {KHAWASU_TX_QUEUE_BULK, 256},
+    };
+    ClassStats stats[TX_CLASS_COUNT];
+    uint rate = KHAWASU_TX_RATE; // bytes per second handed to the transport, zero - as fast as the transport takes them
+
+    TxScheduler() = default;
+    TxScheduler(const TxScheduler&) = delete;
+    TxScheduler& operator=(const TxScheduler&) = delete;
+
+    ~TxScheduler();
+
+    // takes ownership of the packet, returns false if it was dropped
+    bool push(TxClass tx_class, OverlayPacketBuilder* packet);
+
+    // next packet to send according to `mode`, nullptr if all queues are empty
+    OverlayPacketBuilder* pop(TxClass& tx_class);
+
+    // accounts a sent packet for `rate`
+    void on_sent(TxClass tx_class, uint size, u64 time);
+
+    // system time (us) when `rate` allows to send the next packet
+    inline u64 get_ready_time() const {
+        return next_send_time;
+    }
+
+    inline uint size() const {
+        return total;
+    }
+
+    // load of the tx path: queued packets, plus one for every share of `rate` (KHAWASU_TX_NOMINAL_RATE if there's no
+    // limit) sent during the last two windows. transports accepting every packet keep the queue empty, so the
+    // recent traffic is what tells a busy node from an idle one
+    uint get_pressure(u64 time) const;
+
+    inline bool empty() const {
+        return total == 0;
+    }
+
+    // drops every queued packet
+    void clear();
+
+private:
+    AccountedDeque<OverlayPacketBuilder*, MemoryArea::TX_QUEUE> queues[TX_CLASS_COUNT];
+    uint deficits[TX_CLASS_COUNT] = {};
+    ubyte current = 0;         // class being served by deficit round robin
+    bool quantum_added = false; // to the deficit of `current` during this round
+    uint total = 0;
+    u64 next_send_time = 0;
+
+    static constexpr u64 PRESSURE_WINDOW = 100'000; // us
+    u64 window_start = 0;          // system time, us
+    uint window_bytes = 0;
+    uint previous_window_bytes = 0;
+};